@@ -0,0 +1,36 @@
+-- Selection time of a single large median state with and without huge pages.
+--
+-- Run with
+--   psql -X -f bench/hugepages.sql > bench_output.txt
+--
+-- Transparent huge pages must be enabled in "madvise" or "always" mode
+-- (/sys/kernel/mm/transparent_hugepage/enabled) for the advice to have any
+-- effect. The state holds 8 bytes per value, so the 400M rows below make a
+-- 3.2GB values array; scale the series down on smaller machines.
+
+\timing on
+
+CREATE EXTENSION IF NOT EXISTS median;
+
+DROP TABLE IF EXISTS bench_hugepages;
+CREATE UNLOGGED TABLE bench_hugepages AS
+SELECT random() AS val FROM generate_series(1, 400000000);
+VACUUM ANALYZE bench_hugepages;
+
+SET max_parallel_workers_per_gather = 0;
+SET work_mem = '16GB';
+
+-- Baseline scan cost, to subtract from the median timings
+SELECT count(val) FROM bench_hugepages;
+
+-- Regular palloc'd state
+SET median.hugepage_threshold = -1;
+SELECT median(val) FROM bench_hugepages;
+SELECT median(val) FROM bench_hugepages;
+
+-- Huge-page backed state
+SET median.hugepage_threshold = '64MB';
+SELECT median(val) FROM bench_hugepages;
+SELECT median(val) FROM bench_hugepages;
+
+DROP TABLE bench_hugepages;
@@ -0,0 +1,64 @@
+-- Scan time of median() with and without the JIT inlining its transition.
+--
+-- Run with
+--   psql -X -f bench/jit.sql > bench_output.txt
+--
+-- The server must be built with LLVM and the extension installed with its
+-- bitcode (make install does that for such servers), otherwise the last two
+-- runs do not differ from the first. The table holds 100M rows, for a state
+-- of 800MB; scale the series down on smaller machines. The last query dumps
+-- the compiled code, which needs a superuser.
+
+\timing on
+
+CREATE EXTENSION IF NOT EXISTS median;
+
+DROP TABLE IF EXISTS bench_jit;
+CREATE UNLOGGED TABLE bench_jit AS
+SELECT (random() * 1e9)::int8 AS val FROM generate_series(1, 100000000);
+VACUUM ANALYZE bench_jit;
+
+SET max_parallel_workers_per_gather = 0;
+SET work_mem = '4GB';
+SET median.hugepage_threshold = -1;
+-- MedianScan plans call no transition function to compile
+SET median.enable_medianscan = off;
+
+-- Baseline scan cost, to subtract from the median timings
+SELECT count(val) FROM bench_jit;
+
+-- Interpreted transitions
+SET jit = off;
+SELECT median(val) FROM bench_jit;
+SELECT median(val) FROM bench_jit;
+
+-- Compiled, median_transfn called through its function pointer
+SET jit = on;
+SET jit_above_cost = 0;
+SET jit_inline_above_cost = -1;
+SELECT median(val) FROM bench_jit;
+SELECT median(val) FROM bench_jit;
+
+-- Compiled with median_transfn inlined
+SET jit_inline_above_cost = 0;
+SELECT median(val) FROM bench_jit;
+SELECT median(val) FROM bench_jit;
+
+-- The JIT section of the plan shows whether inlining took place
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF)
+SELECT median(val) FROM bench_jit;
+
+-- "Inlining true" only says that inlining was attempted. To see that
+-- median_transfn itself went into the transition step, this writes the
+-- modules to <pid>.<n>.bc and <pid>.<n>.optimized.bc in the data directory.
+-- In
+--   llvm-dis -o - <pid>.<n>.optimized.bc | grep -E 'call .*median_transfn'
+-- only calls of median_transfn_slow remain once it is inlined. When it is
+-- not, with jit_inline_above_cost = -1 or without
+-- $libdir/bitcode/median/median.bc, the call of median_transfn is left, as
+-- "pgextern.$libdir/median.median_transfn".
+SET jit_dump_bitcode = on;
+SELECT median(val) FROM bench_jit;
+RESET jit_dump_bitcode;
+
+DROP TABLE bench_jit;
@@ -0,0 +1,61 @@
+-- Memory taken by median states, per type, group size and group count.
+--
+-- Run with
+--   psql -X -f bench/memory.sql > bench_output.txt
+--
+-- The first part reports what median_footprint() counts for the states of
+-- each grouping: the Datum array or text slots, the room doubling left unused
+-- in them and the copies of by-reference values, all with allocator overhead.
+-- The second part runs the same groupings through median() under EXPLAIN
+-- ANALYZE with median.explain on, whose "Peak Context Bytes" is the memory
+-- context holding the largest state, everything the aggregate allocated
+-- included. The table has 1M rows; scale the series to taste.
+
+CREATE EXTENSION IF NOT EXISTS median;
+
+DROP TABLE IF EXISTS bench_memory;
+CREATE UNLOGGED TABLE bench_memory AS
+SELECT g AS id,
+       (random() * 1e9)::int4 AS v_int4,
+       (random() * 1e15)::int8 AS v_int8,
+       random() AS v_float8,
+       (random() * 1e6)::numeric(12, 4) AS v_numeric,
+       left(md5(g::text), 8) AS v_text_short,
+       md5(g::text) || md5((g + 1)::text) AS v_text_long,
+       now() - random() * interval '365 days' AS v_timestamptz
+FROM generate_series(1, 1000000) g;
+VACUUM ANALYZE bench_memory;
+
+SET max_parallel_workers_per_gather = 0;
+SET work_mem = '4GB';
+
+-- Bytes per value of the states, by type and number of groups
+SELECT format($q$
+SELECT %L AS type, %s AS groups,
+       round(avg((f).value_count)) AS values_per_group,
+       round(avg((f).bytes_per_value)::numeric, 1) AS bytes_per_value,
+       sum((f).array_bytes) AS array_bytes,
+       sum((f).slack_bytes) AS slack_bytes,
+       sum((f).value_bytes) AS value_bytes,
+       sum((f).total_bytes) AS total_bytes
+FROM (SELECT median_footprint(%I) AS f
+      FROM bench_memory GROUP BY id %% %s) s
+$q$, col, groups, col, groups)
+FROM unnest(ARRAY['v_int4', 'v_int8', 'v_float8', 'v_numeric',
+                  'v_text_short', 'v_text_long', 'v_timestamptz']) col,
+     unnest(ARRAY[1, 100, 10000]) groups
+\gexec
+
+-- Peak memory context size of median() itself
+SET median.explain = on;
+
+SELECT format($q$
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF)
+SELECT median(%I) FROM bench_memory GROUP BY id %% %s
+$q$, col, groups)
+FROM unnest(ARRAY['v_int4', 'v_int8', 'v_float8', 'v_numeric',
+                  'v_text_short', 'v_text_long', 'v_timestamptz']) col,
+     unnest(ARRAY[1, 100, 10000]) groups
+\gexec
+
+DROP TABLE bench_memory;
@@ -0,0 +1,62 @@
+-- Scan time of median() as a MedianScan and as a Seq Scan under an Aggregate.
+--
+-- Run with
+--   psql -X -f bench/scan.sql > bench_output.txt
+--
+-- Every query runs twice, the second run with the table cached. The table
+-- holds 100M rows of a few columns, so that the aggregated one is not the
+-- only one to deform; scale the series down on smaller machines. The plan
+-- printed ahead of each set of timings shows which scan they are for.
+
+\timing on
+
+CREATE EXTENSION IF NOT EXISTS median;
+
+DROP TABLE IF EXISTS bench_scan;
+CREATE UNLOGGED TABLE bench_scan AS
+SELECT g AS id,
+       (random() * 1e9)::int4 AS v_int4,
+       random() AS v_float8,
+       md5(g::text) AS note
+FROM generate_series(1, 100000000) g;
+VACUUM ANALYZE bench_scan;
+
+SET work_mem = '4GB';
+SET max_parallel_workers_per_gather = 0;
+
+-- Baseline scan cost
+SELECT count(v_float8) FROM bench_scan;
+SELECT count(v_float8) FROM bench_scan;
+
+-- Seq Scan and Aggregate
+SET median.enable_medianscan = off;
+EXPLAIN (COSTS OFF) SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_int4) FROM bench_scan WHERE id % 10 <> 0;
+SELECT median(v_int4) FROM bench_scan WHERE id % 10 <> 0;
+
+-- MedianScan
+SET median.enable_medianscan = on;
+EXPLAIN (COSTS OFF) SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_int4) FROM bench_scan WHERE id % 10 <> 0;
+SELECT median(v_int4) FROM bench_scan WHERE id % 10 <> 0;
+
+-- Parallel plans of both
+SET max_parallel_workers_per_gather = 4;
+SET median.enable_medianscan = off;
+EXPLAIN (COSTS OFF) SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+SET median.enable_medianscan = on;
+EXPLAIN (COSTS OFF) SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+SELECT median(v_float8) FROM bench_scan;
+
+-- Rows and workers of the last plan, to check that it ran as planned
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF)
+SELECT median(v_float8) FROM bench_scan;
+
+DROP TABLE bench_scan;
@@ -49,3 +49,466 @@ CREATE AGGREGATE median (ANYELEMENT)
     DESERIALFUNC = _median_deserialfunc,
     PARALLEL = SAFE
 );
+
+CREATE OR REPLACE FUNCTION _median_chunks_transfn(state internal, vals anyarray)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_chunks_transfn'
+PARALLEL SAFE
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION _median_chunks_finalfn(state internal, vals anyarray)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'median_finalfn'
+PARALLEL SAFE
+LANGUAGE C IMMUTABLE;
+
+DROP AGGREGATE IF EXISTS median_chunks (ANYARRAY);
+CREATE AGGREGATE median_chunks (ANYARRAY)
+(
+    sfunc = _median_chunks_transfn,
+    stype = internal,
+    finalfunc = _median_chunks_finalfn,
+    finalfunc_extra,
+    COMBINEFUNC = _median_combinefunc,
+    SERIALFUNC = _median_serialfunc,
+    DESERIALFUNC = _median_deserialfunc,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION _median_state_finalfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'median_state_finalfn'
+PARALLEL SAFE
+LANGUAGE C IMMUTABLE;
+
+DROP AGGREGATE IF EXISTS median_state_agg (ANYELEMENT);
+CREATE AGGREGATE median_state_agg (ANYELEMENT)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    finalfunc = _median_state_finalfn,
+    COMBINEFUNC = _median_combinefunc,
+    SERIALFUNC = _median_serialfunc,
+    DESERIALFUNC = _median_deserialfunc,
+    PARALLEL = SAFE
+);
+
+CREATE TYPE median_footprint AS (
+    value_count int8,
+    state_bytes int8,
+    array_bytes int8,
+    slack_bytes int8,
+    value_bytes int8,
+    total_bytes int8,
+    bytes_per_value float8
+);
+
+CREATE OR REPLACE FUNCTION _median_footprint_finalfn(state internal)
+RETURNS median_footprint
+AS 'MODULE_PATHNAME', 'median_footprint_finalfn'
+PARALLEL SAFE
+LANGUAGE C IMMUTABLE;
+
+DROP AGGREGATE IF EXISTS median_footprint (ANYELEMENT);
+CREATE AGGREGATE median_footprint (ANYELEMENT)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    finalfunc = _median_footprint_finalfn,
+    COMBINEFUNC = _median_combinefunc,
+    SERIALFUNC = _median_serialfunc,
+    DESERIALFUNC = _median_deserialfunc,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION median_state_merge(state1 bytea, state2 bytea)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'median_state_merge'
+PARALLEL SAFE
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION median_state_value(state bytea, type_hint anyelement)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'median_state_value'
+PARALLEL SAFE
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION median_track(name text, value float8)
+RETURNS void
+AS 'MODULE_PATHNAME', 'median_track'
+PARALLEL SAFE
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_tracked(name text, fraction float8 DEFAULT 0.5)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'median_tracked'
+PARALLEL SAFE
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_tracked_reset(name text DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'median_tracked_reset'
+PARALLEL SAFE
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_tracked_snapshot(
+    OUT name text,
+    OUT count int8,
+    OUT p50 float8,
+    OUT p90 float8,
+    OUT p99 float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'median_tracked_snapshot'
+PARALLEL SAFE
+LANGUAGE C STRICT VOLATILE;
+
+CREATE TABLE median_registry (
+    relid regclass NOT NULL,
+    attname name NOT NULL,
+    atttypid regtype,
+    relfilenode oid,
+    changes int8,
+    snapshot_xmin xid,
+    snapshot_xmax xid,
+    snapshot_xip xid[],
+    state bytea,
+    median text,
+    refreshed_at timestamptz,
+    PRIMARY KEY (relid, attname)
+);
+SELECT pg_catalog.pg_extension_config_dump('median_registry', '');
+
+CREATE OR REPLACE FUNCTION median_register(rel regclass, col name)
+RETURNS void
+AS 'MODULE_PATHNAME', 'median_register'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_unregister(rel regclass, col name)
+RETURNS void
+AS 'MODULE_PATHNAME', 'median_unregister'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_registered(rel regclass, col name,
+                                             max_staleness interval DEFAULT NULL)
+RETURNS text
+AS 'MODULE_PATHNAME', 'median_registered'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_registry_refresh(rel regclass DEFAULT NULL,
+                                                   col name DEFAULT NULL)
+RETURNS int4
+AS 'MODULE_PATHNAME', 'median_registry_refresh'
+LANGUAGE C VOLATILE;
+
+CREATE TABLE median_ostat (
+    relid regclass NOT NULL,
+    attname name NOT NULL,
+    values_table regclass NOT NULL,
+    buckets_table regclass NOT NULL,
+    bucket_size int4 NOT NULL,
+    PRIMARY KEY (relid, attname)
+);
+SELECT pg_catalog.pg_extension_config_dump('median_ostat', '');
+
+CREATE OR REPLACE FUNCTION median_ostat_trigger()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'median_ostat_trigger'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION median_ostat_create(rel regclass, col name,
+                                               bucket_size int4 DEFAULT 1024)
+RETURNS void
+AS 'MODULE_PATHNAME', 'median_ostat_create'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_ostat_drop(rel regclass, col name)
+RETURNS void
+AS 'MODULE_PATHNAME', 'median_ostat_drop'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_ostat_rebalance(rel regclass, col name)
+RETURNS int4
+AS 'MODULE_PATHNAME', 'median_ostat_rebalance'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION median_of(rel regclass, col name)
+RETURNS text
+AS 'MODULE_PATHNAME', 'median_of'
+LANGUAGE C STRICT STABLE;
+
+CREATE TABLE median_partition_cache (
+    partition regclass NOT NULL,
+    attname name NOT NULL,
+    atttypid regtype NOT NULL,
+    relfilenode oid NOT NULL,
+    changes int8 NOT NULL,
+    stats_reset timestamptz NOT NULL,
+    state bytea NOT NULL,
+    computed_at timestamptz NOT NULL,
+    PRIMARY KEY (partition, attname)
+);
+
+CREATE OR REPLACE FUNCTION median_cached(parent regclass, col name)
+RETURNS text
+AS 'MODULE_PATHNAME', 'median_cached'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION file_median(path text, col int4,
+                                       format text DEFAULT 'csv',
+                                       header bool DEFAULT false)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'file_median'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE TYPE median_bucket AS (
+    bucket timestamptz,
+    median float8
+);
+
+CREATE OR REPLACE FUNCTION _bucketed_medians_transfn(state internal, ts timestamptz,
+                                                     val float8, width interval)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'bucketed_medians_transfn'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION _bucketed_medians_finalfn(state internal, ts timestamptz,
+                                                     val float8, width interval)
+RETURNS median_bucket[]
+AS 'MODULE_PATHNAME', 'bucketed_medians_finalfn'
+LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE bucketed_medians (timestamptz, float8, interval)
+(
+    sfunc = _bucketed_medians_transfn,
+    stype = internal,
+    finalfunc = _bucketed_medians_finalfn,
+    finalfunc_extra
+);
+
+CREATE OR REPLACE FUNCTION _equi_depth_histogram_transfn(state internal, val anyelement,
+                                                         buckets int4)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'equi_depth_histogram_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _equi_depth_histogram_finalfn(state internal, val anyelement,
+                                                         buckets int4)
+RETURNS anyarray
+AS 'MODULE_PATHNAME', 'equi_depth_histogram_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _equi_depth_histogram_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'equi_depth_histogram_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _equi_depth_histogram_serialfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'equi_depth_histogram_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _equi_depth_histogram_deserialfn(state bytea, dummy internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'equi_depth_histogram_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE equi_depth_histogram (anyelement, int4)
+(
+    sfunc = _equi_depth_histogram_transfn,
+    stype = internal,
+    finalfunc = _equi_depth_histogram_finalfn,
+    finalfunc_extra,
+    COMBINEFUNC = _equi_depth_histogram_combinefn,
+    SERIALFUNC = _equi_depth_histogram_serialfn,
+    DESERIALFUNC = _equi_depth_histogram_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION median_state_sort(state bytea)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'median_state_sort'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_rank(sorted bytea, val anyelement)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'median_state_rank'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE median_state;
+
+CREATE OR REPLACE FUNCTION median_state_in(cstring)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'median_state_in'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_out(median_state)
+RETURNS cstring
+AS 'byteaout'
+LANGUAGE internal IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE median_state (
+    INPUT = median_state_in,
+    OUTPUT = median_state_out,
+    INTERNALLENGTH = VARIABLE,
+    STORAGE = extended
+);
+
+CREATE OR REPLACE FUNCTION median_state(bytea)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'median_state_from_bytea'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (bytea AS median_state) WITH FUNCTION median_state(bytea);
+CREATE CAST (median_state AS bytea) WITHOUT FUNCTION;
+
+CREATE OR REPLACE FUNCTION median_state_add(state median_state, val anyelement)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'median_state_append'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_result(state median_state)
+RETURNS text
+AS 'MODULE_PATHNAME', 'median_state_result'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_export(state bytea)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'median_state_export'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_import(data bytea)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'median_state_import'
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_transfn(state internal, val float8)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_invfn(state internal, val float8)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_invfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_finalfn(state internal)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'approx_median_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_serialfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'approx_median_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_deserialfn(state bytea, dummy internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE approx_median (float8)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    finalfunc = _approx_median_finalfn,
+    COMBINEFUNC = _approx_median_combinefn,
+    SERIALFUNC = _approx_median_serialfn,
+    DESERIALFUNC = _approx_median_deserialfn,
+    MSFUNC = _approx_median_transfn,
+    MINVFUNC = _approx_median_invfn,
+    MSTYPE = internal,
+    MFINALFUNC = _approx_median_finalfn,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION _median_ci_transfn(state internal, val anyelement,
+                                              confidence float8)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_ci_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_ci_finalfn(state internal, val anyelement,
+                                              confidence float8)
+RETURNS anyarray
+AS 'MODULE_PATHNAME', 'median_ci_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_ci_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_ci_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_ci_serialfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'median_ci_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_ci_deserialfn(state bytea, dummy internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_ci_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE median_ci (anyelement, float8)
+(
+    sfunc = _median_ci_transfn,
+    stype = internal,
+    finalfunc = _median_ci_finalfn,
+    finalfunc_extra,
+    COMBINEFUNC = _median_ci_combinefn,
+    SERIALFUNC = _median_ci_serialfn,
+    DESERIALFUNC = _median_ci_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION sampled_median(rel regclass, col name, percent float8,
+                                          OUT median text,
+                                          OUT lower text,
+                                          OUT upper text,
+                                          OUT sampled_blocks int8,
+                                          OUT total_blocks int8,
+                                          OUT sampled_rows int8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'sampled_median'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION _sorted_array_agg_transfn(state internal, val anyelement)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'sorted_array_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _sorted_array_agg_finalfn(state internal, val anyelement)
+RETURNS anyarray
+AS 'MODULE_PATHNAME', 'sorted_array_agg_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _sorted_array_agg_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'sorted_array_agg_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _sorted_array_agg_serialfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'sorted_array_agg_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _sorted_array_agg_deserialfn(state bytea, dummy internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'sorted_array_agg_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE sorted_array_agg (anyelement)
+(
+    sfunc = _sorted_array_agg_transfn,
+    stype = internal,
+    finalfunc = _sorted_array_agg_finalfn,
+    finalfunc_extra,
+    COMBINEFUNC = _sorted_array_agg_combinefn,
+    SERIALFUNC = _sorted_array_agg_serialfn,
+    DESERIALFUNC = _sorted_array_agg_deserialfn,
+    PARALLEL = SAFE
+);
@@ -1,20 +1,32 @@
 #include <postgres.h>
 #include <fmgr.h>
 
+#include <sys/mman.h>
+
 #include "access/htup_details.h"
+#include "access/parallel.h"
 #include "access/nbtree.h"
 #include "access/stratnum.h"
+#include "access/tuptoaster.h"
 #include "catalog/pg_operator.h"
 #include "catalog/pg_opfamily.h"
 #include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/datum.h"
 #include "utils/elog.h"
+#include "utils/guc.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/syscache.h"
 #include "utils/typcache.h"
 
+#include "median.h"
+
 
 #if PG_VERSION_NUM < 120000 || PG_VERSION_NUM >= 130000
 #error "Unsupported PostgreSQL version. Use version 12."
@@ -24,62 +36,205 @@
 PG_MODULE_MAGIC;
 #endif
 
-typedef struct MedianState
+/*
+ * Huge-page backed values arrays are only available where the kernel lets us
+ * advise a mapping to use transparent huge pages.
+ */
+#if defined(MADV_HUGEPAGE) && defined(MAP_ANONYMOUS)
+#define USE_MEDIAN_HUGEPAGES
+#define MEDIAN_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+#endif
+
+/*
+ * States of up to this many values are serialized in the compact format, see
+ * median_state_serialize.
+ */
+#define MEDIAN_COMPACT_MAX_COUNT	PG_UINT8_MAX
+
+/*
+ * Long strings discarded from a moving text state are reclaimed once there are
+ * at least this many bytes of them, see compact_strings_median_state.
+ */
+#define MEDIAN_ARENA_MIN_DEAD_BYTES	(64 * 1024)
+
+struct MedianState
 {
 	Oid			inputTypeId;	/* OID of the input data type */
 	int64		count;			/* number of non-null inputs seen */
 	int64		allocated;		/* allocated size of values array */
 	Datum	   *values;			/* array of input values */
+	MedianTextSlot *slots;		/* text values instead, or NULL */
 	TypeCacheEntry *typentry;	/* info about the comparison function */
-} MedianState;
-
-static MedianState *init_median_state(FunctionCallInfo fcinfo);
-static TypeCacheEntry *get_type_comp_method(Oid type_oid);
+	bool		values_embedded;	/* array allocated along with the state */
+	bool		values_copied;	/* by-reference values are chunks of their own */
+	bool		fast_add;		/* median_transfn may append values itself */
+	MemoryContext arena;		/* long strings of a moving text state, or NULL */
+	int64		arena_bytes;	/* memory of arena */
+	int64		dead_bytes;		/* long strings discarded since compaction */
+	int64		compacted_bytes;	/* long strings kept by the last compaction */
+	int64		value_bytes;	/* memory of the by-reference values kept */
+	Size		mmap_size;		/* mapped size of values, 0 if palloc'd */
+	MemoryContextCallback mmap_callback;	/* unmaps values on reset */
+	MedianAggStats *stats;		/* EXPLAIN statistics, or NULL */
+};
+
+/* GUC variables */
+static int	median_hugepage_threshold = 1024 * 1024;	/* kB, -1 disables */
+static int	median_finalize_threads = 0;	/* 0 keeps the qsort path */
+static int	median_finalize_workers = 0;	/* 0 disables parallel finalize */
+static int	median_finalize_workers_threshold = 100000000;
+
+void		_PG_init(void);
+
+static MedianState *init_median_state(FunctionCallInfo fcinfo,
+									  Oid inputTypeId);
+extern Datum median_transfn_slow(FunctionCallInfo fcinfo);
+static MedianState *create_median_state(Oid inputTypeId,
+										TypeCacheEntry *typentry,
+										int64 allocated);
+static TypeCacheEntry *cached_type_comp_method(MedianCallCache *cache,
+											   Oid type_oid);
+static MedianState *deserialize_median_state_bytes(bytea *state_bytes,
+												   MedianCallCache *cache,
+												   bool trusted);
+static void check_serialized_bytes(const char *p, const char *end, Size size);
+static void check_string(const char *data, int len);
+static Size serialized_size_varlena(Datum value);
+static void write_byval_value(char *p, Datum value, int16 typlen);
+static Datum read_byval_value(const char *p, int16 typlen);
 static int	datum_qsort_compare(const void *a, const void *b, void *arg);
+static Datum select_median(MedianState *state, const char **strategy);
 static Datum calculate_median(MedianState *state);
-static Datum calculate_average(Oid inputTypeId, Datum left, Datum right);
+static void select_ranks_median_state(MedianState *state, int64 lo, int64 hi,
+									  const int64 *ranks, int nranks,
+									  Datum *results);
+static Datum calculate_median_byval(MedianState *state, MedianKeyKind kind);
+static bool calculate_median_parallel(MedianState *state, MedianKeyKind kind,
+									  Datum *result);
 static void add_input_element_median_state(MedianState *state, Datum newVal);
+static void add_array_median_state(MedianState *state, ArrayType *array);
 static void discard_element_median_state(MedianState *state, Datum datum);
+static void alloc_values_median_state(MedianState *state, int64 allocated);
+static void grow_values_median_state(MedianState *state, int64 allocated);
+static void reserve_values_median_state(MedianState *state, int64 count);
+static void materialize_median_state(MedianState *state);
+static void compact_strings_median_state(MedianState *state);
+static int64 state_bytes_median_state(MedianState *state);
+static int64 array_bytes_median_state(MedianState *state);
+static int64 context_bytes(MemoryContext context);
+static void accum_time_median_stats(instr_time *total, instr_time start);
+#ifdef USE_MEDIAN_HUGEPAGES
+static bool mmap_values_median_state(MedianState *state, int64 allocated);
+static void unmap_values_median_state(void *arg);
+#endif
 
 
 PG_FUNCTION_INFO_V1(median_transfn);
+PG_FUNCTION_INFO_V1(median_chunks_transfn);
 PG_FUNCTION_INFO_V1(median_mtransfn);
 PG_FUNCTION_INFO_V1(median_finalfn);
 PG_FUNCTION_INFO_V1(combine_median_state);
 PG_FUNCTION_INFO_V1(serialize_median_state);
 PG_FUNCTION_INFO_V1(deserialize_median_state);
+PG_FUNCTION_INFO_V1(median_state_finalfn);
+PG_FUNCTION_INFO_V1(median_state_merge);
+PG_FUNCTION_INFO_V1(median_state_value);
+PG_FUNCTION_INFO_V1(median_footprint_finalfn);
 
 
+/*
+ * _PG_init
+ *
+ * Module load callback, defines the GUCs of the extension.
+ */
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("median.hugepage_threshold",
+							"Size above which a median state is kept in huge pages.",
+							"States whose values array grows beyond this size are "
+							"moved to an anonymous mapping advised with MADV_HUGEPAGE. "
+							"-1 disables huge-page backed states.",
+							&median_hugepage_threshold,
+							1024 * 1024,
+							-1, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("median.finalize_threads",
+							"Number of threads used to select the median of by-value types.",
+							"With a value of 1 or more, medians of integer, float, "
+							"date and timestamp types are found with radix "
+							"selection instead of sorting, using this many threads "
+							"for the counting passes. 0 disables radix selection.",
+							&median_finalize_threads,
+							0,
+							0, 128,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("median.finalize_workers",
+							"Number of background workers used to select the median of huge by-value states.",
+							"States of integer, float, date and timestamp types with "
+							"at least median.finalize_workers_threshold values are "
+							"copied to dynamic shared memory and selected on by up to "
+							"this many dynamic background workers. 0 disables it.",
+							&median_finalize_workers,
+							0,
+							0, 64,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("median.finalize_workers_threshold",
+							"Minimum number of values for background worker selection.",
+							NULL,
+							&median_finalize_workers_threshold,
+							100000000,
+							0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	median_explain_init();
+	median_track_init();
+	median_registry_init();
+	median_scan_init();
+}
+
 
 /*
  * init_median_state
  *
- * Iniitalize the median state.
+ * Iniitalize the median state for values of the given type.
  */
 static MedianState *
-init_median_state(FunctionCallInfo fcinfo)
+init_median_state(FunctionCallInfo fcinfo, Oid inputTypeId)
 {
 	MemoryContext agg_context;
 	MemoryContext old_context;
 	MedianState *state;
-	Oid			inputTypeId;
+	TypeCacheEntry *typentry;
 
 	if (!AggCheckCallContext(fcinfo, &agg_context))
 		elog(ERROR, "median_transfn called in non-aggregate context");
 
-	old_context = MemoryContextSwitchTo(agg_context);
-
-	/* First call, initialize the state */
-	inputTypeId = get_fn_expr_argtype(fcinfo->flinfo, 1);
 	if (inputTypeId == InvalidOid)
 		elog(ERROR, "could not determine input data type");
 
-	state = (MedianState *) palloc(sizeof(MedianState));
-	state->inputTypeId = inputTypeId;
-	state->allocated = 8;
-	state->count = 0;
-	state->values = (Datum *) palloc(state->allocated * sizeof(Datum));
-	state->typentry = (TypeCacheEntry *) get_type_comp_method(inputTypeId);
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	/* The type cache lookup is done once per call site, not per group */
+	typentry = cached_type_comp_method(median_call_cache(fcinfo), inputTypeId);
+	state = create_median_state(inputTypeId, typentry, 8);
+	state->stats = median_explain_stats(fcinfo, inputTypeId);
+	if (state->stats != NULL)
+	{
+		state->stats->states_created++;
+		state->fast_add = false;
+	}
 
 	MemoryContextSwitchTo(old_context);
 	return state;
@@ -91,22 +246,92 @@ init_median_state(FunctionCallInfo fcinfo)
  * This function is called for every value in the set that we are calculating
  * the median for. On first call, the aggregate state, if any, needs to be
  * initialized.
+ *
+ * Only the common case of a by-value input going into an existing state that
+ * has room for it is handled here, which keeps the function small and free of
+ * calls, so that the JIT can inline it into the transition step of the
+ * aggregate. Everything else is left to median_transfn_slow.
  */
 Datum
 median_transfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state = (MedianState *) PG_GETARG_POINTER(0);
+
+	if (likely(!PG_ARGISNULL(0) && !PG_ARGISNULL(1) && state->fast_add &&
+			   state->count < state->allocated))
+	{
+		state->values[state->count++] = PG_GETARG_DATUM(1);
+		PG_RETURN_POINTER(state);
+	}
+
+	return median_transfn_slow(fcinfo);
+}
+
+/*
+ * median_transfn_slow
+ *
+ * The rest of median_transfn: creating the state, growing it, copying by-
+ * reference values and timing for EXPLAIN. Not static, as a copy of
+ * median_transfn inlined by the JIT calls it from outside of this module.
+ */
+pg_noinline Datum
+median_transfn_slow(FunctionCallInfo fcinfo)
 {
 	MedianState *state;
+	instr_time	start;
 
 	state = PG_ARGISNULL(0) ? NULL : (MedianState *) PG_GETARG_POINTER(0);
 
 	/* Create the state data on the first call */
 	if (state == NULL)
-		state = init_median_state(fcinfo);
+		state = init_median_state(fcinfo,
+								  get_fn_expr_argtype(fcinfo->flinfo, 1));
 	else
 		state = (MedianState *) PG_GETARG_POINTER(0);
 
+	INSTR_TIME_SET_ZERO(start);
+	if (state->stats != NULL)
+		INSTR_TIME_SET_CURRENT(start);
+
+	if (!PG_ARGISNULL(1))
+		median_state_add(state, PG_GETARG_DATUM(1));
+
+	if (state->stats != NULL)
+		accum_time_median_stats(&state->stats->trans_time, start);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * median_chunks_transfn
+ *
+ * Transition function of median_chunks, adding all non-null elements of an
+ * array to the state.
+ */
+Datum
+median_chunks_transfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+	instr_time	start;
+
+	state = PG_ARGISNULL(0) ? NULL : (MedianState *) PG_GETARG_POINTER(0);
+
+	if (state == NULL)
+	{
+		Oid			arrayTypeId = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+		state = init_median_state(fcinfo, get_element_type(arrayTypeId));
+	}
+
+	INSTR_TIME_SET_ZERO(start);
+	if (state->stats != NULL)
+		INSTR_TIME_SET_CURRENT(start);
+
 	if (!PG_ARGISNULL(1))
-		add_input_element_median_state(state, PG_GETARG_DATUM(1));
+		add_array_median_state(state, PG_GETARG_ARRAYTYPE_P(1));
+
+	if (state->stats != NULL)
+		accum_time_median_stats(&state->stats->trans_time, start);
 
 	PG_RETURN_POINTER(state);
 }
@@ -122,17 +347,40 @@ Datum
 median_finalfn(PG_FUNCTION_ARGS)
 {
 	MedianState *state;
+	const char *strategy;
+	instr_time	start;
+	Datum		result;
+	int64		state_bytes;
 
 	state = PG_ARGISNULL(0) ? NULL : (MedianState *) PG_GETARG_POINTER(0);
 
 	if (state == NULL || state->count == 0)
 		PG_RETURN_NULL();
 
-	/* Sort the array */
-	qsort_arg(state->values, state->count, sizeof(Datum),
-			  datum_qsort_compare, state->typentry);
+	if (state->stats == NULL)
+		return select_median(state, &strategy);
 
-	return calculate_median(state);
+	INSTR_TIME_SET_CURRENT(start);
+	result = select_median(state, &strategy);
+	accum_time_median_stats(&state->stats->final_time, start);
+
+	state->stats->strategy = strategy;
+
+	/*
+	 * Walking the memory context is not free, so it is only measured along
+	 * with the largest state. With hashed grouping all states are there by the
+	 * first finalize, with sorted grouping the largest group is what counts.
+	 */
+	state_bytes = state_bytes_median_state(state);
+	if (state_bytes > state->stats->peak_state_bytes)
+	{
+		state->stats->peak_state_bytes = state_bytes;
+		state->stats->peak_context_bytes =
+			Max(state->stats->peak_context_bytes,
+				context_bytes(GetMemoryChunkContext(state)));
+	}
+
+	return result;
 }
 
 /*
@@ -173,7 +421,7 @@ combine_median_state(PG_FUNCTION_ARGS)
 	MedianState *state2;
 	MemoryContext agg_context;
 	MemoryContext old_context;
-	int			i = 0;
+	instr_time	start;
 
 	if (!AggCheckCallContext(fcinfo, &agg_context))
 		elog(ERROR, "aggregate function called in non-aggregate context");
@@ -184,30 +432,41 @@ combine_median_state(PG_FUNCTION_ARGS)
 	if (state2 == NULL)
 		PG_RETURN_POINTER(state1);
 
-	/* manually copy all fields from state2 to state1 */
+	INSTR_TIME_SET_ZERO(start);
+	if (state2->stats != NULL)
+		INSTR_TIME_SET_CURRENT(start);
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	/* Take over state2 into a new state */
 	if (state1 == NULL)
 	{
-		old_context = MemoryContextSwitchTo(agg_context);
-		state1 = (MedianState *) palloc0(sizeof(MedianState));
-		state1->inputTypeId = state2->inputTypeId;
-		state1->count = state2->count;
-		state1->allocated = state2->allocated;
-		state1->values = palloc(state2->allocated * sizeof(Datum));
-		state1->typentry = palloc(sizeof(TypeCacheEntry));
-		memcpy(state1->values, state2->values, state2->count * sizeof(Datum));
-		memcpy(state1->typentry, state2->typentry, sizeof(TypeCacheEntry));
+		state1 = create_median_state(state2->inputTypeId, state2->typentry,
+									 state2->count + 1);
+		state1->stats = state2->stats;
+		if (state1->stats != NULL)
+			state1->fast_add = false;
+		median_state_combine(state1, state2);
 		MemoryContextSwitchTo(old_context);
+
+		if (state1->stats != NULL)
+		{
+			state1->stats->states_created++;
+			accum_time_median_stats(&state1->stats->combine_time, start);
+		}
 		PG_RETURN_POINTER(state1);
 	}
 
-	old_context = MemoryContextSwitchTo(agg_context);
-	/* only copy datum values */
-	for (i = 0; i < state2->count; ++i)
-	{
-		add_input_element_median_state(state1, state2->values[i]);
-	}
+	if (state1->stats != NULL && state2->stats == NULL)
+		INSTR_TIME_SET_CURRENT(start);
+
+	median_state_combine(state1, state2);
 
 	MemoryContextSwitchTo(old_context);
+
+	if (state1->stats != NULL)
+		accum_time_median_stats(&state1->stats->combine_time, start);
+
 	PG_RETURN_POINTER(state1);
 }
 
@@ -215,25 +474,12 @@ combine_median_state(PG_FUNCTION_ARGS)
  * serialize_median_state
  *		Serialize MedianState into bytea
  *
- * First we serialize the fixed length fields, and then we traverse each datum
- * based on the datatype we serialize each datum. Before each Datum, serialize a
- * single byte (char) indicating whether the datum is NULL (1) or not (0).
- * TODO: For large datasets, a more efficient null representation (like a
- * bitmap) might be preferable.
- *
- * We do not seralize TypeCacheEntry as this can be genrated during
- * deserialization.
+ * See median_state_serialize for the format.
  */
 Datum
 serialize_median_state(PG_FUNCTION_ARGS)
 {
 	MedianState *state = PG_ARGISNULL(0) ? NULL : (MedianState *) PG_GETARG_POINTER(0);
-	bool		typbyval;
-	char		typalign;
-	int16		typlen;
-	bool		is_varlena;
-	StringInfoData buf;
-	bytea	   *result;
 
 	/* Check if the input state is NULL */
 	if (state == NULL)
@@ -243,87 +489,20 @@ serialize_median_state(PG_FUNCTION_ARGS)
 	if (!AggCheckCallContext(fcinfo, NULL))
 		elog(ERROR, "aggregate function called in non-aggregate context");
 
-	/* Get type information */
-	get_typlenbyvalalign(state->inputTypeId, &typlen, &typbyval, &typalign);
-	is_varlena = (typlen == -1 || typlen == -2);
-
-	/* Initialize a dynamic buffer using StringInfo */
-	initStringInfo(&buf);
-
-	/* Serialize fixed fields: inputTypeId, count, allocated */
-	appendBinaryStringInfo(&buf, (char *) &(state->inputTypeId), sizeof(Oid));
-	appendBinaryStringInfo(&buf, (char *) &(state->count), sizeof(int64));
-	appendBinaryStringInfo(&buf, (char *) &(state->allocated), sizeof(int64));
-
-	/* Serialize each Datum with null flags */
-	for (int i = 0; i < state->count; i++)
-	{
-		/* Determine if the Datum is NULL */
-		bool		is_null = (state->values[i] == (Datum) 0);
-
-		/* Serialize the null flag (1 byte) */
-		char		null_flag = is_null ? 1 : 0;
-
-		appendBinaryStringInfo(&buf, &null_flag, sizeof(char));
-
-		if (is_null)
-		{
-			/* No need to serialize the value */
-			continue;
-		}
-
-		if (typbyval && !is_varlena)
-		{
-			/* Fixed-size, passed by value */
-			appendBinaryStringInfo(&buf, (char *) &(state->values[i]), sizeof(Datum));
-		}
-		else
-		{
-			if (is_varlena)
-			{
-				/* Serialize the length first */
-				int32		data_length = VARSIZE_ANY(state->values[i]);
-
-				appendBinaryStringInfo(&buf, (char *) &data_length, sizeof(int32));
-
-				/* Serialize the actual data bytes */
-				appendBinaryStringInfo(&buf, (char *) state->values[i], data_length);
-			}
-			else
-			{
-				/* Fixed-length types but passed by reference */
-				appendBinaryStringInfo(&buf, (char *) &(state->values[i]), sizeof(Datum));
-			}
-		}
-	}
-	/* Allocate a bytea with the buffer's content */
-	result = (bytea *) palloc(buf.len + VARHDRSZ);
-	SET_VARSIZE(result, buf.len + VARHDRSZ);
-	memcpy(VARDATA(result), buf.data, buf.len);
-	pfree(buf.data);
-
-	/* Free the buffer allocated by StringInfo */
-	PG_RETURN_BYTEA_P(result);
+	PG_RETURN_BYTEA_P(median_state_serialize(state));
 }
 
 /*
  * deserialize_median_state
  *		Deserialize the median state from bytea.
  *
- * Here Variable-Length and Null values are handled as well.
- * During deserialization, read the NULL flag first. If set, assign NULL to the
- * corresponding Datum without attempting to read further.
+ * The state is built in the aggregate memory context.
  */
 Datum
 deserialize_median_state(PG_FUNCTION_ARGS)
 {
 	bytea	   *state_bytes = PG_ARGISNULL(0) ? NULL : PG_GETARG_BYTEA_P(0);
 	MedianState *state;
-	char	   *p;
-	int16		typlen;
-	bool		typbyval;
-	char		typalign;
-	bool		is_varlena;
 	MemoryContext agg_context;
 	MemoryContext old_context;
 
@@ -335,184 +514,1640 @@ deserialize_median_state(PG_FUNCTION_ARGS)
 		elog(ERROR, "aggregate function called in non-aggregate context");
 
 	old_context = MemoryContextSwitchTo(agg_context);
-	p = VARDATA(state_bytes);
-	state = (MedianState *) palloc(sizeof(MedianState));
 
-	/* Deserialize inputTypeId */
-	memcpy(&(state->inputTypeId), p, sizeof(Oid));
-	p += sizeof(Oid);
+	state = deserialize_median_state_bytes(state_bytes,
+										   median_call_cache(fcinfo), true);
+
+	state->stats = median_explain_stats(fcinfo, state->inputTypeId);
+	if (state->stats != NULL)
+	{
+		state->fast_add = false;
+		state->stats->states_created++;
+		state->stats->serialized_bytes += VARSIZE(state_bytes);
+	}
+
+	MemoryContextSwitchTo(old_context);
+	PG_RETURN_POINTER(state);
+}
 
-	/* Deserialize count */
-	memcpy(&(state->count), p, sizeof(int64));
-	p += sizeof(int64);
+/*
+ * median_state_finalfn
+ *
+ * Final function of median_state_agg, returning the serialized state so it
+ * can be stored and merged later.
+ */
+Datum
+median_state_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
 
-	/* Deserialize allocated */
-	memcpy(&(state->allocated), p, sizeof(int64));
-	p += sizeof(int64);
+	state = PG_ARGISNULL(0) ? NULL : (MedianState *) PG_GETARG_POINTER(0);
 
-	state->values = (Datum *) palloc0(state->allocated * sizeof(Datum));
+	if (state == NULL)
+		PG_RETURN_NULL();
 
-	/* Fetch type information */
-	get_typlenbyvalalign(state->inputTypeId, &typlen, &typbyval, &typalign);
-	is_varlena = (typlen == -1 || typlen == -2);
+	PG_RETURN_BYTEA_P(median_state_serialize(state));
+}
 
-	/* Allocate memory for values */
-	state->values = (Datum *) palloc(state->allocated * sizeof(Datum));
+/*
+ * median_state_merge
+ *
+ * Merge two serialized states of the same type into one.
+ */
+Datum
+median_state_merge(PG_FUNCTION_ARGS)
+{
+	MedianState *state1;
+	MedianState *state2;
 
-	/* Deserialize each Datum with null flags */
-	for (int i = 0; i < state->count; i++)
+	if (PG_ARGISNULL(0))
 	{
-		/* Deserialize the null flag */
-		char		null_flag;
+		if (PG_ARGISNULL(1))
+			PG_RETURN_NULL();
+		PG_RETURN_DATUM(PG_GETARG_DATUM(1));
+	}
+	if (PG_ARGISNULL(1))
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
 
-		memcpy(&null_flag, p, sizeof(char));
-		p += sizeof(char);
+	state1 = median_state_deserialize(PG_GETARG_BYTEA_P(0));
+	state2 = median_state_deserialize(PG_GETARG_BYTEA_P(1));
 
-		if (null_flag)
-		{
-			/* Assign NULL to the Datum */
-			state->values[i] = (Datum) 0;
-			continue;
-		}
+	if (state1->inputTypeId != state2->inputTypeId)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("cannot merge median states of types %s and %s",
+						format_type_be(state1->inputTypeId),
+						format_type_be(state2->inputTypeId))));
 
-		if (typbyval && !is_varlena)
-		{
-			/* Fixed-size, passed by value */
-			Datum		datum;
+	median_state_combine(state1, state2);
 
-			memcpy(&datum, p, sizeof(Datum));
-			state->values[i] = datum;
-			p += sizeof(Datum);
-		}
-		else
-		{
-			if (is_varlena)
-			{
-				/* Deserialize the length first */
-				int32		data_length;
-				struct varlena *varlena;
+	PG_RETURN_BYTEA_P(median_state_serialize(state1));
+}
 
-				memcpy(&data_length, p, sizeof(int32));
-				p += sizeof(int32);
+/*
+ * median_state_value
+ *
+ * Median of a serialized state. The second argument only gives the result
+ * type and must match the type of the state's values.
+ */
+Datum
+median_state_value(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+	Oid			typid = get_fn_expr_argtype(fcinfo->flinfo, 1);
 
-				/* Allocate memory and copy the data bytes */
-				varlena = (struct varlena *) palloc(data_length);
-				memcpy(varlena, p, data_length);
-				p += data_length;
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
 
-				/* Assign the varlena pointer to Datum */
-				state->values[i] = PointerGetDatum(varlena);
-			}
-			else
-			{
-				/* Fixed-length types but passed by reference */
-				Datum		datum;
+	state = median_state_deserialize(PG_GETARG_BYTEA_P(0));
 
-				memcpy(&datum, p, sizeof(Datum));
-				state->values[i] = datum;
-				p += sizeof(Datum);
-			}
-		}
-	}
+	if (state->inputTypeId != typid)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("median state holds values of type %s, not %s",
+						format_type_be(state->inputTypeId),
+						format_type_be(typid))));
 
-	/* Reinitialize typentry */
-	state->typentry = lookup_type_cache(state->inputTypeId, TYPECACHE_CMP_PROC);
+	if (state->count == 0)
+		PG_RETURN_NULL();
 
-	MemoryContextSwitchTo(old_context);
-	PG_RETURN_POINTER(state);
+	PG_RETURN_DATUM(median_state_median(state));
 }
 
 /*
- * add_input_element_median_state
+ * median_footprint_finalfn
  *
- * Add new element to the state.
+ * Final function of median_footprint, the memory the median state of a group
+ * takes: the state itself, its values array including the room that doubling
+ * left unused, and the by-reference values it keeps, each with the overhead of
+ * the allocator.
  */
-static void
-add_input_element_median_state(MedianState *state, Datum newVal)
+Datum
+median_footprint_finalfn(PG_FUNCTION_ARGS)
 {
-	state->count++;
-	if (state->count > state->allocated - 1)
-	{
-		state->allocated *= 2;
-		state->values = (Datum *) repalloc(state->values, state->allocated * sizeof(Datum));
-	}
+	MedianState *state;
+	TupleDesc	tupdesc;
+	Datum		result[7];
+	bool		nulls[7] = {false, false, false, false, false, false, false};
+	Size		elemsize;
+	int64		array_bytes;
+	int64		header_bytes;
+	int64		total_bytes;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
 
-	state->values[state->count - 1] = newVal;
+	state = (MedianState *) PG_GETARG_POINTER(0);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	elemsize = state->slots != NULL ? sizeof(MedianTextSlot) : sizeof(Datum);
+	array_bytes = array_bytes_median_state(state);
+	header_bytes = GetMemoryChunkSpace(state);
+	if (state->values_embedded)
+		header_bytes -= array_bytes;
+	total_bytes = state_bytes_median_state(state);
+
+	result[0] = Int64GetDatum(state->count);
+	result[1] = Int64GetDatum(header_bytes);
+	result[2] = Int64GetDatum(array_bytes);
+	result[3] = Int64GetDatum(array_bytes - state->count * (int64) elemsize);
+	result[4] = Int64GetDatum(state->value_bytes);
+	result[5] = Int64GetDatum(total_bytes);
+	if (state->count > 0)
+		result[6] = Float8GetDatum((float8) total_bytes / state->count);
+	else
+		nulls[6] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, result, nulls)));
 }
 
 /*
- * discard_element_median_state
+ * median_state_create
  *
- * Remove the first occurance of the given element we find in the state.
+ * Create an empty median state for values of the given type in the current
+ * memory context, for use outside of the aggregate.
  */
-static void
-discard_element_median_state(MedianState *state, Datum datum)
+MedianState *
+median_state_create(Oid inputTypeId)
 {
-	int			num_elems = state->count;
-	Datum	   *elem_values = state->values;
-	int16		typlen;
-	bool		typbyval;
-	char		typalign;
-	int			i;
-	bool		found = false;
+	return create_median_state(inputTypeId, get_type_comp_method(inputTypeId),
+							   8);
+}
 
-	/* Get element type information */
-	get_typlenbyvalalign(state->inputTypeId, &typlen, &typbyval, &typalign);
+/*
+ * median_call_cache
+ *
+ * The cache in fn_extra of a support function, created on first use.
+ */
+MedianCallCache *
+median_call_cache(FunctionCallInfo fcinfo)
+{
+	if (fcinfo->flinfo->fn_extra == NULL)
+		fcinfo->flinfo->fn_extra =
+			MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+								   sizeof(MedianCallCache));
 
-	/* Copy elements, excluding the first occurrence of the search element */
-	for (i = 0; i < num_elems; i++)
+	return (MedianCallCache *) fcinfo->flinfo->fn_extra;
+}
+
+/*
+ * median_state_add
+ *
+ * Add a value to a state. Values of by-reference types are copied into the
+ * memory context of the state, so they may point into buffers that are
+ * released before the state is used.
+ */
+void
+median_state_add(MedianState *state, Datum value)
+{
+	/* Text slots copy what they need themselves */
+	if (!state->typentry->typbyval && state->slots == NULL)
 	{
-		if (!found && datumIsEqual(elem_values[i], datum, typbyval, typlen))
-		{
-			/* Skip this element (delete the first occurrence) */
-			found = true;
-			continue;
-		}
+		MemoryContext old_context;
 
-		if (found && i < num_elems - 1)
-		{
-			/* Shift elements left to fill the gap */
-			elem_values[i] = elem_values[i + 1];
-		}
-	}
+		old_context = MemoryContextSwitchTo(GetMemoryChunkContext(state));
+		value = datumCopy(value, false, state->typentry->typlen);
+		MemoryContextSwitchTo(old_context);
 
-	/* Set the last element to NULL if an element was found and deleted */
-	if (found)
-	{
-		state->count--;
-		/* pfree(&elem_values[state->count]); */
+		state->value_bytes += GetMemoryChunkSpace(DatumGetPointer(value));
 	}
 
+	add_input_element_median_state(state, value);
 }
 
 /*
- * get_type_comp_method
- *
- * Goal is to get the suitable comparison function for the input type_oid.
- *
- * There is a long chain to traverse through as follows:
- *  1. Get the operator class (pg_opclass) for the specified type.
- *      SELECT pg_opclass.oid, pg_opclass.opcfamily WHERE opclass->opcintype == type_id;
- *
- *  2. Using pg_opclass.oid, pg_opclass.opcfamily, and type_oid, get pg_amproc.amproc.
+ * median_state_combine
  *
- * As these steps are already done in lookup_type_cache(), we use it here.
+ * Add the values of state2 to state1. Values of by-reference types are not
+ * copied, so state2 must live as long as state1, and its memory is accounted
+ * to state1 from now on.
  */
-static TypeCacheEntry *
-get_type_comp_method(Oid type_oid)
+void
+median_state_combine(MedianState *state1, MedianState *state2)
 {
-	TypeCacheEntry *typentry;
+	Assert(state1->inputTypeId == state2->inputTypeId);
 
-	/* Lookup the type cache entry for the given type OID. */
-	typentry = lookup_type_cache(type_oid,
-								 TYPECACHE_CMP_PROC_FINFO);
+	if (state1->slots == NULL)
+	{
+		materialize_median_state(state2);
+		state1->values_copied = false;
+	}
+	state1->value_bytes += state2->value_bytes;
 
-	/* Check if the type has a valid comparison function. */
-	if (!OidIsValid(typentry->cmp_proc_finfo.fn_oid))
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_FUNCTION),
-				 errmsg("could not identify a comparison function for type %s",
-						format_type_be(type_oid))));
+	if (state1->slots != NULL && state2->slots == NULL)
+	{
+		for (int64 i = 0; i < state2->count; i++)
+			add_input_element_median_state(state1, state2->values[i]);
+		return;
+	}
+
+	/* Both states are in the same form, copy the array over */
+	reserve_values_median_state(state1, state1->count + state2->count);
+	if (state1->slots != NULL)
+		memcpy(state1->slots + state1->count, state2->slots,
+			   state2->count * sizeof(MedianTextSlot));
+	else
+		memcpy(state1->values + state1->count, state2->values,
+			   state2->count * sizeof(Datum));
+	state1->count += state2->count;
+}
+
+/*
+ * median_state_reset
+ *
+ * Empty a state, keeping its buffer for the values added next. Values of
+ * by-reference types that were copied in are not freed.
+ */
+void
+median_state_reset(MedianState *state)
+{
+	state->count = 0;
+}
+
+/*
+ * median_state_type
+ *
+ * Type of the values of a state.
+ */
+Oid
+median_state_type(MedianState *state)
+{
+	return state->inputTypeId;
+}
+
+/*
+ * median_state_count
+ *
+ * Number of values in a state.
+ */
+int64
+median_state_count(MedianState *state)
+{
+	return state->count;
+}
+
+/*
+ * median_state_median
+ *
+ * Median of a non-empty state, computed the same way as by median_finalfn.
+ * The values of the state are reordered.
+ */
+Datum
+median_state_median(MedianState *state)
+{
+	const char *strategy;
+
+	Assert(state->count > 0);
+
+	return select_median(state, &strategy);
+}
+
+/*
+ * median_state_values
+ *
+ * The values of a state, in no particular order.
+ */
+Datum *
+median_state_values(MedianState *state)
+{
+	materialize_median_state(state);
+
+	return state->values;
+}
+
+/*
+ * median_state_sorted_values
+ *
+ * Sort the values of a state, as median_finalfn would, and return them.
+ */
+Datum *
+median_state_sorted_values(MedianState *state)
+{
+	materialize_median_state(state);
+
+	qsort_arg(state->values, state->count, sizeof(Datum),
+			  datum_qsort_compare, state->typentry);
+
+	return state->values;
+}
+
+/*
+ * median_state_select_ranks
+ *
+ * Find the values of the given ranks, 0-based and in ascending order, in a
+ * non-empty state, as if it was sorted. The values of the state are
+ * reordered.
+ */
+void
+median_state_select_ranks(MedianState *state, const int64 *ranks, int nranks,
+						  Datum *results)
+{
+	Assert(state->count > 0);
+
+	materialize_median_state(state);
+	select_ranks_median_state(state, 0, state->count, ranks, nranks, results);
+}
+
+/*
+ * median_state_serialize
+ *
+ * Serialize a state into a bytea in the current memory context.
+ *
+ * States of up to MEDIAN_COMPACT_MAX_COUNT values, which is what most groups
+ * of a parallel GROUP BY hold, use the compact format:
+ *
+ *   InvalidOid, count (1 byte), inputTypeId
+ *   for each value: by-value and fixed-length types their typlen bytes,
+ *   varlena types the value with its own (possibly short) header
+ *
+ * Larger states use the original format:
+ *
+ *   inputTypeId, count (int64), allocated (int64)
+ *   for each value: a null flag byte, then the Datum for by-value types,
+ *   the typlen bytes for other fixed-length types, or an int32 length and
+ *   the bytes for varlena types
+ *
+ * Values are never NULL, so the null flag is always written as 0; it is only
+ * read for states stored by older versions. The size is computed before
+ * anything is written, by median_state_serialized_size, so the result is
+ * allocated once and exactly.
+ *
+ * We do not seralize TypeCacheEntry as this can be genrated during
+ * deserialization.
+ */
+bytea *
+median_state_serialize(MedianState *state)
+{
+	int16		typlen = state->typentry->typlen;
+	bool		typbyval = state->typentry->typbyval;
+	bool		compact = (state->count <= MEDIAN_COMPACT_MAX_COUNT);
+	Size		size = median_state_serialized_size(state);
+	bytea	   *result;
+	char	   *p;
+
+	if (size > MaxAllocSize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("median state is too large to serialize")));
+
+	result = (bytea *) palloc(size);
+	SET_VARSIZE(result, size);
+	p = VARDATA(result);
+
+	if (compact)
+	{
+		Oid			marker = InvalidOid;
+
+		memcpy(p, &marker, sizeof(Oid));
+		p += sizeof(Oid);
+		*p++ = (char) state->count;
+		memcpy(p, &state->inputTypeId, sizeof(Oid));
+		p += sizeof(Oid);
+	}
+	else
+	{
+		memcpy(p, &state->inputTypeId, sizeof(Oid));
+		p += sizeof(Oid);
+		memcpy(p, &state->count, sizeof(int64));
+		p += sizeof(int64);
+		memcpy(p, &state->allocated, sizeof(int64));
+		p += sizeof(int64);
+	}
+
+	for (int64 i = 0; i < state->count; i++)
+	{
+		Datum		value;
+
+		if (!compact)
+			*p++ = 0;			/* null flag */
+
+		if (state->slots != NULL)
+		{
+			if (!compact)
+			{
+				int32		data_length = median_text_slot_size(&state->slots[i]);
+
+				memcpy(p, &data_length, sizeof(int32));
+				p += sizeof(int32);
+			}
+			p = median_text_slot_write(p, &state->slots[i]);
+			continue;
+		}
+
+		value = state->values[i];
+		if (typbyval)
+		{
+			if (compact)
+			{
+				write_byval_value(p, value, typlen);
+				p += typlen;
+			}
+			else
+			{
+				memcpy(p, &value, sizeof(Datum));
+				p += sizeof(Datum);
+			}
+		}
+		else if (typlen > 0)
+		{
+			/*
+			 * Fixed-length types but passed by reference. The pointer is of
+			 * no use to whoever reads the state, send the bytes.
+			 */
+			memcpy(p, DatumGetPointer(value), typlen);
+			p += typlen;
+		}
+		else
+		{
+			/* Values read from disk may still be toasted */
+			struct varlena *data = (struct varlena *) DatumGetPointer(value);
+			int32		data_length;
+
+			if (typlen == -1)
+				data = PG_DETOAST_DATUM_PACKED(value);
+			data_length = VARSIZE_ANY(data);
+
+			if (!compact)
+			{
+				memcpy(p, &data_length, sizeof(int32));
+				p += sizeof(int32);
+			}
+			memcpy(p, data, data_length);
+			p += data_length;
+		}
+	}
+
+	Assert(p == (char *) result + size);
+
+	return result;
+}
+
+/*
+ * median_state_serialized_size
+ *
+ * Size of the output of median_state_serialize. Counting stops once past
+ * MaxAllocSize, so larger sizes are only known to be too large.
+ */
+Size
+median_state_serialized_size(MedianState *state)
+{
+	int16		typlen = state->typentry->typlen;
+	bool		typbyval = state->typentry->typbyval;
+	bool		compact = (state->count <= MEDIAN_COMPACT_MAX_COUNT);
+	Size		size;
+
+	if (compact)
+		size = VARHDRSZ + sizeof(Oid) + sizeof(uint8) + sizeof(Oid);
+	else
+		size = VARHDRSZ + sizeof(Oid) + 2 * sizeof(int64);
+
+	if (typbyval)
+		size += state->count * (compact ? typlen : sizeof(char) + sizeof(Datum));
+	else if (typlen > 0)
+		size += state->count * (compact ? typlen : sizeof(char) + typlen);
+	else
+	{
+		for (int64 i = 0; i < state->count && size <= MaxAllocSize; i++)
+		{
+			if (state->slots != NULL)
+				size += median_text_slot_size(&state->slots[i]);
+			else
+				size += serialized_size_varlena(state->values[i]);
+			if (!compact)
+				size += sizeof(char) + sizeof(int32);
+		}
+	}
+
+	return size;
+}
+
+/*
+ * median_state_deserialize
+ *
+ * Build a state from the output of median_state_serialize, in the current
+ * memory context. The bytes may come from the user, so the values are checked
+ * as well, see median_state_check_type.
+ */
+MedianState *
+median_state_deserialize(bytea *state_bytes)
+{
+	return deserialize_median_state_bytes(state_bytes, NULL, false);
+}
+
+/*
+ * median_state_deserialize_trusted
+ *
+ * Like median_state_deserialize, for bytes only this module can have written,
+ * such as the serialized states of aggregates, whose values need no checks.
+ */
+MedianState *
+median_state_deserialize_trusted(bytea *state_bytes)
+{
+	return deserialize_median_state_bytes(state_bytes, NULL, true);
+}
+
+/*
+ * deserialize_median_state_bytes
+ *
+ * Guts of median_state_deserialize, taking the comparison info of the type
+ * from the cache of the calling support function if there is one.
+ *
+ * Either format of median_state_serialize is accepted. The values array is
+ * sized for exactly the values read, and for a compact state it is allocated
+ * along with the state. All by-reference values go into a single chunk, at
+ * the alignment of their type; for text slots that is only the strings too
+ * long to be inlined.
+ *
+ * The bytes may come from the user, through the median_state type or one of
+ * the functions taking a serialized state, so the framing is never trusted:
+ * every read is checked against the end of the input, the count must fit in
+ * what is left of it, and the type must exist. Varlena values must be plain
+ * inline values, as median_state_serialize writes them. Unless trusted is
+ * set, the values themselves go through median_state_check_value too.
+ */
+static MedianState *
+deserialize_median_state_bytes(bytea *state_bytes, MedianCallCache *cache,
+							   bool trusted)
+{
+	MedianState *state;
+	char	   *p = VARDATA(state_bytes);
+	char	   *end = (char *) state_bytes + VARSIZE(state_bytes);
+	Oid			typid;
+	int64		count;
+	bool		compact;
+	TypeCacheEntry *typentry;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	char	   *data = NULL;
+	Size		offset = 0;
+	Size		min_value_size;
+
+	check_serialized_bytes(p, end, sizeof(Oid));
+	memcpy(&typid, p, sizeof(Oid));
+	p += sizeof(Oid);
+
+	compact = (typid == InvalidOid);
+	if (compact)
+	{
+		check_serialized_bytes(p, end, sizeof(uint8) + sizeof(Oid));
+		count = (uint8) *p++;
+		memcpy(&typid, p, sizeof(Oid));
+		p += sizeof(Oid);
+	}
+	else
+	{
+		check_serialized_bytes(p, end, 2 * sizeof(int64));
+		memcpy(&count, p, sizeof(int64));
+		/* the allocated size of the serialized state is of no interest */
+		p += 2 * sizeof(int64);
+	}
+
+	if (!SearchSysCacheExists1(TYPEOID, ObjectIdGetDatum(typid)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state"),
+				 errdetail("The state holds values of unknown type %u.",
+						   typid)));
+
+	typentry = cache != NULL ? cached_type_comp_method(cache, typid) :
+		get_type_comp_method(typid);
+	typlen = typentry->typlen;
+	typbyval = typentry->typbyval;
+	typalign = typentry->typalign;
+
+	if (typlen < -1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state"),
+				 errdetail("The state holds values of type %s.",
+						   format_type_be(typid))));
+
+	if (!trusted)
+		median_state_check_type(typid);
+
+	/*
+	 * The fewest bytes a value can take. NULL flags of older versions are
+	 * only accepted for by-value types, for which they take one byte.
+	 */
+	if (compact)
+		min_value_size = typlen > 0 ? typlen : VARHDRSZ_SHORT;
+	else if (typbyval)
+		min_value_size = sizeof(char);
+	else
+		min_value_size = sizeof(char) +
+			(typlen > 0 ? typlen : sizeof(int32) + VARHDRSZ_SHORT);
+
+	if (count < 0 || count > (end - p) / min_value_size)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state"),
+				 errdetail("The state claims " INT64_FORMAT " values in %d bytes.",
+						   count, (int) (end - p))));
+
+	state = create_median_state(typid, typentry, compact ? -count : count);
+	state->count = count;
+
+	/*
+	 * What is left of the input bounds the size of the values, plus the
+	 * padding to align each.
+	 */
+	if (!typbyval)
+	{
+		data = palloc_extended((end - p) + count * MAXIMUM_ALIGNOF,
+							   MCXT_ALLOC_HUGE);
+		state->value_bytes = GetMemoryChunkSpace(data);
+		state->values_copied = false;
+	}
+
+	for (int64 i = 0; i < count; i++)
+	{
+		if (!compact)
+		{
+			check_serialized_bytes(p, end, sizeof(char));
+			if (*p++ != 0)
+			{
+				/* NULL, as written by older versions for a zero Datum */
+				if (!typbyval)
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+							 errmsg("invalid median state"),
+							 errdetail("The state holds a NULL value of type %s.",
+									   format_type_be(typid))));
+				state->values[i] = (Datum) 0;
+				continue;
+			}
+		}
+
+		if (typbyval)
+		{
+			if (compact)
+			{
+				check_serialized_bytes(p, end, typlen);
+				state->values[i] = read_byval_value(p, typlen);
+				p += typlen;
+			}
+			else
+			{
+				check_serialized_bytes(p, end, sizeof(Datum));
+				memcpy(&state->values[i], p, sizeof(Datum));
+				p += sizeof(Datum);
+			}
+		}
+		else if (typlen > 0)
+		{
+			/* Fixed-length types but passed by reference */
+			check_serialized_bytes(p, end, typlen);
+			offset = att_align_nominal(offset, typalign);
+			memcpy(data + offset, p, typlen);
+			state->values[i] = PointerGetDatum(data + offset);
+			offset += typlen;
+			p += typlen;
+			if (!trusted)
+				median_state_check_value(typid, state->values[i]);
+		}
+		else
+		{
+			int32		data_length;
+			int32		stored_length = 0;
+
+			if (!compact)
+			{
+				check_serialized_bytes(p, end, sizeof(int32));
+				memcpy(&stored_length, p, sizeof(int32));
+				p += sizeof(int32);
+			}
+
+			/* Only plain inline values, as median_state_serialize writes */
+			check_serialized_bytes(p, end, VARHDRSZ_SHORT);
+			if (VARATT_IS_1B_E(p))
+				data_length = -1;
+			else if (VARATT_IS_1B(p))
+				data_length = VARSIZE_1B(p);
+			else
+			{
+				uint32		header;
+
+				/* p may not be aligned, read the header from a copy */
+				check_serialized_bytes(p, end, VARHDRSZ);
+				memcpy(&header, p, sizeof(uint32));
+				if (VARATT_IS_4B_U(&header) && VARSIZE_4B(&header) >= VARHDRSZ)
+					data_length = VARSIZE_4B(&header);
+				else
+					data_length = -1;
+			}
+
+			if (data_length < 0 || (!compact && stored_length != data_length))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("invalid median state"),
+						 errdetail("The state holds a malformed value of type %s.",
+								   format_type_be(typid))));
+			check_serialized_bytes(p, end, data_length);
+
+			if (state->slots != NULL)
+			{
+				int32		hdrsz = VARATT_IS_1B(p) ? VARHDRSZ_SHORT : VARHDRSZ;
+				uint32		len = data_length - hdrsz;
+				char	   *bytes = p + hdrsz;
+
+				if (!trusted)
+					check_string(bytes, len);
+
+				/* Only strings too long for the slot are kept in data */
+				if (len > MEDIAN_TEXT_INLINE)
+				{
+					memcpy(data + offset, bytes, len);
+					bytes = data + offset;
+					offset += len;
+				}
+				median_text_slot_set(&state->slots[i], bytes, len, false);
+				p += data_length;
+				continue;
+			}
+
+			/* Values with a short header need no alignment */
+			if (!VARATT_IS_1B(p))
+				offset = INTALIGN(offset);
+			memcpy(data + offset, p, data_length);
+			state->values[i] = PointerGetDatum(data + offset);
+			offset += data_length;
+			p += data_length;
+			if (!trusted)
+				median_state_check_value(typid, state->values[i]);
+		}
+	}
+
+	if (p != end)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state"),
+				 errdetail("The state goes on after its last value.")));
+
+	return state;
+}
+
+/*
+ * median_state_check_type
+ *
+ * Raise an error unless values of the given type may be read from bytes the
+ * user can forge. The output and comparison functions of a type trust its
+ * values to be well formed, so a forged array or numeric could make them read
+ * far past the value. Only superusers may read the types whose values
+ * median_state_check_value cannot check.
+ */
+void
+median_state_check_type(Oid typid)
+{
+	switch (typid)
+	{
+		case BOOLOID:
+		case CHAROID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case CASHOID:
+		case DATEOID:
+		case TIMEOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+		case INTERVALOID:
+		case UUIDOID:
+		case NAMEOID:
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+		case BYTEAOID:
+		case NUMERICOID:
+			return;
+	}
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to read median states of type %s",
+						format_type_be(typid)),
+				 errdetail("Values of this type cannot be checked before they are used.")));
+}
+
+/*
+ * median_state_check_value
+ *
+ * Raise an error unless a value read from bytes the user can forge is well
+ * formed. Strings must be valid in the server encoding and names must end
+ * within NAMEDATALEN. A numeric must have the header its send function reads,
+ * and then go through its receive function, which checks every field. Any
+ * bytes make a valid value of the other types median_state_check_type lets
+ * through, and the values of the rest are left alone.
+ */
+void
+median_state_check_value(Oid typid, Datum value)
+{
+	char	   *p = DatumGetPointer(value);
+
+	switch (typid)
+	{
+		case NAMEOID:
+			if (memchr(p, '\0', NAMEDATALEN) == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("invalid median state"),
+						 errdetail("The state holds a malformed value of type %s.",
+								   format_type_be(typid))));
+			break;
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+			check_string(VARDATA_ANY(p), VARSIZE_ANY_EXHDR(p));
+			break;
+		case NUMERICOID:
+			{
+				uint16		header = 0;
+				bytea	   *sent;
+				StringInfoData buf;
+
+				/* Two header bytes, four unless the first has the top bit */
+				if (VARSIZE_ANY_EXHDR(p) >= sizeof(uint16))
+					memcpy(&header, VARDATA_ANY(p), sizeof(uint16));
+				if (VARSIZE_ANY_EXHDR(p) < sizeof(uint16) ||
+					((header & 0x8000) == 0 &&
+					 VARSIZE_ANY_EXHDR(p) < 2 * sizeof(uint16)))
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+							 errmsg("invalid median state"),
+							 errdetail("The state holds a malformed value of type %s.",
+									   format_type_be(typid))));
+
+				sent = DatumGetByteaPP(DirectFunctionCall1(numeric_send, value));
+				buf.data = VARDATA_ANY(sent);
+				buf.len = VARSIZE_ANY_EXHDR(sent);
+				buf.maxlen = buf.len;
+				buf.cursor = 0;
+				(void) DirectFunctionCall3(numeric_recv,
+										   PointerGetDatum(&buf),
+										   ObjectIdGetDatum(InvalidOid),
+										   Int32GetDatum(-1));
+				pfree(sent);
+			}
+			break;
+	}
+}
+
+/*
+ * check_string
+ *
+ * Raise an error unless len bytes at data are a valid string in the server
+ * encoding.
+ */
+static void
+check_string(const char *data, int len)
+{
+	(void) pg_verifymbstr(data, len, false);
+}
+
+/*
+ * check_serialized_bytes
+ *
+ * Raise an error unless size bytes of a serialized state are left at p.
+ */
+static void
+check_serialized_bytes(const char *p, const char *end, Size size)
+{
+	if (end - p < 0 || (Size) (end - p) < size)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state"),
+				 errdetail("The state ends in the middle of a value.")));
+}
+
+/*
+ * serialized_size_varlena
+ *
+ * Size of a varlena value of a state once detoasted the way
+ * median_state_serialize does.
+ */
+static Size
+serialized_size_varlena(Datum value)
+{
+	struct varlena *data = (struct varlena *) DatumGetPointer(value);
+
+	if (VARATT_IS_EXTERNAL(data) || VARATT_IS_COMPRESSED(data))
+		return toast_raw_datum_size(value);
+
+	return VARSIZE_ANY(data);
+}
+
+/*
+ * write_byval_value
+ *
+ * Store the typlen bytes of a by-value Datum at a possibly unaligned p.
+ */
+static void
+write_byval_value(char *p, Datum value, int16 typlen)
+{
+	switch (typlen)
+	{
+		case sizeof(char):
+			*p = DatumGetChar(value);
+			break;
+		case sizeof(int16):
+			{
+				int16		v = DatumGetInt16(value);
+
+				memcpy(p, &v, sizeof(int16));
+				break;
+			}
+		case sizeof(int32):
+			{
+				int32		v = DatumGetInt32(value);
+
+				memcpy(p, &v, sizeof(int32));
+				break;
+			}
+		case sizeof(Datum):
+			memcpy(p, &value, sizeof(Datum));
+			break;
+		default:
+			elog(ERROR, "unsupported byval length: %d", (int) typlen);
+	}
+}
+
+/*
+ * read_byval_value
+ *
+ * Inverse of write_byval_value.
+ */
+static Datum
+read_byval_value(const char *p, int16 typlen)
+{
+	switch (typlen)
+	{
+		case sizeof(char):
+			return CharGetDatum(*p);
+		case sizeof(int16):
+			{
+				int16		v;
+
+				memcpy(&v, p, sizeof(int16));
+				return Int16GetDatum(v);
+			}
+		case sizeof(int32):
+			{
+				int32		v;
+
+				memcpy(&v, p, sizeof(int32));
+				return Int32GetDatum(v);
+			}
+		case sizeof(Datum):
+			{
+				Datum		v;
+
+				memcpy(&v, p, sizeof(Datum));
+				return v;
+			}
+		default:
+			elog(ERROR, "unsupported byval length: %d", (int) typlen);
+			return (Datum) 0;	/* keep compiler quiet */
+	}
+}
+
+/*
+ * create_median_state
+ *
+ * Create an empty state with room for allocated values in the current memory
+ * context. A negative allocated asks for room for -allocated values in the
+ * same chunk as the state, for small states that are not expected to grow.
+ *
+ * States of text types keep their values in text slots.
+ */
+static MedianState *
+create_median_state(Oid inputTypeId, TypeCacheEntry *typentry,
+					int64 allocated)
+{
+	MedianState *state;
+	bool		text_slots = median_text_slot_type(inputTypeId);
+	Size		elemsize = text_slots ? sizeof(MedianTextSlot) : sizeof(Datum);
+
+	if (allocated < 0)
+	{
+		char	   *array;
+
+		allocated = Max(-allocated, 1);
+		state = (MedianState *) palloc0(MAXALIGN(sizeof(MedianState)) +
+										allocated * elemsize);
+		array = (char *) state + MAXALIGN(sizeof(MedianState));
+		if (text_slots)
+			state->slots = (MedianTextSlot *) array;
+		else
+			state->values = (Datum *) array;
+		state->allocated = allocated;
+		state->values_embedded = true;
+	}
+	else if (text_slots)
+	{
+		allocated = Max(allocated, 1);
+		state = (MedianState *) palloc0(sizeof(MedianState));
+		state->slots = (MedianTextSlot *) palloc_extended(allocated * elemsize,
+														  MCXT_ALLOC_HUGE);
+		state->allocated = allocated;
+	}
+	else
+	{
+		state = (MedianState *) palloc0(sizeof(MedianState));
+		alloc_values_median_state(state, Max(allocated, 1));
+	}
+
+	state->inputTypeId = inputTypeId;
+	state->count = 0;
+	state->typentry = typentry;
+	state->values_copied = true;
+	state->value_bytes = 0;
+	state->fast_add = !text_slots && typentry->typbyval;
+	state->arena = NULL;
+	state->arena_bytes = 0;
+	state->dead_bytes = 0;
+	state->compacted_bytes = 0;
+	state->stats = NULL;
+
+	return state;
+}
+
+/*
+ * cached_type_comp_method
+ *
+ * get_type_comp_method, remembered in the cache of a support function.
+ */
+static TypeCacheEntry *
+cached_type_comp_method(MedianCallCache *cache, Oid type_oid)
+{
+	if (cache->typid != type_oid || cache->typentry == NULL)
+	{
+		cache->typentry = get_type_comp_method(type_oid);
+		cache->typid = type_oid;
+	}
+
+	return cache->typentry;
+}
+
+/*
+ * add_input_element_median_state
+ *
+ * Add new element to the state.
+ */
+static void
+add_input_element_median_state(MedianState *state, Datum newVal)
+{
+	state->count++;
+	if (state->count > state->allocated)
+		grow_values_median_state(state, state->allocated * 2);
+
+	if (state->slots != NULL)
+	{
+		/*
+		 * Long strings are copied to where the state lives, or to its arena
+		 * once values are being discarded.
+		 */
+		MemoryContext old_context;
+		Size		bytes;
+
+		old_context = MemoryContextSwitchTo(state->arena != NULL ? state->arena :
+											GetMemoryChunkContext(state));
+		bytes = median_text_slot_set_datum(&state->slots[state->count - 1],
+										   newVal);
+		MemoryContextSwitchTo(old_context);
+
+		state->value_bytes += bytes;
+		if (state->arena != NULL)
+			state->arena_bytes += bytes;
+		return;
+	}
+
+	state->values[state->count - 1] = newVal;
+}
+
+/*
+ * add_array_median_state
+ *
+ * Add the non-null elements of an array to the state. Arrays of by-value
+ * types without nulls are appended in one go: with a memcpy where elements
+ * are stored as wide as Datums, like int8 and float8, otherwise with a loop
+ * widening each element. Anything else is added value by value, copying by-
+ * reference values.
+ */
+static void
+add_array_median_state(MedianState *state, ArrayType *array)
+{
+	int			nitems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	TypeCacheEntry *typentry = state->typentry;
+	ArrayIterator iterator;
+	Datum		value;
+	bool		isnull;
+
+	if (nitems == 0)
+		return;
+
+	if (typentry->typbyval && state->slots == NULL && !ARR_HASNULL(array))
+	{
+		char	   *p = ARR_DATA_PTR(array);
+
+		reserve_values_median_state(state, state->count + nitems);
+
+		if (typentry->typlen == sizeof(Datum))
+			memcpy(state->values + state->count, p, nitems * sizeof(Datum));
+		else
+		{
+			Size		stride = att_align_nominal(typentry->typlen,
+												   typentry->typalign);
+
+			for (int i = 0; i < nitems; i++)
+			{
+				state->values[state->count + i] = fetch_att(p, true,
+															typentry->typlen);
+				p += stride;
+			}
+		}
+
+		state->count += nitems;
+		return;
+	}
+
+	iterator = array_create_iterator(array, 0, NULL);
+	while (array_iterate(iterator, &value, &isnull))
+	{
+		if (!isnull)
+			median_state_add(state, value);
+	}
+	array_free_iterator(iterator);
+}
+
+/*
+ * alloc_values_median_state
+ *
+ * Allocate the values array of a new state in the current memory context, or
+ * in huge pages if it is already above median.hugepage_threshold.
+ */
+static void
+alloc_values_median_state(MedianState *state, int64 allocated)
+{
+	state->values = NULL;
+	state->allocated = 0;
+	state->values_embedded = false;
+	state->mmap_size = 0;
+
+#ifdef USE_MEDIAN_HUGEPAGES
+	if (mmap_values_median_state(state, allocated))
+		return;
+#endif
+
+	state->values = (Datum *) palloc_extended(allocated * sizeof(Datum),
+											  MCXT_ALLOC_HUGE);
+	state->allocated = allocated;
+}
+
+/*
+ * grow_values_median_state
+ *
+ * Enlarge the values array to hold allocated elements. The array stays in the
+ * memory context it was allocated in until it crosses
+ * median.hugepage_threshold, from where on it lives in a huge-page mapping.
+ */
+static void
+grow_values_median_state(MedianState *state, int64 allocated)
+{
+	Size		elemsize = state->slots != NULL ? sizeof(MedianTextSlot) :
+		sizeof(Datum);
+
+#ifdef USE_MEDIAN_HUGEPAGES
+	/* Text slots stay in palloc'd memory */
+	if (state->slots == NULL && mmap_values_median_state(state, allocated))
+		return;
+#endif
+
+	/* An array allocated along with the state moves out on its own */
+	if (state->values_embedded)
+	{
+		char	   *array;
+
+		array = MemoryContextAllocExtended(GetMemoryChunkContext(state),
+										   allocated * elemsize,
+										   MCXT_ALLOC_HUGE);
+		if (state->slots != NULL)
+		{
+			memcpy(array, state->slots, state->count * elemsize);
+			state->slots = (MedianTextSlot *) array;
+		}
+		else
+		{
+			memcpy(array, state->values, state->count * elemsize);
+			state->values = (Datum *) array;
+		}
+		state->values_embedded = false;
+		state->allocated = allocated;
+		return;
+	}
+
+	if (state->slots != NULL)
+		state->slots = (MedianTextSlot *) repalloc_huge(state->slots,
+														allocated * elemsize);
+	else
+		state->values = (Datum *) repalloc_huge(state->values,
+												allocated * elemsize);
+	state->allocated = allocated;
+}
+
+/*
+ * reserve_values_median_state
+ *
+ * Make room for count values, doubling the array as often as needed.
+ */
+static void
+reserve_values_median_state(MedianState *state, int64 count)
+{
+	int64		allocated = state->allocated;
+
+	while (count > allocated)
+		allocated *= 2;
+
+	if (allocated != state->allocated)
+		grow_values_median_state(state, allocated);
+}
+
+/*
+ * materialize_median_state
+ *
+ * Turn the text slots of a state into a values array of text Datums, for
+ * the code that needs plain Datums. Does nothing for other states.
+ */
+static void
+materialize_median_state(MedianState *state)
+{
+	MedianTextSlot *slots = state->slots;
+	bool		embedded = state->values_embedded;
+	MemoryContext old_context;
+
+	if (slots == NULL)
+		return;
+
+	old_context = MemoryContextSwitchTo(GetMemoryChunkContext(state));
+
+	state->slots = NULL;
+	alloc_values_median_state(state, state->allocated);
+	for (int64 i = 0; i < state->count; i++)
+	{
+		state->values[i] = median_text_slot_datum(&slots[i]);
+		state->value_bytes += GetMemoryChunkSpace(DatumGetPointer(state->values[i]));
+	}
+
+	MemoryContextSwitchTo(old_context);
+
+	if (!embedded)
+		pfree(slots);
+}
+
+/*
+ * compact_strings_median_state
+ *
+ * Copy the long strings of the text slots still in the state into a fresh
+ * arena and drop the previous one, with the strings discarded from it.
+ *
+ * The strings of a moving-aggregate state cannot be freed one by one, as a
+ * slot may point into the middle of a detoasted value, so instead they go into
+ * an arena that is replaced as soon as the discarded strings outweigh the
+ * ones copied the last time. That keeps the memory of a sliding window in
+ * proportion to the frame, at the cost of copying each string about once
+ * more. Strings added before the first compaction stay where they were until
+ * the aggregate's memory is reset.
+ */
+static void
+compact_strings_median_state(MedianState *state)
+{
+	MemoryContext arena;
+	MemoryContext old_context;
+	int64		live_bytes = 0;
+
+	arena = AllocSetContextCreate(GetMemoryChunkContext(state),
+								  "median strings",
+								  ALLOCSET_DEFAULT_SIZES);
+
+	old_context = MemoryContextSwitchTo(arena);
+	for (int64 i = 0; i < state->count; i++)
+	{
+		MedianTextSlot *slot = &state->slots[i];
+		char	   *bytes;
+
+		if (slot->len <= MEDIAN_TEXT_INLINE)
+			continue;
+
+		bytes = palloc(slot->len);
+		memcpy(bytes, slot->u.ptr, slot->len);
+		slot->u.ptr = bytes;
+		live_bytes += slot->len;
+	}
+	MemoryContextSwitchTo(old_context);
+
+	if (state->arena != NULL)
+	{
+		state->value_bytes -= state->arena_bytes;
+		MemoryContextDelete(state->arena);
+	}
+
+	state->arena = arena;
+	state->arena_bytes = context_bytes(arena);
+	state->value_bytes += state->arena_bytes;
+	state->dead_bytes = 0;
+	state->compacted_bytes = live_bytes;
+}
+
+#ifdef USE_MEDIAN_HUGEPAGES
+/*
+ * mmap_values_median_state
+ *
+ * Try to place the values array in an anonymous mapping advised with
+ * MADV_HUGEPAGE, sized for allocated elements. Returns false if the array is
+ * below the threshold or the mapping cannot be made, in which case the caller
+ * falls back to palloc.
+ *
+ * For very large states the random access pattern of sorting makes TLB misses
+ * a significant part of the cost, which 2MB pages mostly remove. The mapping
+ * is not owned by a memory context, so the first time we map we register a
+ * reset callback on the context holding the state to unmap it again.
+ */
+static bool
+mmap_values_median_state(MedianState *state, int64 allocated)
+{
+	Size		size = allocated * sizeof(Datum);
+	Datum	   *values;
+
+	if (median_hugepage_threshold < 0 ||
+		size < (Size) median_hugepage_threshold * 1024)
+		return false;
+
+	/* Round up to whole huge pages */
+	size = TYPEALIGN(MEDIAN_HUGEPAGE_SIZE, size);
+
+	if (state->mmap_size > 0)
+	{
+#ifdef MREMAP_MAYMOVE
+		values = mremap(state->values, state->mmap_size, size, MREMAP_MAYMOVE);
+		if (values == MAP_FAILED)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory"),
+					 errdetail("Failed to grow median state to %zu bytes: %m.",
+							   size)));
+		madvise(values, size, MADV_HUGEPAGE);
+		state->values = values;
+		state->mmap_size = size;
+		state->allocated = size / sizeof(Datum);
+		return true;
+#endif
+	}
+
+	values = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (values == MAP_FAILED)
+	{
+		/* An already mapped array has nowhere else to go */
+		if (state->mmap_size > 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory"),
+					 errdetail("Failed to grow median state to %zu bytes: %m.",
+							   size)));
+		elog(DEBUG1, "could not map %zu bytes for median state: %m", size);
+		return false;
+	}
+	madvise(values, size, MADV_HUGEPAGE);
+
+	if (state->values != NULL)
+		memcpy(values, state->values, state->count * sizeof(Datum));
+
+	if (state->mmap_size > 0)
+		munmap(state->values, state->mmap_size);
+	else
+	{
+		if (state->values != NULL && !state->values_embedded)
+			pfree(state->values);
+
+		/* state lives in the aggregate context, so does the callback */
+		state->mmap_callback.func = unmap_values_median_state;
+		state->mmap_callback.arg = state;
+		MemoryContextRegisterResetCallback(GetMemoryChunkContext(state),
+										   &state->mmap_callback);
+	}
+
+	state->values = values;
+	state->values_embedded = false;
+	state->mmap_size = size;
+	state->allocated = size / sizeof(Datum);
+	return true;
+}
+
+/*
+ * unmap_values_median_state
+ *
+ * Memory context reset callback releasing a huge-page backed values array.
+ */
+static void
+unmap_values_median_state(void *arg)
+{
+	MedianState *state = (MedianState *) arg;
+
+	if (state->mmap_size > 0)
+		munmap(state->values, state->mmap_size);
+	state->values = NULL;
+	state->mmap_size = 0;
+	state->allocated = 0;
+}
+#endif
+
+/*
+ * state_bytes_median_state
+ *
+ * Memory used by the state, its values array and the by-reference values it
+ * keeps.
+ */
+static int64
+state_bytes_median_state(MedianState *state)
+{
+	int64		bytes = GetMemoryChunkSpace(state);
+
+	if (!state->values_embedded)
+		bytes += array_bytes_median_state(state);
+
+	return bytes + state->value_bytes;
+}
+
+/*
+ * array_bytes_median_state
+ *
+ * Memory used by the values array or text slots of a state, allocated or
+ * mapped, used or not.
+ */
+static int64
+array_bytes_median_state(MedianState *state)
+{
+	if (state->mmap_size > 0)
+		return state->mmap_size;
+	if (state->values_embedded)
+		return state->allocated * (int64) (state->slots != NULL ?
+										   sizeof(MedianTextSlot) :
+										   sizeof(Datum));
+	if (state->slots != NULL)
+		return GetMemoryChunkSpace(state->slots);
+	if (state->values != NULL)
+		return GetMemoryChunkSpace(state->values);
+
+	return 0;
+}
+
+/*
+ * context_bytes
+ *
+ * Memory allocated by a memory context and all its children, as
+ * MemoryContextStats would count it.
+ */
+static int64
+context_bytes(MemoryContext context)
+{
+	MemoryContextCounters counters;
+	int64		bytes;
+
+	memset(&counters, 0, sizeof(counters));
+	context->methods->stats(context, NULL, NULL, &counters);
+	bytes = counters.totalspace;
+
+	for (MemoryContext child = context->firstchild; child != NULL;
+		 child = child->nextchild)
+		bytes += context_bytes(child);
+
+	return bytes;
+}
+
+/*
+ * accum_time_median_stats
+ *
+ * Add the time passed since start to an EXPLAIN statistics counter.
+ */
+static void
+accum_time_median_stats(instr_time *total, instr_time start)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(*total, now, start);
+}
+
+/*
+ * discard_element_median_state
+ *
+ * Remove the first occurance of the given element we find in the state.
+ */
+static void
+discard_element_median_state(MedianState *state, Datum datum)
+{
+	int			num_elems = state->count;
+	Datum	   *elem_values;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	int			i;
+	bool		found = false;
+	Datum		removed = (Datum) 0;
+
+	if (state->slots != NULL)
+	{
+		i = median_text_slot_find(state->slots, state->count, datum);
+		if (i >= 0)
+		{
+			uint32		len = state->slots[i].len;
+
+			memmove(&state->slots[i], &state->slots[i + 1],
+					(state->count - i - 1) * sizeof(MedianTextSlot));
+			state->count--;
+
+			if (len > MEDIAN_TEXT_INLINE)
+			{
+				state->dead_bytes += len;
+				if (state->dead_bytes >= Max(state->compacted_bytes,
+											 MEDIAN_ARENA_MIN_DEAD_BYTES))
+					compact_strings_median_state(state);
+			}
+		}
+		return;
+	}
+
+	elem_values = state->values;
+
+	/* Get element type information */
+	get_typlenbyvalalign(state->inputTypeId, &typlen, &typbyval, &typalign);
+
+	/* Copy elements, excluding the first occurrence of the search element */
+	for (i = 0; i < num_elems; i++)
+	{
+		if (!found && datumIsEqual(elem_values[i], datum, typbyval, typlen))
+		{
+			/* Skip this element (delete the first occurrence) */
+			found = true;
+			removed = elem_values[i];
+			continue;
+		}
+
+		if (found)
+		{
+			/* Shift elements left to fill the gap */
+			elem_values[i - 1] = elem_values[i];
+		}
+	}
+
+	if (found)
+	{
+		state->count--;
+
+		/* A copy made by median_state_add can go, the window moved past it */
+		if (!typbyval && state->values_copied)
+		{
+			state->value_bytes -= GetMemoryChunkSpace(DatumGetPointer(removed));
+			pfree(DatumGetPointer(removed));
+		}
+	}
+
+}
+
+/*
+ * get_type_comp_method
+ *
+ * Goal is to get the suitable comparison function for the input type_oid.
+ *
+ * There is a long chain to traverse through as follows:
+ *  1. Get the operator class (pg_opclass) for the specified type.
+ *      SELECT pg_opclass.oid, pg_opclass.opcfamily WHERE opclass->opcintype == type_id;
+ *
+ *  2. Using pg_opclass.oid, pg_opclass.opcfamily, and type_oid, get pg_amproc.amproc.
+ *
+ * As these steps are already done in lookup_type_cache(), we use it here.
+ */
+TypeCacheEntry *
+get_type_comp_method(Oid type_oid)
+{
+	TypeCacheEntry *typentry;
+
+	/* Lookup the type cache entry for the given type OID. */
+	typentry = lookup_type_cache(type_oid,
+								 TYPECACHE_CMP_PROC_FINFO);
+
+	/* Check if the type has a valid comparison function. */
+	if (!OidIsValid(typentry->cmp_proc_finfo.fn_oid))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("could not identify a comparison function for type %s",
+						format_type_be(type_oid))));
 
 	return typentry;
 }
@@ -537,6 +2172,150 @@ datum_qsort_compare(const void *a, const void *b, void *arg)
 	return DatumGetInt32(result);
 }
 
+/*
+ * select_median
+ *   return median of the state, using the best selection strategy for it.
+ *
+ * The name of the strategy used is returned in *strategy, for EXPLAIN.
+ */
+static Datum
+select_median(MedianState *state, const char **strategy)
+{
+	MedianKeyKind kind = median_key_kind(state->inputTypeId);
+	Datum		result;
+
+	/*
+	 * Text slots are sorted as they are. Text has no average, so for an even
+	 * count the lower middle value is the median, as in calculate_median.
+	 */
+	if (state->slots != NULL)
+	{
+		Oid		   *collation = &state->typentry->typcollation;
+
+		qsort_arg(state->slots, state->count, sizeof(MedianTextSlot),
+				  median_text_slot_comparator(*collation), collation);
+
+		*strategy = "text slots";
+		return median_text_slot_datum(&state->slots[(state->count - 1) / 2]);
+	}
+
+	/* Huge by-value states can be selected on by background workers */
+	if (kind != MEDIAN_KEY_NONE && median_finalize_workers > 0 &&
+		state->count >= median_finalize_workers_threshold &&
+		!IsParallelWorker() &&
+		calculate_median_parallel(state, kind, &result))
+	{
+		*strategy = "background workers";
+		return result;
+	}
+
+	/* By-value types can be radix selected without sorting */
+	if (kind != MEDIAN_KEY_NONE && median_finalize_threads > 0)
+	{
+		*strategy = median_finalize_threads > 1 ? "threaded radix" : "radix";
+		return calculate_median_byval(state, kind);
+	}
+
+	/* Sort the array */
+	qsort_arg(state->values, state->count, sizeof(Datum),
+			  datum_qsort_compare, state->typentry);
+
+	*strategy = "sort";
+	return calculate_median(state);
+}
+
+/*
+ * select_ranks_median_state
+ *   find the values of several ranks within values[lo, hi).
+ *
+ * A quickselect that keeps going into every side holding a wanted rank, so k
+ * ranks take about n log k comparisons instead of the n log n of a sort.
+ * Partitions are three-way, which keeps runs of equal values from degrading
+ * it, and small ranges are sorted outright.
+ */
+static void
+select_ranks_median_state(MedianState *state, int64 lo, int64 hi,
+						  const int64 *ranks, int nranks, Datum *results)
+{
+	Datum	   *values = state->values;
+	TypeCacheEntry *typentry = state->typentry;
+
+	check_stack_depth();
+
+	while (nranks > 0)
+	{
+		Datum		pivot;
+		Datum		a,
+					b,
+					c;
+		int64		lt = lo;
+		int64		gt = hi;
+		int64		i = lo;
+		int			nleft = 0;
+		int			nmid;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (hi - lo <= 32)
+		{
+			qsort_arg(values + lo, hi - lo, sizeof(Datum),
+					  datum_qsort_compare, typentry);
+			for (int j = 0; j < nranks; j++)
+				results[j] = values[ranks[j]];
+			return;
+		}
+
+		/* Median of three pivot */
+		a = values[lo];
+		b = values[lo + (hi - lo) / 2];
+		c = values[hi - 1];
+		if (datum_qsort_compare(&a, &b, typentry) > 0)
+		{
+			pivot = a;
+			a = b;
+			b = pivot;
+		}
+		if (datum_qsort_compare(&b, &c, typentry) > 0)
+			b = datum_qsort_compare(&a, &c, typentry) > 0 ? a : c;
+		pivot = b;
+
+		/* [lo, lt) < pivot, [lt, i) == pivot, [gt, hi) > pivot */
+		while (i < gt)
+		{
+			int			cmp = datum_qsort_compare(&values[i], &pivot, typentry);
+			Datum		tmp = values[i];
+
+			if (cmp < 0)
+			{
+				values[i++] = values[lt];
+				values[lt++] = tmp;
+			}
+			else if (cmp > 0)
+			{
+				values[i] = values[--gt];
+				values[gt] = tmp;
+			}
+			else
+				i++;
+		}
+
+		while (nleft < nranks && ranks[nleft] < lt)
+			nleft++;
+		nmid = nleft;
+		while (nmid < nranks && ranks[nmid] < gt)
+			results[nmid++] = pivot;
+
+		if (nleft > 0)
+			select_ranks_median_state(state, lo, lt, ranks, nleft, results);
+
+		/* Continue with the ranks right of the pivot */
+		ranks += nmid;
+		results += nmid;
+		nranks -= nmid;
+		lo = gt;
+	}
+}
+
 /*
  * calculate_median
  *   return median of the sorted array.
@@ -564,6 +2343,63 @@ calculate_median(MedianState *state)
 	return result;
 }
 
+/*
+ * calculate_median_byval
+ *   return median of an unsorted by-value array using radix selection.
+ */
+static Datum
+calculate_median_byval(MedianState *state, MedianKeyKind kind)
+{
+	int64		midpoint = state->count / 2;
+	Datum		left;
+	Datum		right;
+
+	if (state->count % 2 == 0)
+	{
+		/* Even number of elements, average the two middle values */
+		left = median_radix_select(state->values, state->count, kind,
+								   midpoint - 1, median_finalize_threads,
+								   &right);
+
+		return calculate_average(state->inputTypeId, left, right);
+	}
+
+	return median_radix_select(state->values, state->count, kind,
+							   midpoint, median_finalize_threads, NULL);
+}
+
+/*
+ * calculate_median_parallel
+ *   compute the median of a by-value array with background workers.
+ *
+ * Returns false if the workers could not be used, the caller then has to
+ * compute the median itself.
+ */
+static bool
+calculate_median_parallel(MedianState *state, MedianKeyKind kind,
+						  Datum *result)
+{
+	int64		midpoint = state->count / 2;
+	Datum		left;
+	Datum		right;
+
+	if (state->count % 2 == 0)
+	{
+		/* Even number of elements, average the two middle values */
+		if (!median_parallel_select(state->values, state->count, kind,
+									midpoint - 1, median_finalize_workers,
+									median_finalize_threads, &left, &right))
+			return false;
+
+		*result = calculate_average(state->inputTypeId, left, right);
+		return true;
+	}
+
+	return median_parallel_select(state->values, state->count, kind,
+								  midpoint, median_finalize_workers,
+								  median_finalize_threads, result, NULL);
+}
+
 /*
  * calculate_average
  *
@@ -571,7 +2407,7 @@ calculate_median(MedianState *state)
  * of two middle values whereas for other datatypes simply using the n/2 nd
  * largest element as median.
  */
-static Datum
+Datum
 calculate_average(Oid inputTypeId, Datum left, Datum right)
 {
 	switch (inputTypeId)
@@ -0,0 +1,310 @@
+/*
+ * median.h
+ *
+ * Declarations shared between the source files of the median extension.
+ */
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <math.h>
+
+#include "access/attnum.h"
+#include "portability/instr_time.h"
+#include "utils/typcache.h"
+
+/*
+ * MedianKeyKind
+ *
+ * By-value types whose Datums can be mapped to unsigned integer keys that sort
+ * in the same order as the type's default btree opclass. Such types can be
+ * selected on with radix passes instead of comparison sorts.
+ */
+typedef enum MedianKeyKind
+{
+	MEDIAN_KEY_NONE,			/* not radix-selectable */
+	MEDIAN_KEY_INT16,			/* int2 */
+	MEDIAN_KEY_INT32,			/* int4, date */
+	MEDIAN_KEY_UINT32,			/* oid */
+	MEDIAN_KEY_INT64,			/* int8, time, timestamp, timestamptz */
+	MEDIAN_KEY_FLOAT4,			/* float4 */
+	MEDIAN_KEY_FLOAT8			/* float8 */
+} MedianKeyKind;
+
+/*
+ * median_key_bits
+ *
+ * Width of the keys of a kind, a multiple of 8.
+ */
+static inline int
+median_key_bits(MedianKeyKind kind)
+{
+	switch (kind)
+	{
+		case MEDIAN_KEY_INT16:
+			return 16;
+		case MEDIAN_KEY_INT32:
+		case MEDIAN_KEY_UINT32:
+		case MEDIAN_KEY_FLOAT4:
+			return 32;
+		case MEDIAN_KEY_INT64:
+		case MEDIAN_KEY_FLOAT8:
+			return 64;
+		default:
+			elog(ERROR, "unexpected median key kind: %d", (int) kind);
+			return 0;			/* keep compiler quiet */
+	}
+}
+
+/*
+ * median_datum_to_key
+ *
+ * Map a Datum to an unsigned key with the same ordering as the type's btree
+ * opclass. Signed integers get their sign bit flipped. For floats, negative
+ * values get all bits flipped and positive ones the sign bit, after which
+ * -0 is folded into +0 and all NaNs into a single key above +Infinity, as
+ * the float comparison functions treat them as equal.
+ *
+ * Called from the radix selection threads, so this must stay free of backend
+ * calls.
+ */
+static inline uint64
+median_datum_to_key(Datum value, MedianKeyKind kind)
+{
+	switch (kind)
+	{
+		case MEDIAN_KEY_INT16:
+			return (uint16) DatumGetInt16(value) ^ UINT64CONST(0x8000);
+		case MEDIAN_KEY_INT32:
+			return (uint32) DatumGetInt32(value) ^ UINT64CONST(0x80000000);
+		case MEDIAN_KEY_UINT32:
+			return (uint32) DatumGetObjectId(value);
+		case MEDIAN_KEY_INT64:
+			return (uint64) DatumGetInt64(value) ^ (UINT64CONST(1) << 63);
+		case MEDIAN_KEY_FLOAT4:
+			{
+				float4		f = DatumGetFloat4(value);
+				uint32		bits;
+
+				if (isnan(f))
+					return PG_UINT32_MAX;
+				if (f == 0)
+					f = 0;
+				memcpy(&bits, &f, sizeof(bits));
+				return (bits & 0x80000000) ? (uint32) ~bits : bits | 0x80000000;
+			}
+		case MEDIAN_KEY_FLOAT8:
+			{
+				float8		f = DatumGetFloat8(value);
+				uint64		bits;
+
+				if (isnan(f))
+					return PG_UINT64_MAX;
+				if (f == 0)
+					f = 0;
+				memcpy(&bits, &f, sizeof(bits));
+				return (bits & (UINT64CONST(1) << 63)) ? ~bits :
+					bits | (UINT64CONST(1) << 63);
+			}
+		default:
+			return 0;
+	}
+}
+
+/*
+ * median_key_to_datum
+ *
+ * Inverse of median_datum_to_key.
+ */
+static inline Datum
+median_key_to_datum(uint64 key, MedianKeyKind kind)
+{
+	switch (kind)
+	{
+		case MEDIAN_KEY_INT16:
+			return Int16GetDatum((int16) (uint16) (key ^ 0x8000));
+		case MEDIAN_KEY_INT32:
+			return Int32GetDatum((int32) (uint32) (key ^ 0x80000000));
+		case MEDIAN_KEY_UINT32:
+			return ObjectIdGetDatum((Oid) key);
+		case MEDIAN_KEY_INT64:
+			return Int64GetDatum((int64) (key ^ (UINT64CONST(1) << 63)));
+		case MEDIAN_KEY_FLOAT4:
+			{
+				uint32		bits = (uint32) key;
+				float4		f;
+
+				bits = (bits & 0x80000000) ? bits & 0x7FFFFFFF : ~bits;
+				memcpy(&f, &bits, sizeof(f));
+				return Float4GetDatum(f);
+			}
+		case MEDIAN_KEY_FLOAT8:
+			{
+				uint64		bits = key;
+				float8		f;
+
+				bits = (bits & (UINT64CONST(1) << 63)) ?
+					bits & ~(UINT64CONST(1) << 63) : ~bits;
+				memcpy(&f, &bits, sizeof(f));
+				return Float8GetDatum(f);
+			}
+		default:
+			elog(ERROR, "unexpected median key kind: %d", (int) kind);
+			return (Datum) 0;	/* keep compiler quiet */
+	}
+}
+
+/*
+ * MedianAggStats
+ *
+ * Statistics of one median aggregate, collected for EXPLAIN ANALYZE when
+ * median.explain is on.
+ */
+typedef struct MedianAggStats
+{
+	Oid			inputTypeId;	/* input data type of the aggregate */
+	int64		states_created; /* states created by support functions */
+	int64		peak_state_bytes;	/* largest state seen in finalize */
+	int64		peak_context_bytes; /* its memory context, at that time */
+	const char *strategy;		/* selection strategy of last finalize */
+	instr_time	trans_time;		/* time spent in transition functions */
+	instr_time	combine_time;	/* time spent in combine functions */
+	instr_time	final_time;		/* time spent in final functions */
+	int64		serialized_bytes;	/* bytes of deserialized partial states */
+} MedianAggStats;
+
+/*
+ * MedianState
+ *
+ * Transition state of the median aggregate, see median.c. Other parts of the
+ * extension build states with the median_state_* functions.
+ */
+typedef struct MedianState MedianState;
+
+/*
+ * MedianTextSlot
+ *
+ * A value of a text or varchar median state, see median_text.c. Strings of up
+ * to MEDIAN_TEXT_INLINE bytes are stored in data and u.rest, longer ones have
+ * their first bytes in data and all of them at u.ptr.
+ */
+typedef struct MedianTextSlot
+{
+	uint32		len;			/* length of the string in bytes */
+	char		data[4];		/* first bytes of the string */
+	union
+	{
+		char		rest[8];	/* further bytes of an inline string */
+		const char *ptr;		/* the string, if not inline */
+	}			u;
+} MedianTextSlot;
+
+#define MEDIAN_TEXT_INLINE	12
+
+/*
+ * MedianCallCache
+ *
+ * What the support functions of the median aggregates keep in fn_extra, so
+ * that work done for every group is only done once per call site.
+ */
+typedef struct MedianCallCache
+{
+	Oid			typid;			/* type typentry belongs to, or InvalidOid */
+	TypeCacheEntry *typentry;	/* comparison info of typid */
+	uint64		explain_generation; /* EXPLAIN explain_stats belong to */
+	MedianAggStats *explain_stats;	/* see median_explain_stats */
+} MedianCallCache;
+
+/* median.c */
+extern MedianCallCache *median_call_cache(FunctionCallInfo fcinfo);
+extern MedianState *median_state_create(Oid inputTypeId);
+extern void median_state_add(MedianState *state, Datum value);
+extern void median_state_reset(MedianState *state);
+extern Oid	median_state_type(MedianState *state);
+extern int64 median_state_count(MedianState *state);
+extern Datum median_state_median(MedianState *state);
+extern Datum *median_state_values(MedianState *state);
+extern Datum *median_state_sorted_values(MedianState *state);
+extern void median_state_select_ranks(MedianState *state, const int64 *ranks,
+									  int nranks, Datum *results);
+extern Size median_state_serialized_size(MedianState *state);
+extern bytea *median_state_serialize(MedianState *state);
+extern MedianState *median_state_deserialize(bytea *state_bytes);
+extern MedianState *median_state_deserialize_trusted(bytea *state_bytes);
+extern void median_state_check_type(Oid typid);
+extern void median_state_check_value(Oid typid, Datum value);
+extern void median_state_combine(MedianState *state1, MedianState *state2);
+extern TypeCacheEntry *get_type_comp_method(Oid type_oid);
+extern Datum calculate_average(Oid inputTypeId, Datum left, Datum right);
+
+/* median_text.c */
+extern bool median_text_slot_type(Oid typid);
+extern void median_text_slot_set(MedianTextSlot *slot, const char *data,
+								 uint32 len, bool copy);
+extern Size median_text_slot_set_datum(MedianTextSlot *slot, Datum value);
+extern Datum median_text_slot_datum(const MedianTextSlot *slot);
+extern int64 median_text_slot_find(const MedianTextSlot *slots, int64 count,
+								   Datum value);
+extern Size median_text_slot_size(const MedianTextSlot *slot);
+extern char *median_text_slot_write(char *p, const MedianTextSlot *slot);
+extern qsort_arg_comparator median_text_slot_comparator(Oid collation);
+
+/* median_explain.c */
+extern bool median_explain_collecting;
+extern void median_explain_init(void);
+extern MedianAggStats *median_explain_stats(FunctionCallInfo fcinfo,
+											Oid inputTypeId);
+
+/*
+ * Log-bucketed quantile sketches, see median_sketch.c. Estimates are within
+ * MEDIAN_SKETCH_ALPHA relative error for magnitudes between about 1e-18 and
+ * 1e18.
+ */
+#define MEDIAN_SKETCH_ALPHA		0.01
+#define MEDIAN_SKETCH_BUCKETS	4096	/* buckets per sign */
+#define MEDIAN_SKETCH_ZERO_SLOT MEDIAN_SKETCH_BUCKETS
+#define MEDIAN_SKETCH_SLOTS		(2 * MEDIAN_SKETCH_BUCKETS + 1)
+
+/* median_sketch.c */
+extern int	median_sketch_slot(float8 value);
+extern float8 median_sketch_slot_value(int slot);
+extern float8 median_sketch_quantile(const int64 *counts, int64 total,
+									 float8 fraction);
+
+/* median_track.c */
+extern void median_track_init(void);
+
+/* median_registry.c */
+extern void median_registry_init(void);
+extern AttrNumber median_check_column(Oid relid, Name attname,
+									  bool partitioned_ok);
+extern void median_switch_to_owner(Oid relid, Oid *save_userid,
+								   int *save_sec_context);
+extern Oid	median_catalog_relid(Oid funcid, const char *relname);
+
+/* median_select.c */
+extern MedianKeyKind median_key_kind(Oid typid);
+extern Datum median_radix_select(const Datum *values, int64 count,
+								 MedianKeyKind kind, int64 rank,
+								 int nthreads, Datum *next);
+extern uint64 median_radix_select_keys(const uint64 *keys, int64 count,
+									   MedianKeyKind kind, int64 rank,
+									   int nthreads, uint64 *next);
+
+/* median_parallel.c */
+extern bool median_parallel_select(const Datum *values, int64 count,
+								   MedianKeyKind kind, int64 rank,
+								   int nworkers, int nthreads,
+								   Datum *result, Datum *next);
+
+/* median_sorted.c */
+extern void median_merge_runs(const Datum *values, const int64 *run_ends,
+							  int nruns, TypeCacheEntry *typentry,
+							  Datum *result);
+
+/* median_scan.c */
+extern void median_scan_init(void);
+
+#endif							/* MEDIAN_H */
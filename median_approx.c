@@ -0,0 +1,246 @@
+/*
+ * median_approx.c
+ *
+ * Approximate median aggregate over a log-bucketed sketch.
+ *
+ * approx_median keeps a sketch (see median_sketch.c) instead of the values, so
+ * its state has the same size however many rows it saw. Adding a row and, in
+ * a moving window, removing one are a counter increment and decrement, and
+ * the final function walks the buckets once. The estimate is within
+ * MEDIAN_SKETCH_ALPHA relative error of the value of rank ceil(n / 2), like
+ * median_tracked(..., 0.5). NaNs cannot be placed in a bucket and are ignored.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "libpq/pqformat.h"
+
+#include "median.h"
+
+/*
+ * ApproxMedianState
+ *
+ * Transition state of approx_median.
+ */
+typedef struct ApproxMedianState
+{
+	int64		total;			/* values counted */
+	int64		counts[MEDIAN_SKETCH_SLOTS];
+} ApproxMedianState;
+
+static ApproxMedianState *approx_median_state(FunctionCallInfo fcinfo);
+
+PG_FUNCTION_INFO_V1(approx_median_transfn);
+PG_FUNCTION_INFO_V1(approx_median_invfn);
+PG_FUNCTION_INFO_V1(approx_median_finalfn);
+PG_FUNCTION_INFO_V1(approx_median_combinefn);
+PG_FUNCTION_INFO_V1(approx_median_serialfn);
+PG_FUNCTION_INFO_V1(approx_median_deserialfn);
+
+
+/*
+ * approx_median_transfn
+ *
+ * Count a value.
+ */
+Datum
+approx_median_transfn(PG_FUNCTION_ARGS)
+{
+	ApproxMedianState *state = approx_median_state(fcinfo);
+
+	if (!PG_ARGISNULL(1))
+	{
+		int			slot = median_sketch_slot(PG_GETARG_FLOAT8(1));
+
+		if (slot >= 0)
+		{
+			state->counts[slot]++;
+			state->total++;
+		}
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * approx_median_invfn
+ *
+ * Inverse transition function of the moving aggregate, uncount a value.
+ */
+Datum
+approx_median_invfn(PG_FUNCTION_ARGS)
+{
+	ApproxMedianState *state;
+
+	/* Should not get here with no state */
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "approx_median_invfn called with NULL state");
+
+	state = (ApproxMedianState *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		int			slot = median_sketch_slot(PG_GETARG_FLOAT8(1));
+
+		if (slot >= 0)
+		{
+			Assert(state->counts[slot] > 0);
+			state->counts[slot]--;
+			state->total--;
+		}
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * approx_median_finalfn
+ *
+ * Estimated median, NULL if no values are counted.
+ */
+Datum
+approx_median_finalfn(PG_FUNCTION_ARGS)
+{
+	ApproxMedianState *state;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (ApproxMedianState *) PG_GETARG_POINTER(0);
+	if (state->total == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(median_sketch_quantile(state->counts, state->total, 0.5));
+}
+
+/*
+ * approx_median_combinefn
+ *
+ * Add the counts of state2 to state1.
+ */
+Datum
+approx_median_combinefn(PG_FUNCTION_ARGS)
+{
+	ApproxMedianState *state1;
+	ApproxMedianState *state2;
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	state1 = approx_median_state(fcinfo);
+	state2 = (ApproxMedianState *) PG_GETARG_POINTER(1);
+
+	for (int slot = 0; slot < MEDIAN_SKETCH_SLOTS; slot++)
+		state1->counts[slot] += state2->counts[slot];
+	state1->total += state2->total;
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * approx_median_serialfn
+ *
+ * Serialize a state as the number of used slots followed by slot and count
+ * pairs, most slots being empty.
+ */
+Datum
+approx_median_serialfn(PG_FUNCTION_ARGS)
+{
+	ApproxMedianState *state;
+	StringInfoData buf;
+	int			used = 0;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state = (ApproxMedianState *) PG_GETARG_POINTER(0);
+
+	for (int slot = 0; slot < MEDIAN_SKETCH_SLOTS; slot++)
+		if (state->counts[slot] != 0)
+			used++;
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, used);
+	for (int slot = 0; slot < MEDIAN_SKETCH_SLOTS; slot++)
+	{
+		if (state->counts[slot] == 0)
+			continue;
+		pq_sendint32(&buf, slot);
+		pq_sendint64(&buf, state->counts[slot]);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * approx_median_deserialfn
+ *
+ * Rebuild a state from approx_median_serialfn in the aggregate memory
+ * context.
+ */
+Datum
+approx_median_deserialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	ApproxMedianState *state;
+	bytea	   *bytes;
+	StringInfoData buf;
+	int			used;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	bytes = PG_GETARG_BYTEA_PP(0);
+	buf.data = VARDATA_ANY(bytes);
+	buf.len = VARSIZE_ANY_EXHDR(bytes);
+	buf.maxlen = buf.len;
+	buf.cursor = 0;
+
+	state = (ApproxMedianState *) MemoryContextAllocZero(agg_context,
+														 sizeof(ApproxMedianState));
+
+	used = pq_getmsgint(&buf, 4);
+	for (int i = 0; i < used; i++)
+	{
+		int			slot = pq_getmsgint(&buf, 4);
+
+		if (slot < 0 || slot >= MEDIAN_SKETCH_SLOTS)
+			elog(ERROR, "invalid approx_median state slot %d", slot);
+		state->counts[slot] = pq_getmsgint64(&buf);
+		state->total += state->counts[slot];
+	}
+	pq_getmsgend(&buf);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * approx_median_state
+ *
+ * The state passed as first argument, or a new one in the aggregate memory
+ * context if it is NULL.
+ */
+static ApproxMedianState *
+approx_median_state(FunctionCallInfo fcinfo)
+{
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	if (!PG_ARGISNULL(0))
+		return (ApproxMedianState *) PG_GETARG_POINTER(0);
+
+	return (ApproxMedianState *) MemoryContextAllocZero(agg_context,
+														sizeof(ApproxMedianState));
+}
@@ -0,0 +1,246 @@
+/*
+ * median_bucket.c
+ *
+ * Medians of consecutive time buckets of an ordered time series.
+ *
+ * GROUP BY on a bucketed timestamp builds one median state per bucket,
+ * hashed or sorted by the executor. The bucketed_medians aggregate instead
+ * takes its input ordered by time and keeps a single state: when a row falls
+ * into a later bucket, the median of the open bucket is taken, appended to
+ * the result and the state emptied for the next bucket, so memory is bounded
+ * by the largest bucket. The result is an array of median_bucket.
+ *
+ * Buckets are aligned to Monday 2000-01-03 00:00 UTC, like time_bucket of
+ * TimescaleDB, so that weekly buckets start on Mondays.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "common/int.h"
+#include "funcapi.h"
+#include "utils/array.h"
+#include "utils/datetime.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+
+#include "median.h"
+
+/* Start of the first bucket, 2000-01-03 */
+#define MEDIAN_BUCKET_ORIGIN	(2 * USECS_PER_DAY)
+
+/*
+ * MedianBuckets
+ *
+ * Transition state of bucketed_medians.
+ */
+typedef struct MedianBuckets
+{
+	int64		width;			/* bucket width in microseconds */
+	bool		open;			/* is a bucket being filled? */
+	TimestampTz current;		/* start of the open bucket */
+	MedianState *values;		/* values of the open bucket */
+	int64		nbuckets;		/* closed buckets */
+	int64		allocated;		/* allocated size of starts and medians */
+	TimestampTz *starts;		/* start of each closed bucket */
+	float8	   *medians;		/* median of each closed bucket */
+} MedianBuckets;
+
+static void close_bucket(MedianBuckets *state);
+
+PG_FUNCTION_INFO_V1(bucketed_medians_transfn);
+PG_FUNCTION_INFO_V1(bucketed_medians_finalfn);
+
+
+/*
+ * bucketed_medians_transfn
+ *
+ * Add a value to the open bucket, closing it first if the value belongs to
+ * a later one.
+ */
+Datum
+bucketed_medians_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	MedianBuckets *state;
+	TimestampTz ts;
+	TimestampTz start;
+	int64		offset;
+	int64		delta;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "bucketed_medians_transfn called in non-aggregate context");
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	if (PG_ARGISNULL(0))
+	{
+		Interval   *width;
+
+		if (PG_ARGISNULL(3))
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("bucket width must not be null")));
+
+		width = PG_GETARG_INTERVAL_P(3);
+		if (width->month != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("bucket widths with months are not supported")));
+
+		state = (MedianBuckets *) palloc0(sizeof(MedianBuckets));
+		state->width = width->time + width->day * USECS_PER_DAY;
+		if (state->width <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("bucket width must be positive")));
+
+		state->values = median_state_create(FLOAT8OID);
+		state->allocated = 16;
+		state->starts = (TimestampTz *) palloc(state->allocated * sizeof(TimestampTz));
+		state->medians = (float8 *) palloc(state->allocated * sizeof(float8));
+	}
+	else
+		state = (MedianBuckets *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		MemoryContextSwitchTo(old_context);
+		PG_RETURN_POINTER(state);
+	}
+
+	ts = PG_GETARG_TIMESTAMPTZ(1);
+	if (TIMESTAMP_NOT_FINITE(ts) ||
+		pg_sub_s64_overflow(ts, MEDIAN_BUCKET_ORIGIN, &offset))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+				 errmsg("timestamp out of range")));
+
+	delta = offset % state->width;
+	if (delta < 0)
+		delta += state->width;
+	start = ts - delta;
+
+	if (state->open && start != state->current)
+	{
+		if (start < state->current)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("input of bucketed_medians must be ordered by time"),
+					 errdetail("Timestamp %s comes after the bucket starting at %s.",
+							   timestamptz_to_str(ts),
+							   timestamptz_to_str(state->current)),
+					 errhint("Add ORDER BY to the aggregate call.")));
+
+		close_bucket(state);
+	}
+
+	state->current = start;
+	state->open = true;
+	median_state_add(state->values, PG_GETARG_DATUM(2));
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * bucketed_medians_finalfn
+ *
+ * Array of the buckets and their medians, the open bucket included.
+ */
+Datum
+bucketed_medians_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianBuckets *state;
+	Oid			elemtype;
+	TupleDesc	tupdesc;
+	Datum	   *elems;
+	int16		elmlen;
+	bool		elmbyval;
+	char		elmalign;
+	int64		n;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state = (MedianBuckets *) PG_GETARG_POINTER(0);
+
+	n = state->nbuckets + (state->open ? 1 : 0);
+	if (n == 0)
+		PG_RETURN_NULL();
+
+	if ((Size) n > MaxAllocSize / sizeof(Datum))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many buckets")));
+
+	elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+	if (!OidIsValid(elemtype))
+		elog(ERROR, "could not determine result type of bucketed_medians");
+
+	tupdesc = lookup_rowtype_tupdesc_copy(elemtype, -1);
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	elems = (Datum *) palloc(n * sizeof(Datum));
+	for (int64 i = 0; i < n; i++)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+
+		/* The open bucket stays open, more rows may come in a window */
+		if (i < state->nbuckets)
+		{
+			values[0] = TimestampTzGetDatum(state->starts[i]);
+			values[1] = Float8GetDatum(state->medians[i]);
+		}
+		else
+		{
+			values[0] = TimestampTzGetDatum(state->current);
+			values[1] = median_state_median(state->values);
+		}
+
+		elems[i] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+	}
+
+	get_typlenbyvalalign(elemtype, &elmlen, &elmbyval, &elmalign);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, (int) n, elemtype,
+										  elmlen, elmbyval, elmalign));
+}
+
+/*
+ * close_bucket
+ *
+ * Append the open bucket to the closed ones and empty the values state for
+ * the next. Called in the aggregate memory context.
+ */
+static void
+close_bucket(MedianBuckets *state)
+{
+	if (state->nbuckets == state->allocated)
+	{
+		if ((Size) state->allocated * 2 > MaxAllocSize / sizeof(float8))
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("too many buckets")));
+
+		state->allocated *= 2;
+		state->starts = (TimestampTz *) repalloc(state->starts,
+												 state->allocated * sizeof(TimestampTz));
+		state->medians = (float8 *) repalloc(state->medians,
+											 state->allocated * sizeof(float8));
+	}
+
+	state->starts[state->nbuckets] = state->current;
+	state->medians[state->nbuckets] = DatumGetFloat8(median_state_median(state->values));
+	state->nbuckets++;
+
+	median_state_reset(state->values);
+	state->open = false;
+}
@@ -0,0 +1,288 @@
+/*
+ * median_ci.c
+ *
+ * Distribution-free confidence intervals for the median.
+ *
+ * For n values, the number of them below the true median is Binomial(n, 1/2)
+ * distributed, whatever their distribution. So the order statistics
+ * X(j) and X(n - j + 1) cover the median with probability
+ * 1 - 2 P(B <= j - 1), and the interval of median_ci uses the largest j for
+ * which that is at least the requested confidence. Those two ranks and the
+ * median are then found by one multi-rank selection over a median state.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <math.h>
+
+#include "utils/array.h"
+#include "utils/float.h"
+#include "utils/lsyscache.h"
+
+#include "median.h"
+
+/*
+ * MedianCIState
+ *
+ * Transition state of median_ci. The confidence comes from the first row.
+ */
+typedef struct MedianCIState
+{
+	float8		confidence;
+	MedianState *values;
+} MedianCIState;
+
+static int64 median_ci_lower_rank(int64 n, float8 confidence);
+
+PG_FUNCTION_INFO_V1(median_ci_transfn);
+PG_FUNCTION_INFO_V1(median_ci_combinefn);
+PG_FUNCTION_INFO_V1(median_ci_serialfn);
+PG_FUNCTION_INFO_V1(median_ci_deserialfn);
+PG_FUNCTION_INFO_V1(median_ci_finalfn);
+
+
+/*
+ * median_ci_transfn
+ *
+ * Add a value to the state, creating it on the first call.
+ */
+Datum
+median_ci_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	MedianCIState *state;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "median_ci_transfn called in non-aggregate context");
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	if (PG_ARGISNULL(0))
+	{
+		Oid			inputTypeId = get_fn_expr_argtype(fcinfo->flinfo, 1);
+		float8		confidence;
+
+		if (inputTypeId == InvalidOid)
+			elog(ERROR, "could not determine input data type");
+
+		confidence = PG_ARGISNULL(2) ? get_float8_nan() : PG_GETARG_FLOAT8(2);
+		if (!(confidence > 0 && confidence < 1))
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("confidence %g is out of range (0, 1)", confidence)));
+
+		state = (MedianCIState *) palloc(sizeof(MedianCIState));
+		state->confidence = confidence;
+		state->values = median_state_create(inputTypeId);
+	}
+	else
+		state = (MedianCIState *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+		median_state_add(state->values, PG_GETARG_DATUM(1));
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * median_ci_combinefn
+ *
+ * Combine two partial states. The values of state2 are not copied, it lives
+ * in the aggregate context as well.
+ */
+Datum
+median_ci_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	MedianCIState *state1;
+	MedianCIState *state2;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (MedianCIState *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (MedianCIState *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+		PG_RETURN_POINTER(state1);
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	/* state2 is not used after this, its values can be taken over */
+	if (state1 == NULL)
+	{
+		state1 = (MedianCIState *) palloc(sizeof(MedianCIState));
+		*state1 = *state2;
+	}
+	else
+		median_state_combine(state1->values, state2->values);
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * median_ci_serialfn
+ *
+ * The confidence followed by the serialized median state.
+ */
+Datum
+median_ci_serialfn(PG_FUNCTION_ARGS)
+{
+	MedianCIState *state;
+	bytea	   *values;
+	bytea	   *result;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state = (MedianCIState *) PG_GETARG_POINTER(0);
+	values = median_state_serialize(state->values);
+
+	result = (bytea *) palloc(VARHDRSZ + sizeof(float8) + VARSIZE(values));
+	SET_VARSIZE(result, VARHDRSZ + sizeof(float8) + VARSIZE(values));
+	memcpy(VARDATA(result), &state->confidence, sizeof(float8));
+	memcpy(VARDATA(result) + sizeof(float8), values, VARSIZE(values));
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * median_ci_deserialfn
+ *
+ * Rebuild a state from median_ci_serialfn in the aggregate memory context.
+ */
+Datum
+median_ci_deserialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	MedianCIState *state;
+	bytea	   *bytes;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	bytes = PG_GETARG_BYTEA_P(0);
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	state = (MedianCIState *) palloc(sizeof(MedianCIState));
+	memcpy(&state->confidence, VARDATA(bytes), sizeof(float8));
+	state->values = median_state_deserialize_trusted((bytea *) (VARDATA(bytes) + sizeof(float8)));
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * median_ci_finalfn
+ *
+ * Array of the lower bound, the median and the upper bound. The bounds are
+ * NULL if there are too few values to reach the confidence.
+ */
+Datum
+median_ci_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianCIState *state;
+	Oid			typid;
+	int64		count;
+	int64		lower;
+	int64		ranks[4];
+	Datum		found[4];
+	int			nranks = 0;
+	Datum		elems[3];
+	bool		nulls[3] = {false, false, false};
+	int			dims[1] = {3};
+	int			lbs[1] = {1};
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (MedianCIState *) PG_GETARG_POINTER(0);
+
+	count = median_state_count(state->values);
+	if (count == 0)
+		PG_RETURN_NULL();
+
+	typid = median_state_type(state->values);
+	lower = median_ci_lower_rank(count, state->confidence);
+
+	/* Ranks in ascending order: lower bound, median, upper bound */
+	if (lower >= 0)
+		ranks[nranks++] = lower;
+	if (count % 2 == 0)
+		ranks[nranks++] = count / 2 - 1;
+	ranks[nranks++] = count / 2;
+	if (lower >= 0)
+		ranks[nranks++] = count - 1 - lower;
+
+	median_state_select_ranks(state->values, ranks, nranks, found);
+
+	if (lower >= 0)
+	{
+		elems[0] = found[0];
+		elems[2] = found[nranks - 1];
+	}
+	else
+		nulls[0] = nulls[2] = true;
+
+	if (count % 2 == 0)
+		elems[1] = calculate_average(typid, found[lower >= 0 ? 1 : 0],
+									 found[lower >= 0 ? 2 : 1]);
+	else
+		elems[1] = found[lower >= 0 ? 1 : 0];
+
+	get_typlenbyvalalign(typid, &typlen, &typbyval, &typalign);
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, 1, dims, lbs, typid,
+											 typlen, typbyval, typalign));
+}
+
+/*
+ * median_ci_lower_rank
+ *
+ * 0-based rank of the lower bound of the interval for n values, -1 if even
+ * the minimum and maximum do not reach the confidence.
+ *
+ * We add up Binomial(n, 1/2) probabilities from the bottom until they exceed
+ * (1 - confidence) / 2. Terms more than 10 standard deviations below n / 2
+ * add less than 1e-22 and are skipped, so this takes O(sqrt(n)) steps.
+ */
+static int64
+median_ci_lower_rank(int64 n, float8 confidence)
+{
+	float8		tail = (1.0 - confidence) / 2.0;
+	float8		sd = sqrt((float8) n) / 2.0;
+	int64		i = Max(0, (int64) floor(n / 2.0 - 10.0 * sd));
+	float8		pmf;
+	float8		cdf = 0;
+
+	pmf = exp(lgamma(n + 1.0) - lgamma(i + 1.0) - lgamma(n - i + 1.0) -
+			  n * log(2.0));
+
+	for (; i <= n; i++)
+	{
+		cdf += pmf;
+		if (cdf > tail)
+			break;
+		pmf *= (float8) (n - i) / (i + 1);
+	}
+
+	return i - 1;
+}
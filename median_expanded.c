@@ -0,0 +1,472 @@
+/*
+ * median_expanded.c
+ *
+ * The median_state type and its expanded representation.
+ *
+ * A median_state value holds the same bytes as the states of median_state_agg
+ * (and casts to and from bytea, the bytes being checked on the way in), but
+ * in memory it is expanded into an array of Datums, so that
+ *
+ *   s := median_state_add(s, val);
+ *
+ * in a PL/pgSQL loop does not deserialize, copy and flatten a growing bytea
+ * for every value.
+ *
+ * PL/pgSQL only hands read-write pointers to a few built-in functions, so
+ * median_state_add mostly sees a read-only state it may not change. To still
+ * append in constant time, the value arrays are shared: every expanded state
+ * sees the first count values of a MedianValues buffer, and a new state
+ * derived from one that sees all of the buffer's values appends to the buffer
+ * instead of copying it. The old state is unaffected, it does not look past
+ * its own count. Only appending to a state whose buffer has already been
+ * extended by another copies the values.
+ *
+ * The buffer is referenced by all states sharing it, which can live in
+ * different memory contexts, so it gets a context of its own under
+ * TopMemoryContext, deleted by the reset callback of the last state using it.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/expandeddatum.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "median.h"
+
+#define EMS_MAGIC	0x4D455853		/* ID for debugging crosschecks */
+
+/*
+ * MedianValues
+ *
+ * Append-only values buffer shared between expanded states.
+ */
+typedef struct MedianValues
+{
+	MemoryContext context;		/* holds this, values and by-ref copies */
+	int			refcount;		/* expanded states using the buffer */
+	int64		used;			/* values appended so far */
+	int64		allocated;		/* allocated size of values */
+	Datum	   *values;
+} MedianValues;
+
+/*
+ * ExpandedMedianState
+ *
+ * Expanded median_state, seeing the first count values of shared.
+ */
+typedef struct ExpandedMedianState
+{
+	ExpandedObjectHeader hdr;
+	int			ems_magic;		/* EMS_MAGIC */
+	Oid			typid;			/* type of the values */
+	int16		typlen;
+	bool		typbyval;
+	int64		count;
+	MedianValues *shared;
+	MemoryContextCallback release;	/* drops the reference to shared */
+	bytea	   *flat;			/* flat form, built on demand */
+} ExpandedMedianState;
+
+static Size EMS_get_flat_size(ExpandedObjectHeader *eohptr);
+static void EMS_flatten_into(ExpandedObjectHeader *eohptr,
+							 void *result, Size allocated_size);
+
+static const ExpandedObjectMethods EMS_methods =
+{
+	EMS_get_flat_size,
+	EMS_flatten_into
+};
+
+static ExpandedMedianState *ems_create(Oid typid, MedianValues *shared);
+static ExpandedMedianState *ems_get(Datum d);
+static void ems_append(ExpandedMedianState *ems, Datum value);
+static MedianState *ems_flat_state(ExpandedMedianState *ems);
+static MedianValues *values_create(int64 allocated);
+static void values_release(void *arg);
+
+PG_FUNCTION_INFO_V1(median_state_in);
+PG_FUNCTION_INFO_V1(median_state_from_bytea);
+PG_FUNCTION_INFO_V1(median_state_append);
+PG_FUNCTION_INFO_V1(median_state_result);
+
+
+/*
+ * median_state_in
+ *
+ * Input function of median_state. The text form is that of bytea, but only
+ * the bytes of a valid state are accepted, values included.
+ */
+Datum
+median_state_in(PG_FUNCTION_ARGS)
+{
+	Datum		result = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+
+	/* Raises an error if the bytes are not a state */
+	median_state_deserialize((bytea *) DatumGetPointer(result));
+
+	PG_RETURN_DATUM(result);
+}
+
+/*
+ * median_state_from_bytea
+ *
+ * Cast from bytea to median_state, checking the bytes like median_state_in.
+ * As median_state values can only be made by these two functions and by the
+ * functions of this module, the functions reading them can trust them.
+ */
+Datum
+median_state_from_bytea(PG_FUNCTION_ARGS)
+{
+	bytea	   *bytes = PG_GETARG_BYTEA_P(0);
+
+	/* Raises an error if the bytes are not a state */
+	median_state_deserialize(bytes);
+
+	PG_RETURN_BYTEA_P(bytes);
+}
+
+/*
+ * median_state_append
+ *
+ * Add a value to a median_state, creating the state if it is NULL.
+ */
+Datum
+median_state_append(PG_FUNCTION_ARGS)
+{
+	Oid			typid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	ExpandedMedianState *ems;
+
+	if (!OidIsValid(typid))
+		elog(ERROR, "could not determine input data type");
+
+	if (PG_ARGISNULL(0))
+	{
+		if (PG_ARGISNULL(1))
+			PG_RETURN_NULL();
+
+		ems = ems_create(typid, NULL);
+	}
+	else if (VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(PG_GETARG_DATUM(0))))
+	{
+		/* We own it, change it in place */
+		ems = (ExpandedMedianState *) DatumGetEOHP(PG_GETARG_DATUM(0));
+		Assert(ems->ems_magic == EMS_MAGIC);
+	}
+	else if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(PG_GETARG_DATUM(0))))
+	{
+		ExpandedMedianState *source = ems_get(PG_GETARG_DATUM(0));
+
+		/* A new state over the same values, which it may append to */
+		ems = ems_create(source->typid, source->shared);
+		ems->count = source->count;
+	}
+	else
+	{
+		/* A fresh expansion of a flat state is ours to change */
+		ems = ems_get(PG_GETARG_DATUM(0));
+	}
+
+	if (ems->typid != typid)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("median state holds values of type %s, not %s",
+						format_type_be(ems->typid),
+						format_type_be(typid))));
+
+	if (!PG_ARGISNULL(1))
+		ems_append(ems, PG_GETARG_DATUM(1));
+
+	PG_RETURN_DATUM(EOHPGetRWDatum(&ems->hdr));
+}
+
+/*
+ * median_state_result
+ *
+ * Median of a median_state in text form, NULL if it is empty.
+ */
+Datum
+median_state_result(PG_FUNCTION_ARGS)
+{
+	Datum		d = PG_GETARG_DATUM(0);
+	MedianState *state;
+	Oid			typoutput;
+	bool		typisvarlena;
+
+	/* Selection reorders the values, work on a copy of them */
+	if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(d)))
+		state = ems_flat_state(ems_get(d));
+	else
+		state = median_state_deserialize_trusted((bytea *) PG_DETOAST_DATUM(d));
+
+	if (median_state_count(state) == 0)
+		PG_RETURN_NULL();
+
+	getTypeOutputInfo(median_state_type(state), &typoutput, &typisvarlena);
+
+	PG_RETURN_TEXT_P(cstring_to_text(OidOutputFunctionCall(typoutput,
+														   median_state_median(state))));
+}
+
+/*
+ * ems_create
+ *
+ * Create an empty expanded state in the current memory context, using the
+ * given values buffer or a new one if shared is NULL.
+ */
+static ExpandedMedianState *
+ems_create(Oid typid, MedianValues *shared)
+{
+	ExpandedMedianState *ems;
+	MemoryContext objcxt;
+
+	/* Checks that the type can be compared */
+	get_type_comp_method(typid);
+
+	objcxt = AllocSetContextCreate(CurrentMemoryContext,
+								   "expanded median state",
+								   ALLOCSET_SMALL_SIZES);
+
+	ems = (ExpandedMedianState *) MemoryContextAllocZero(objcxt,
+														 sizeof(ExpandedMedianState));
+	EOH_init_header(&ems->hdr, &EMS_methods, objcxt);
+	ems->ems_magic = EMS_MAGIC;
+	ems->typid = typid;
+	get_typlenbyval(typid, &ems->typlen, &ems->typbyval);
+
+	ems->release.func = values_release;
+	ems->release.arg = ems;
+	MemoryContextRegisterResetCallback(objcxt, &ems->release);
+
+	if (shared != NULL)
+		shared->refcount++;
+	else
+	{
+		shared = values_create(8);
+		MemoryContextSetParent(shared->context, TopMemoryContext);
+	}
+	ems->shared = shared;
+
+	return ems;
+}
+
+/*
+ * ems_get
+ *
+ * Expanded form of a median_state Datum, expanding a flat one in the current
+ * memory context.
+ */
+static ExpandedMedianState *
+ems_get(Datum d)
+{
+	ExpandedMedianState *ems;
+	MedianState *state;
+	MemoryContext old_context;
+	Datum	   *values;
+	int64		count;
+
+	if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(d)))
+	{
+		ems = (ExpandedMedianState *) DatumGetEOHP(d);
+		Assert(ems->ems_magic == EMS_MAGIC);
+		return ems;
+	}
+
+	state = median_state_deserialize_trusted((bytea *) PG_DETOAST_DATUM(d));
+	count = median_state_count(state);
+	values = median_state_values(state);
+
+	ems = ems_create(median_state_type(state), NULL);
+
+	if (count > ems->shared->allocated)
+	{
+		ems->shared->allocated = count;
+		ems->shared->values = (Datum *) repalloc_huge(ems->shared->values,
+													  count * sizeof(Datum));
+	}
+
+	old_context = MemoryContextSwitchTo(ems->shared->context);
+	for (int64 i = 0; i < count; i++)
+		ems->shared->values[i] = ems->typbyval ? values[i] :
+			datumCopy(values[i], false, ems->typlen);
+	MemoryContextSwitchTo(old_context);
+
+	ems->shared->used = count;
+	ems->count = count;
+
+	return ems;
+}
+
+/*
+ * ems_append
+ *
+ * Append a value to an expanded state we may change.
+ */
+static void
+ems_append(ExpandedMedianState *ems, Datum value)
+{
+	MedianValues *shared = ems->shared;
+	MemoryContext old_context;
+
+	/* Another state appended to the buffer, continue on a copy */
+	if (shared->used != ems->count)
+	{
+		MedianValues *copy = values_create(Max(ems->count * 2, 8));
+
+		memcpy(copy->values, shared->values, ems->count * sizeof(Datum));
+		old_context = MemoryContextSwitchTo(copy->context);
+		if (!ems->typbyval)
+			for (int64 i = 0; i < ems->count; i++)
+				copy->values[i] = datumCopy(copy->values[i], false, ems->typlen);
+		MemoryContextSwitchTo(old_context);
+		copy->used = ems->count;
+
+		values_release(ems);
+		ems->shared = shared = copy;
+		MemoryContextSetParent(shared->context, TopMemoryContext);
+	}
+
+	if (shared->used == shared->allocated)
+	{
+		shared->allocated *= 2;
+		shared->values = (Datum *) repalloc_huge(shared->values,
+												 shared->allocated * sizeof(Datum));
+	}
+
+	if (!ems->typbyval)
+	{
+		old_context = MemoryContextSwitchTo(shared->context);
+		if (ems->typlen == -1)
+			value = PointerGetDatum(PG_DETOAST_DATUM_PACKED(value));
+		value = datumCopy(value, false, ems->typlen);
+		MemoryContextSwitchTo(old_context);
+	}
+
+	shared->values[shared->used++] = value;
+	ems->count++;
+
+	/* The flat form is out of date */
+	if (ems->flat != NULL)
+	{
+		pfree(ems->flat);
+		ems->flat = NULL;
+	}
+}
+
+/*
+ * ems_flat_state
+ *
+ * A median state with copies of the values of an expanded state, in the
+ * current memory context.
+ */
+static MedianState *
+ems_flat_state(ExpandedMedianState *ems)
+{
+	MedianState *state = median_state_create(ems->typid);
+
+	for (int64 i = 0; i < ems->count; i++)
+		median_state_add(state, ems->shared->values[i]);
+
+	return state;
+}
+
+/*
+ * EMS_get_flat_size
+ *
+ * Size of the flat form, which is built and kept until the state changes.
+ */
+static Size
+EMS_get_flat_size(ExpandedObjectHeader *eohptr)
+{
+	ExpandedMedianState *ems = (ExpandedMedianState *) eohptr;
+
+	Assert(ems->ems_magic == EMS_MAGIC);
+
+	if (ems->flat == NULL)
+	{
+		MemoryContext tmpcxt;
+		MemoryContext old_context;
+		bytea	   *flat;
+
+		tmpcxt = AllocSetContextCreate(CurrentMemoryContext,
+									   "median state flattening",
+									   ALLOCSET_DEFAULT_SIZES);
+		old_context = MemoryContextSwitchTo(tmpcxt);
+		flat = median_state_serialize(ems_flat_state(ems));
+		MemoryContextSwitchTo(old_context);
+
+		ems->flat = (bytea *) MemoryContextAlloc(ems->hdr.eoh_context,
+												 VARSIZE(flat));
+		memcpy(ems->flat, flat, VARSIZE(flat));
+		MemoryContextDelete(tmpcxt);
+	}
+
+	return VARSIZE(ems->flat);
+}
+
+/*
+ * EMS_flatten_into
+ *
+ * Copy the flat form built by EMS_get_flat_size.
+ */
+static void
+EMS_flatten_into(ExpandedObjectHeader *eohptr,
+				 void *result, Size allocated_size)
+{
+	ExpandedMedianState *ems = (ExpandedMedianState *) eohptr;
+
+	Assert(ems->ems_magic == EMS_MAGIC);
+	Assert(ems->flat != NULL && allocated_size == VARSIZE(ems->flat));
+
+	memcpy(result, ems->flat, allocated_size);
+}
+
+/*
+ * values_create
+ *
+ * Create an empty values buffer with one reference. Its context starts out
+ * under the current one, so that it goes away on errors; it is moved under
+ * TopMemoryContext once a state holds the reference.
+ */
+static MedianValues *
+values_create(int64 allocated)
+{
+	MemoryContext context;
+	MedianValues *shared;
+
+	context = AllocSetContextCreate(CurrentMemoryContext,
+									"median state values",
+									ALLOCSET_DEFAULT_SIZES);
+
+	shared = (MedianValues *) MemoryContextAlloc(context, sizeof(MedianValues));
+	shared->context = context;
+	shared->refcount = 1;
+	shared->used = 0;
+	shared->allocated = allocated;
+	shared->values = (Datum *) MemoryContextAllocHuge(context,
+													  allocated * sizeof(Datum));
+
+	return shared;
+}
+
+/*
+ * values_release
+ *
+ * Drop the reference of an expanded state to its values buffer. Also the
+ * reset callback of the state's memory context.
+ */
+static void
+values_release(void *arg)
+{
+	ExpandedMedianState *ems = (ExpandedMedianState *) arg;
+	MedianValues *shared = ems->shared;
+
+	if (shared == NULL)
+		return;
+
+	ems->shared = NULL;
+	if (--shared->refcount == 0)
+		MemoryContextDelete(shared->context);
+}
@@ -0,0 +1,259 @@
+/*
+ * median_explain.c
+ *
+ * EXPLAIN ANALYZE details for median aggregates.
+ *
+ * The work of a median aggregate is hidden in its support functions, so a
+ * plan only shows it as time spent in the Agg node. With median.explain
+ * enabled, EXPLAIN ANALYZE has the support functions record per-aggregate
+ * statistics while the query runs, and appends them to the plan output.
+ *
+ * Statistics are attached to the median states: a state gets the entry of
+ * the support function call that created it, which is cached in that call's
+ * fn_extra, and states created by combining inherit the entry of their input.
+ * That way the transition, combine and final work of one aggregate add up in
+ * one entry. Only the leader's work is seen; the transitions run inside
+ * parallel workers are accounted to the leader through the deserialized
+ * bytes only.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "commands/explain.h"
+#include "nodes/pg_list.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+#include "median.h"
+
+/* Are we running an EXPLAIN ANALYZE that collects median statistics? */
+bool		median_explain_collecting = false;
+
+/* GUC variables */
+static bool median_explain = false;
+
+/*
+ * Statistics of the innermost running EXPLAIN, in collection order. A nested
+ * EXPLAIN ANALYZE, run by a function called from the outer one, gets its own
+ * context and generation and restores the outer ones when it is done.
+ */
+static MemoryContext median_explain_context = NULL;
+static List *median_explain_aggs = NIL;
+static uint64 median_explain_generation = 0;
+static uint64 median_explain_last_generation = 0;
+
+static ExplainOneQuery_hook_type prev_ExplainOneQuery_hook = NULL;
+
+static void median_ExplainOneQuery(Query *query, int cursorOptions,
+								   IntoClause *into, ExplainState *es,
+								   const char *queryString,
+								   ParamListInfo params,
+								   QueryEnvironment *queryEnv);
+static void median_explain_print(ExplainState *es);
+
+
+/*
+ * median_explain_init
+ *
+ * Define the GUC and install the hook. Called from _PG_init.
+ */
+void
+median_explain_init(void)
+{
+	DefineCustomBoolVariable("median.explain",
+							 "Show median aggregate details in EXPLAIN ANALYZE.",
+							 "Reports states created, peak state size, selection "
+							 "strategy, time spent in the support functions and "
+							 "deserialized bytes of every median aggregate.",
+							 &median_explain,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	prev_ExplainOneQuery_hook = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = median_ExplainOneQuery;
+}
+
+/*
+ * median_explain_stats
+ *
+ * Return the statistics entry for the aggregate whose support function is
+ * being called, or NULL if we are not collecting statistics.
+ */
+MedianAggStats *
+median_explain_stats(FunctionCallInfo fcinfo, Oid inputTypeId)
+{
+	MedianCallCache *cache;
+	MedianAggStats *stats;
+	MemoryContext old_context;
+
+	if (!median_explain_collecting)
+		return NULL;
+
+	/* The generation tells whether the entry belongs to this EXPLAIN */
+	cache = median_call_cache(fcinfo);
+	if (cache->explain_stats != NULL &&
+		cache->explain_generation == median_explain_generation)
+		return cache->explain_stats;
+
+	old_context = MemoryContextSwitchTo(median_explain_context);
+	stats = (MedianAggStats *) palloc0(sizeof(MedianAggStats));
+	stats->inputTypeId = inputTypeId;
+	stats->strategy = "none";
+	median_explain_aggs = lappend(median_explain_aggs, stats);
+	MemoryContextSwitchTo(old_context);
+
+	cache->explain_generation = median_explain_generation;
+	cache->explain_stats = stats;
+
+	return stats;
+}
+
+/*
+ * median_ExplainOneQuery
+ *
+ * Plan and explain a query as the core code does, collecting median
+ * statistics while it executes if this is an EXPLAIN ANALYZE and
+ * median.explain is on, and append them to the output.
+ */
+static void
+median_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+					   ExplainState *es, const char *queryString,
+					   ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	bool		collect = median_explain && es->analyze;
+	bool		save_collecting = median_explain_collecting;
+	MemoryContext save_context = median_explain_context;
+	List	   *save_aggs = median_explain_aggs;
+	uint64		save_generation = median_explain_generation;
+
+	if (collect)
+	{
+		median_explain_context =
+			AllocSetContextCreate(TopMemoryContext,
+								  "median explain statistics",
+								  ALLOCSET_SMALL_SIZES);
+		median_explain_aggs = NIL;
+		median_explain_generation = ++median_explain_last_generation;
+		median_explain_collecting = true;
+	}
+
+	PG_TRY();
+	{
+		if (prev_ExplainOneQuery_hook)
+			prev_ExplainOneQuery_hook(query, cursorOptions, into, es,
+									  queryString, params, queryEnv);
+		else
+		{
+			PlannedStmt *plan;
+			instr_time	planstart;
+			instr_time	planduration;
+
+			INSTR_TIME_SET_CURRENT(planstart);
+			plan = pg_plan_query(query, cursorOptions, params);
+			INSTR_TIME_SET_CURRENT(planduration);
+			INSTR_TIME_SUBTRACT(planduration, planstart);
+
+			ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+						   &planduration);
+		}
+
+		median_explain_collecting = save_collecting;
+
+		if (collect)
+			median_explain_print(es);
+	}
+	PG_CATCH();
+	{
+		if (collect)
+		{
+			MemoryContextDelete(median_explain_context);
+			median_explain_context = save_context;
+			median_explain_aggs = save_aggs;
+			median_explain_generation = save_generation;
+		}
+		median_explain_collecting = save_collecting;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (collect)
+	{
+		MemoryContextDelete(median_explain_context);
+		median_explain_context = save_context;
+		median_explain_aggs = save_aggs;
+		median_explain_generation = save_generation;
+	}
+}
+
+/*
+ * median_explain_print
+ *
+ * Append the collected statistics to the EXPLAIN output. In text format they
+ * follow the plan as indented blocks, in the structured formats they form an
+ * extra group next to the query.
+ */
+static void
+median_explain_print(ExplainState *es)
+{
+	ListCell   *lc;
+
+	if (median_explain_aggs == NIL)
+		return;
+
+	ExplainOpenGroup("Median", NULL, true, es);
+	ExplainOpenGroup("Median Aggregates", "Median Aggregates", false, es);
+
+	foreach(lc, median_explain_aggs)
+	{
+		MedianAggStats *stats = (MedianAggStats *) lfirst(lc);
+		char	   *typname = format_type_be(stats->inputTypeId);
+
+		ExplainOpenGroup("Median Aggregate", NULL, true, es);
+
+		if (es->format == EXPLAIN_FORMAT_TEXT)
+		{
+			ExplainPropertyText("Median Aggregate", typname, es);
+			es->indent++;
+		}
+		else
+			ExplainPropertyText("Input Type", typname, es);
+
+		ExplainPropertyInteger("States Created", NULL, stats->states_created, es);
+		if (stats->peak_state_bytes > 0)
+			ExplainPropertyInteger("Peak State Bytes", NULL,
+								   stats->peak_state_bytes, es);
+		if (stats->peak_context_bytes > 0)
+			ExplainPropertyInteger("Peak Context Bytes", NULL,
+								   stats->peak_context_bytes, es);
+		ExplainPropertyText("Strategy", stats->strategy, es);
+
+		if (es->timing)
+		{
+			ExplainPropertyFloat("Transition Time", "ms",
+								 INSTR_TIME_GET_MILLISEC(stats->trans_time),
+								 3, es);
+			ExplainPropertyFloat("Combine Time", "ms",
+								 INSTR_TIME_GET_MILLISEC(stats->combine_time),
+								 3, es);
+			ExplainPropertyFloat("Finalize Time", "ms",
+								 INSTR_TIME_GET_MILLISEC(stats->final_time),
+								 3, es);
+		}
+
+		if (stats->serialized_bytes > 0)
+			ExplainPropertyInteger("Deserialized Bytes", NULL,
+								   stats->serialized_bytes, es);
+
+		if (es->format == EXPLAIN_FORMAT_TEXT)
+			es->indent--;
+
+		ExplainCloseGroup("Median Aggregate", NULL, true, es);
+	}
+
+	ExplainCloseGroup("Median Aggregates", "Median Aggregates", false, es);
+	ExplainCloseGroup("Median", NULL, true, es);
+}
@@ -0,0 +1,166 @@
+/*
+ * median_export.c
+ *
+ * Architecture-independent form of serialized median states.
+ *
+ * The states of median_state_agg hold native-endian integers, raw Datums and
+ * the OID of the value type, which is fine within one server but cannot be
+ * read by a server of another architecture or with other OIDs.
+ * median_state_export() rewrites a state as
+ *
+ *   "MEDS", format version (1 byte)
+ *   length (int32) and qualified name of the value type
+ *   number of values (int64)
+ *   for each value: length (int32) and output of the type's send function
+ *
+ * with all integers in network byte order, and median_state_import() turns
+ * that back into a state of the local server, looking the type up by name and
+ * reading the values with its receive function. Partial states of different
+ * clusters can so be merged with median_state_merge.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "libpq/pqformat.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+
+#include "median.h"
+
+#define MEDIAN_EXPORT_MAGIC		"MEDS"
+#define MEDIAN_EXPORT_VERSION	1
+
+PG_FUNCTION_INFO_V1(median_state_export);
+PG_FUNCTION_INFO_V1(median_state_import);
+
+
+/*
+ * median_state_export
+ *
+ * Portable form of a serialized median state.
+ */
+Datum
+median_state_export(PG_FUNCTION_ARGS)
+{
+	MedianState *state = median_state_deserialize(PG_GETARG_BYTEA_P(0));
+	Oid			typid = median_state_type(state);
+	int64		count = median_state_count(state);
+	Datum	   *values = median_state_values(state);
+	char	   *typname;
+	Oid			typsend;
+	bool		typisvarlena;
+	FmgrInfo	flinfo;
+	StringInfoData buf;
+
+	getTypeBinaryOutputInfo(typid, &typsend, &typisvarlena);
+	fmgr_info(typsend, &flinfo);
+
+	typname = format_type_extended(typid, -1, FORMAT_TYPE_FORCE_QUALIFY);
+
+	pq_begintypsend(&buf);
+	pq_sendbytes(&buf, MEDIAN_EXPORT_MAGIC, 4);
+	pq_sendbyte(&buf, MEDIAN_EXPORT_VERSION);
+	pq_sendint32(&buf, strlen(typname));
+	pq_sendbytes(&buf, typname, strlen(typname));
+	pq_sendint64(&buf, count);
+
+	for (int64 i = 0; i < count; i++)
+	{
+		bytea	   *value = SendFunctionCall(&flinfo, values[i]);
+
+		pq_sendint32(&buf, VARSIZE(value) - VARHDRSZ);
+		pq_sendbytes(&buf, VARDATA(value), VARSIZE(value) - VARHDRSZ);
+		pfree(value);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * median_state_import
+ *
+ * Serialized median state from the output of median_state_export.
+ */
+Datum
+median_state_import(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	MedianState *state;
+	StringInfoData buf;
+	const char *magic;
+	int			version;
+	int			namelen;
+	char	   *typname;
+	Oid			typid;
+	int64		count;
+	Oid			typreceive;
+	Oid			typioparam;
+	FmgrInfo	flinfo;
+
+	/* Receive functions want a trailing null, see record_recv */
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+
+	magic = pq_getmsgbytes(&buf, 4);
+	version = pq_getmsgbyte(&buf);
+	if (memcmp(magic, MEDIAN_EXPORT_MAGIC, 4) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid exported median state")));
+	if (version != MEDIAN_EXPORT_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("unsupported exported median state version %d", version)));
+
+	namelen = pq_getmsgint(&buf, 4);
+	if (namelen < 0 || namelen > buf.len - buf.cursor)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid exported median state")));
+	typname = pnstrdup(pq_getmsgbytes(&buf, namelen), namelen);
+	typid = DatumGetObjectId(DirectFunctionCall1(regtypein,
+												 CStringGetDatum(typname)));
+
+	count = pq_getmsgint64(&buf);
+
+	getTypeBinaryInputInfo(typid, &typreceive, &typioparam);
+	fmgr_info(typreceive, &flinfo);
+
+	state = median_state_create(typid);
+
+	for (int64 i = 0; i < count; i++)
+	{
+		StringInfoData item;
+		int			itemlen = pq_getmsgint(&buf, 4);
+		char		csave;
+		Datum		value;
+
+		if (itemlen < 0 || itemlen > buf.len - buf.cursor)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid exported median state")));
+
+		/* Point at the value, null-terminated for the time of the call */
+		item.data = &buf.data[buf.cursor];
+		item.maxlen = itemlen + 1;
+		item.len = itemlen;
+		item.cursor = 0;
+		buf.cursor += itemlen;
+
+		csave = buf.data[buf.cursor];
+		buf.data[buf.cursor] = '\0';
+		value = ReceiveFunctionCall(&flinfo, &item, typioparam, -1);
+		buf.data[buf.cursor] = csave;
+
+		if (item.cursor != itemlen)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("improper binary format in exported median state")));
+
+		median_state_add(state, value);
+	}
+
+	pq_getmsgend(&buf);
+
+	PG_RETURN_BYTEA_P(median_state_serialize(state));
+}
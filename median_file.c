@@ -0,0 +1,433 @@
+/*
+ * median_file.c
+ *
+ * Medians of a column of a server-side data file.
+ *
+ * file_median() maps the file into memory and parses the wanted column
+ * straight into a float8 median state, which is then selected on like the
+ * state of the aggregate, so checking a file before loading it does not need
+ * a COPY into a staging table first.
+ *
+ * Only the bytes that matter are looked at one by one: the scanner looks for
+ * the next delimiter, newline or quote 16 bytes at a time with SSE2 where
+ * available, and only the target field is copied, into a small buffer for
+ * float8in_internal. Quoted CSV fields, including delimiters and newlines
+ * inside quotes, are handled. Besides csv and tsv text, the float8 format
+ * reads a file of native float8 values.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "port/pg_bitutils.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/float.h"
+#include "utils/memutils.h"
+
+#include "median.h"
+
+/* Longest field we parse as a number */
+#define FILE_MEDIAN_MAX_FIELD	128
+
+typedef enum FileMedianFormat
+{
+	FILE_MEDIAN_CSV,
+	FILE_MEDIAN_TSV,
+	FILE_MEDIAN_FLOAT8
+} FileMedianFormat;
+
+/*
+ * FileMedianScan
+ *
+ * Position of the scanner, also used to report it in error messages.
+ */
+typedef struct FileMedianScan
+{
+	const char *path;
+	const char *p;				/* next byte to scan */
+	const char *end;			/* end of the mapping */
+	char		delim;
+	char		quote;			/* '"' for csv, else same as delim */
+	int64		line;			/* current line, 1-based */
+} FileMedianScan;
+
+static void file_median_parse(FileMedianScan *scan, int column, bool header,
+							  MedianState *state);
+static bool file_median_field(FileMedianScan *scan, int column,
+							  const char **start, const char **stop);
+static float8 file_median_value(FileMedianScan *scan, const char *start,
+								const char *stop, bool *isnull);
+static void file_median_error_callback(void *arg);
+
+PG_FUNCTION_INFO_V1(file_median);
+
+
+/*
+ * file_median_find
+ *
+ * Return the first byte in [p, end) that equals one of c1, c2 or c3, or end.
+ */
+static inline const char *
+file_median_find(const char *p, const char *end, char c1, char c2, char c3)
+{
+#ifdef __SSE2__
+	const __m128i v1 = _mm_set1_epi8(c1);
+	const __m128i v2 = _mm_set1_epi8(c2);
+	const __m128i v3 = _mm_set1_epi8(c3);
+
+	while (end - p >= 16)
+	{
+		__m128i		chunk = _mm_loadu_si128((const __m128i *) p);
+		__m128i		hits;
+		uint32		mask;
+
+		hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, v1),
+										 _mm_cmpeq_epi8(chunk, v2)),
+							_mm_cmpeq_epi8(chunk, v3));
+		mask = (uint32) _mm_movemask_epi8(hits);
+		if (mask != 0)
+			return p + pg_rightmost_one_pos32(mask);
+		p += 16;
+	}
+#endif
+
+	for (; p < end; p++)
+	{
+		if (*p == c1 || *p == c2 || *p == c3)
+			return p;
+	}
+
+	return end;
+}
+
+/*
+ * file_median
+ *
+ * Median of a column of a server-side file, NULL if it has no values.
+ */
+Datum
+file_median(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int32		column = PG_GETARG_INT32(1);
+	char	   *format = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	bool		header = PG_GETARG_BOOL(3);
+	FileMedianFormat fmt;
+	FileMedianScan scan;
+	MemoryContext work_context;
+	MemoryContext old_context;
+	MedianState *state;
+	struct stat st;
+	char	   *data;
+	int			fd;
+	float8		result = 0;
+	bool		isnull = true;
+
+	if (!superuser() && !is_member_of_role(GetUserId(),
+										   DEFAULT_ROLE_READ_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser or a member of the pg_read_server_files role to read files")));
+
+	if (strcmp(format, "csv") == 0)
+		fmt = FILE_MEDIAN_CSV;
+	else if (strcmp(format, "tsv") == 0)
+		fmt = FILE_MEDIAN_TSV;
+	else if (strcmp(format, "float8") == 0)
+		fmt = FILE_MEDIAN_FLOAT8;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized file format \"%s\"", format),
+				 errhint("Valid formats are \"csv\", \"tsv\" and \"float8\".")));
+
+	if (column < 1 || (fmt == FILE_MEDIAN_FLOAT8 && column != 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("column number %d is out of range", column)));
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m", path)));
+
+	if (fstat(fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+
+	if (st.st_size == 0)
+	{
+		CloseTransientFile(fd);
+		PG_RETURN_NULL();
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m", path)));
+	CloseTransientFile(fd);
+
+#ifdef MADV_SEQUENTIAL
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	/* The state can be as big as the file, keep it apart */
+	work_context = AllocSetContextCreate(CurrentMemoryContext,
+										 "file_median",
+										 ALLOCSET_DEFAULT_SIZES);
+
+	PG_TRY();
+	{
+		old_context = MemoryContextSwitchTo(work_context);
+		state = median_state_create(FLOAT8OID);
+
+		if (fmt == FILE_MEDIAN_FLOAT8)
+		{
+			Size		n = st.st_size / sizeof(float8);
+			Size		i;
+
+			if (st.st_size % sizeof(float8) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("size of file \"%s\" is not a multiple of %d bytes",
+								path, (int) sizeof(float8))));
+
+			for (i = 0; i < n; i++)
+			{
+				float8		value;
+
+				memcpy(&value, data + i * sizeof(float8), sizeof(float8));
+				median_state_add(state, Float8GetDatum(value));
+			}
+		}
+		else
+		{
+			scan.path = path;
+			scan.p = data;
+			scan.end = data + st.st_size;
+			scan.delim = fmt == FILE_MEDIAN_CSV ? ',' : '\t';
+			scan.quote = fmt == FILE_MEDIAN_CSV ? '"' : scan.delim;
+			scan.line = 1;
+
+			file_median_parse(&scan, column, header, state);
+		}
+
+		if (median_state_count(state) > 0)
+		{
+			result = DatumGetFloat8(median_state_median(state));
+			isnull = false;
+		}
+
+		MemoryContextSwitchTo(old_context);
+	}
+	PG_CATCH();
+	{
+		munmap(data, st.st_size);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	munmap(data, st.st_size);
+	MemoryContextDelete(work_context);
+
+	if (isnull)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(result);
+}
+
+/*
+ * file_median_parse
+ *
+ * Add the values of a column of every line of a csv or tsv file to state.
+ */
+static void
+file_median_parse(FileMedianScan *scan, int column, bool header,
+				  MedianState *state)
+{
+	ErrorContextCallback errcallback;
+
+	errcallback.callback = file_median_error_callback;
+	errcallback.arg = (void *) scan;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
+
+	if (header && scan->p < scan->end)
+	{
+		file_median_field(scan, 0, NULL, NULL);
+		scan->line++;
+	}
+
+	while (scan->p < scan->end)
+	{
+		const char *start;
+		const char *stop;
+		bool		isnull;
+		float8		value;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (!file_median_field(scan, column, &start, &stop))
+			ereport(ERROR,
+					(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+					 errmsg("missing data for column %d", column)));
+
+		value = file_median_value(scan, start, stop, &isnull);
+		if (!isnull)
+			median_state_add(state, Float8GetDatum(value));
+
+		scan->line++;
+	}
+
+	error_context_stack = errcallback.previous;
+}
+
+/*
+ * file_median_field
+ *
+ * Scan the line at scan->p, returning the bounds of field number column
+ * (quotes included), and leave scan->p at the start of the next line.
+ * Returns false if the line has fewer fields. Column 0 skips the line.
+ */
+static bool
+file_median_field(FileMedianScan *scan, int column,
+				  const char **start, const char **stop)
+{
+	const char *p = scan->p;
+	const char *field = p;
+	int			fieldno = 1;
+	bool		found = false;
+
+	for (;;)
+	{
+		const char *q = file_median_find(p, scan->end, scan->delim, '\n',
+										 scan->quote);
+
+		if (q < scan->end && *q == scan->quote && scan->quote != scan->delim)
+		{
+			/* Skip the quoted part, where "" stands for a quote */
+			p = q + 1;
+			for (;;)
+			{
+				q = memchr(p, scan->quote, scan->end - p);
+				if (q == NULL)
+					ereport(ERROR,
+							(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+							 errmsg("unterminated CSV quoted field")));
+				if (q + 1 < scan->end && q[1] == scan->quote)
+				{
+					p = q + 2;
+					continue;
+				}
+				break;
+			}
+			p = q + 1;
+			continue;
+		}
+
+		if (fieldno == column)
+		{
+			*start = field;
+			*stop = q;
+			found = true;
+		}
+
+		if (q < scan->end && *q == scan->delim)
+		{
+			fieldno++;
+			field = p = q + 1;
+			continue;
+		}
+
+		/* End of the line */
+		scan->p = q < scan->end ? q + 1 : q;
+		break;
+	}
+
+	return found || column == 0;
+}
+
+/*
+ * file_median_value
+ *
+ * Parse a field as float8. Empty fields are NULL.
+ */
+static float8
+file_median_value(FileMedianScan *scan, const char *start, const char *stop,
+				  bool *isnull)
+{
+	char		buf[FILE_MEDIAN_MAX_FIELD + 1];
+	int			len = 0;
+
+	/* Trailing carriage return of CRLF files */
+	if (stop > start && stop[-1] == '\r')
+		stop--;
+
+	if (scan->quote != scan->delim && stop - start >= 2 &&
+		*start == scan->quote && stop[-1] == scan->quote)
+	{
+		/* Unquote, turning "" into " */
+		const char *p;
+
+		for (p = start + 1; p < stop - 1; p++)
+		{
+			if (len >= FILE_MEDIAN_MAX_FIELD)
+				break;
+			buf[len++] = *p;
+			if (*p == scan->quote)
+				p++;
+		}
+		if (p < stop - 1)
+			len = FILE_MEDIAN_MAX_FIELD + 1;
+	}
+	else if (stop - start <= FILE_MEDIAN_MAX_FIELD)
+	{
+		len = stop - start;
+		memcpy(buf, start, len);
+	}
+	else
+		len = FILE_MEDIAN_MAX_FIELD + 1;
+
+	if (len > FILE_MEDIAN_MAX_FIELD)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("field longer than %d bytes", FILE_MEDIAN_MAX_FIELD)));
+
+	buf[len] = '\0';
+
+	/* Empty fields, blanks included, are NULL like in COPY */
+	*isnull = (strspn(buf, " \t") == (size_t) len);
+	if (*isnull)
+		return 0;
+
+	return float8in_internal(buf, NULL, "double precision", buf);
+}
+
+/*
+ * file_median_error_callback
+ *
+ * Tell which line of the file an error came from.
+ */
+static void
+file_median_error_callback(void *arg)
+{
+	FileMedianScan *scan = (FileMedianScan *) arg;
+
+	errcontext("line " INT64_FORMAT " of file \"%s\"", scan->line, scan->path);
+}
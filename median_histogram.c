@@ -0,0 +1,234 @@
+/*
+ * median_histogram.c
+ *
+ * Equi-depth histograms.
+ *
+ * equi_depth_histogram(val, buckets) returns buckets + 1 boundaries that split
+ * the values into buckets of equal size, placed like the histogram_bounds of
+ * pg_stats: boundary i is the value of rank i * (n - 1) / buckets. The values
+ * are collected in a median state and the boundaries found with one
+ * multi-rank selection over it, which for a small number of buckets is
+ * cheaper than sorting everything.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "median.h"
+
+/*
+ * HistogramState
+ *
+ * Transition state of equi_depth_histogram. The bucket count comes from the
+ * first row, the final function only sees the state.
+ */
+typedef struct HistogramState
+{
+	int32		buckets;
+	MedianState *values;
+} HistogramState;
+
+PG_FUNCTION_INFO_V1(equi_depth_histogram_transfn);
+PG_FUNCTION_INFO_V1(equi_depth_histogram_combinefn);
+PG_FUNCTION_INFO_V1(equi_depth_histogram_serialfn);
+PG_FUNCTION_INFO_V1(equi_depth_histogram_deserialfn);
+PG_FUNCTION_INFO_V1(equi_depth_histogram_finalfn);
+
+
+/*
+ * equi_depth_histogram_transfn
+ *
+ * Add a value to the state, creating it on the first call.
+ */
+Datum
+equi_depth_histogram_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	HistogramState *state;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "equi_depth_histogram_transfn called in non-aggregate context");
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	if (PG_ARGISNULL(0))
+	{
+		Oid			inputTypeId = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+		if (inputTypeId == InvalidOid)
+			elog(ERROR, "could not determine input data type");
+
+		if (PG_ARGISNULL(2) || PG_GETARG_INT32(2) < 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("number of buckets must be positive")));
+
+		state = (HistogramState *) palloc(sizeof(HistogramState));
+		state->buckets = PG_GETARG_INT32(2);
+		state->values = median_state_create(inputTypeId);
+	}
+	else
+		state = (HistogramState *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+		median_state_add(state->values, PG_GETARG_DATUM(1));
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * equi_depth_histogram_combinefn
+ *
+ * Combine two partial states. The values of state2 are not copied, it lives
+ * in the aggregate context as well.
+ */
+Datum
+equi_depth_histogram_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	HistogramState *state1;
+	HistogramState *state2;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (HistogramState *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (HistogramState *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+		PG_RETURN_POINTER(state1);
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	/* state2 is not used after this, its values can be taken over */
+	if (state1 == NULL)
+	{
+		state1 = (HistogramState *) palloc(sizeof(HistogramState));
+		*state1 = *state2;
+	}
+	else
+		median_state_combine(state1->values, state2->values);
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * equi_depth_histogram_serialfn
+ *
+ * The bucket count followed by the serialized median state.
+ */
+Datum
+equi_depth_histogram_serialfn(PG_FUNCTION_ARGS)
+{
+	HistogramState *state;
+	bytea	   *values;
+	bytea	   *result;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state = (HistogramState *) PG_GETARG_POINTER(0);
+	values = median_state_serialize(state->values);
+
+	result = (bytea *) palloc(VARHDRSZ + sizeof(int32) + VARSIZE(values));
+	SET_VARSIZE(result, VARHDRSZ + sizeof(int32) + VARSIZE(values));
+	memcpy(VARDATA(result), &state->buckets, sizeof(int32));
+	memcpy(VARDATA(result) + sizeof(int32), values, VARSIZE(values));
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * equi_depth_histogram_deserialfn
+ *
+ * Rebuild a state from equi_depth_histogram_serialfn in the aggregate memory
+ * context.
+ */
+Datum
+equi_depth_histogram_deserialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	HistogramState *state;
+	bytea	   *bytes;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	bytes = PG_GETARG_BYTEA_P(0);
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	state = (HistogramState *) palloc(sizeof(HistogramState));
+	memcpy(&state->buckets, VARDATA(bytes), sizeof(int32));
+	state->values = median_state_deserialize_trusted((bytea *) (VARDATA(bytes) + sizeof(int32)));
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * equi_depth_histogram_finalfn
+ *
+ * Array of the bucket boundaries, NULL if there were no values.
+ */
+Datum
+equi_depth_histogram_finalfn(PG_FUNCTION_ARGS)
+{
+	HistogramState *state;
+	int64		count;
+	int64	   *ranks;
+	Datum	   *bounds;
+	Oid			typid;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	int			nbounds;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (HistogramState *) PG_GETARG_POINTER(0);
+
+	count = median_state_count(state->values);
+	if (count == 0)
+		PG_RETURN_NULL();
+
+	if ((Size) state->buckets >= MaxAllocSize / sizeof(int64))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many buckets")));
+	nbounds = state->buckets + 1;
+
+	ranks = (int64 *) palloc(nbounds * sizeof(int64));
+	bounds = (Datum *) palloc(nbounds * sizeof(Datum));
+
+	/* i * (count - 1) / buckets, split up so that it cannot overflow */
+	for (int i = 0; i < nbounds; i++)
+		ranks[i] = (count - 1) / state->buckets * i +
+			(count - 1) % state->buckets * i / state->buckets;
+
+	median_state_select_ranks(state->values, ranks, nbounds, bounds);
+
+	typid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	get_typlenbyvalalign(typid, &typlen, &typbyval, &typalign);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(bounds, nbounds, typid,
+										  typlen, typbyval, typalign));
+}
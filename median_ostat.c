@@ -0,0 +1,1173 @@
+/*
+ * median_ostat.c
+ *
+ * Trigger-maintained order statistics of a column.
+ *
+ * median_ostat_create() gives a column two side tables that a trigger keeps
+ * in step with every INSERT, UPDATE, DELETE and TRUNCATE of the table:
+ *
+ *	values:  (val, cnt)  every distinct value and how often it occurs, with a
+ *			 btree on val
+ *	buckets: (lo, cnt)	 a partition of the values into ranges starting at lo,
+ *			 with the number of values in each; the first bucket also takes
+ *			 everything below its lo
+ *
+ * A row change updates one values row and one buckets row, both found through
+ * their primary keys, so it costs O(log n). A bucket that grows beyond twice
+ * the bucket size is split in the middle, which scans the bucket once.
+ *
+ * median_of() then sums up the bucket counts to find the bucket holding the
+ * middle rank, and walks the values from the start of that bucket, so it
+ * reads O(n / bucket_size + bucket_size) rows instead of the whole table, no
+ * matter how the table changed since.
+ *
+ * The side tables use the default btree opclass of the column type, the same
+ * ordering median() gets from get_type_comp_method, and median_of() averages
+ * the two middle values for even counts like median() does. Concurrent writers
+ * touching the same bucket serialize on its row, so this is meant for
+ * moderate write rates.
+ *
+ * The side tables belong to the owner of the table, and the trigger and
+ * median_of() read and write them as that owner, so roles that may write or
+ * read the column need no grants on them. Only the owner can create, drop
+ * and rebalance them. The median_ostat table is only accessed as its own
+ * owner, and is not granted to anyone.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "catalog/objectaddress.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include "median.h"
+
+/* Rows fetched at a time when walking values or buckets */
+#define MEDIAN_OSTAT_FETCH		256
+
+/*
+ * MedianOstatPlans
+ *
+ * Saved plans of one median_ostat trigger, keyed by the trigger's OID.
+ */
+typedef struct MedianOstatPlans
+{
+	Oid			tgoid;			/* hash key */
+	Oid			typid;			/* column type */
+	int			bucket_size;
+	SPIPlanPtr	inc;			/* add one occurrence of a value */
+	SPIPlanPtr	dec;			/* remove one, returning what is left */
+	SPIPlanPtr	del;			/* delete a value that has none left */
+	SPIPlanPtr	find_bucket;	/* lo of the bucket a value falls in */
+	SPIPlanPtr	lock_bucket;	/* lock the bucket starting at lo */
+	SPIPlanPtr	count;			/* adjust the count of a bucket */
+	SPIPlanPtr	insert_bucket;	/* start a bucket */
+	SPIPlanPtr	set_bucket;		/* set the count of a bucket */
+	SPIPlanPtr	move_bucket;	/* set the lo of a bucket */
+	SPIPlanPtr	scan_from;		/* values from a bucket's lo on */
+	SPIPlanPtr	scan_all;		/* all values */
+} MedianOstatPlans;
+
+static HTAB *median_ostat_plans_hash = NULL;
+
+static void median_ostat_check_owner(Oid relid);
+static char *median_ostat_table_name(Oid relid, AttrNumber attnum,
+									 const char *suffix);
+static bool median_ostat_lookup(Oid funcid, Oid relid, Name attname,
+								char **values_table, char **buckets_table);
+static int	median_ostat_build_buckets(const char *values_table,
+									   const char *buckets_table,
+									   Oid typid, int bucket_size);
+static MedianOstatPlans *median_ostat_plans(Trigger *trigger, Oid typid);
+static SPIPlanPtr median_ostat_prepare(const char *query, int nargs,
+									   Oid *argtypes);
+static void median_ostat_add(MedianOstatPlans *plans, Datum value);
+static void median_ostat_remove(MedianOstatPlans *plans, Datum value);
+static void median_ostat_count(MedianOstatPlans *plans, Datum value,
+							   int64 delta);
+static bool median_ostat_find_bucket(MedianOstatPlans *plans, Datum value,
+									 Datum *lo);
+static void median_ostat_split(MedianOstatPlans *plans, Datum lo, int64 cnt,
+							   bool first);
+
+PG_FUNCTION_INFO_V1(median_ostat_create);
+PG_FUNCTION_INFO_V1(median_ostat_drop);
+PG_FUNCTION_INFO_V1(median_ostat_rebalance);
+PG_FUNCTION_INFO_V1(median_ostat_trigger);
+PG_FUNCTION_INFO_V1(median_of);
+
+
+/*
+ * median_ostat_create
+ *
+ * Create the side tables of a column, fill them from the current contents of
+ * the table and install the triggers maintaining them.
+ */
+Datum
+median_ostat_create(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	int32		bucket_size = PG_GETARG_INT32(2);
+	char	   *nspname = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+	AttrNumber	attnum;
+	Oid			typid;
+	char	   *relname;
+	char	   *colname;
+	char	   *typname;
+	char	   *values_table;
+	char	   *buckets_table;
+	char	   *tgargs;
+	Oid			argtypes[5] = {REGCLASSOID, NAMEOID, REGCLASSOID, REGCLASSOID,
+	INT4OID};
+	Datum		args[5];
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	if (bucket_size < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("bucket size must be positive")));
+
+	attnum = median_check_column(relid, attname, false);
+	median_ostat_check_owner(relid);
+	typid = get_atttype(relid, attnum);
+
+	relname = quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+										 get_rel_name(relid));
+	colname = quote_identifier(NameStr(*attname));
+	typname = format_type_be_qualified(typid);
+	values_table = median_ostat_table_name(relid, attnum, "values");
+	buckets_table = median_ostat_table_name(relid, attnum, "buckets");
+
+	SPI_connect();
+	median_switch_to_owner(relid, &save_userid, &save_sec_context);
+
+	/* Keep writers out until the triggers are in place */
+	ret = SPI_execute(psprintf("LOCK TABLE %s IN SHARE ROW EXCLUSIVE MODE",
+							   relname), false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	ret = SPI_execute(psprintf("CREATE TABLE %s (val %s PRIMARY KEY, "
+							   "cnt int8 NOT NULL)",
+							   values_table, typname), false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	ret = SPI_execute(psprintf("CREATE TABLE %s (lo %s PRIMARY KEY, "
+							   "cnt int8 NOT NULL)",
+							   buckets_table, typname), false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	ret = SPI_execute(psprintf("INSERT INTO %s (val, cnt) "
+							   "SELECT %s, count(*) FROM %s "
+							   "WHERE %s IS NOT NULL GROUP BY 1",
+							   values_table, colname, relname, colname),
+					  false, 0);
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	median_ostat_build_buckets(values_table, buckets_table, typid,
+							   bucket_size);
+
+	tgargs = psprintf("%s, %s, %s, '%d'",
+					  quote_literal_cstr(NameStr(*attname)),
+					  quote_literal_cstr(values_table),
+					  quote_literal_cstr(buckets_table), bucket_size);
+
+	ret = SPI_execute(psprintf("CREATE TRIGGER median_ostat_%d "
+							   "AFTER INSERT OR UPDATE OF %s OR DELETE ON %s "
+							   "FOR EACH ROW EXECUTE FUNCTION "
+							   "%s.median_ostat_trigger(%s)",
+							   attnum, colname, relname,
+							   quote_identifier(nspname), tgargs),
+					  false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	ret = SPI_execute(psprintf("CREATE TRIGGER median_ostat_%d_truncate "
+							   "AFTER TRUNCATE ON %s "
+							   "FOR EACH STATEMENT EXECUTE FUNCTION "
+							   "%s.median_ostat_trigger(%s)",
+							   attnum, relname,
+							   quote_identifier(nspname), tgargs),
+					  false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+	args[2] = DirectFunctionCall1(regclassin, CStringGetDatum(values_table));
+	args[3] = DirectFunctionCall1(regclassin, CStringGetDatum(buckets_table));
+	args[4] = Int32GetDatum(bucket_size);
+
+	median_switch_to_owner(median_catalog_relid(fcinfo->flinfo->fn_oid,
+												"median_ostat"),
+						   &save_userid, &save_sec_context);
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s.median_ostat "
+										 "VALUES ($1, $2, $3, $4, $5)",
+										 quote_identifier(nspname)),
+								5, argtypes, args, NULL, false, 0);
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * median_ostat_drop
+ *
+ * Remove the triggers and side tables of a column.
+ */
+Datum
+median_ostat_drop(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	char	   *nspname = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+	char	   *values_table;
+	char	   *buckets_table;
+	char	   *relname;
+	AttrNumber	attnum;
+	Oid			argtypes[2] = {REGCLASSOID, NAMEOID};
+	Datum		args[2];
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	median_ostat_check_owner(relid);
+
+	SPI_connect();
+
+	if (!median_ostat_lookup(fcinfo->flinfo->fn_oid, relid, attname,
+							 &values_table, &buckets_table))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("column \"%s\" of relation \"%s\" has no order statistics",
+						NameStr(*attname), get_rel_name(relid))));
+
+	median_switch_to_owner(relid, &save_userid, &save_sec_context);
+
+	relname = quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+										 get_rel_name(relid));
+	attnum = get_attnum(relid, NameStr(*attname));
+
+	ret = SPI_execute(psprintf("DROP TRIGGER IF EXISTS median_ostat_%d ON %s",
+							   attnum, relname), false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+	ret = SPI_execute(psprintf("DROP TRIGGER IF EXISTS median_ostat_%d_truncate ON %s",
+							   attnum, relname), false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+	ret = SPI_execute(psprintf("DROP TABLE %s, %s", values_table, buckets_table),
+					  false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+	median_switch_to_owner(median_catalog_relid(fcinfo->flinfo->fn_oid,
+												"median_ostat"),
+						   &save_userid, &save_sec_context);
+	ret = SPI_execute_with_args(psprintf("DELETE FROM %s.median_ostat "
+										 "WHERE relid = $1 AND attname = $2",
+										 quote_identifier(nspname)),
+								2, argtypes, args, NULL, false, 0);
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * median_ostat_rebalance
+ *
+ * Rebuild the buckets of a column from its values, undoing the skew that
+ * deletes leave behind. Returns the number of buckets.
+ */
+Datum
+median_ostat_rebalance(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	char	   *values_table;
+	char	   *buckets_table;
+	Oid			argtypes[2] = {REGCLASSOID, NAMEOID};
+	Datum		args[2];
+	int			bucket_size;
+	int			nbuckets;
+	bool		isnull;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	median_check_column(relid, attname, false);
+	median_ostat_check_owner(relid);
+
+	SPI_connect();
+
+	if (!median_ostat_lookup(fcinfo->flinfo->fn_oid, relid, attname,
+							 &values_table, &buckets_table))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("column \"%s\" of relation \"%s\" has no order statistics",
+						NameStr(*attname), get_rel_name(relid))));
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+	median_switch_to_owner(median_catalog_relid(fcinfo->flinfo->fn_oid,
+												"median_ostat"),
+						   &save_userid, &save_sec_context);
+	ret = SPI_execute_with_args(psprintf("SELECT bucket_size FROM %s.median_ostat "
+										 "WHERE relid = $1 AND attname = $2",
+										 quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)))),
+								2, argtypes, args, NULL, true, 1);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+	bucket_size = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+											  SPI_tuptable->tupdesc, 1,
+											  &isnull));
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	median_switch_to_owner(relid, &save_userid, &save_sec_context);
+
+	/* The trigger must not count into buckets while they are rebuilt */
+	ret = SPI_execute(psprintf("LOCK TABLE %s, %s IN EXCLUSIVE MODE",
+							   values_table, buckets_table), false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	nbuckets = median_ostat_build_buckets(values_table, buckets_table,
+										  get_atttype(relid,
+													  get_attnum(relid, NameStr(*attname))),
+										  bucket_size);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+
+	PG_RETURN_INT32(nbuckets);
+}
+
+/*
+ * median_of
+ *
+ * The median of a column with order statistics, in text form.
+ */
+Datum
+median_of(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	AttrNumber	attnum;
+	Oid			typid;
+	char	   *values_table;
+	char	   *buckets_table;
+	int64		total;
+	int64		rank;
+	bool		even;
+	int64		acc = 0;
+	int64		within = 0;
+	Datum		lo = (Datum) 0;
+	bool		first = true;
+	bool		found_bucket = false;
+	bool		found_left = false;
+	bool		found_right = false;
+	Datum		left = (Datum) 0;
+	Datum		right = (Datum) 0;
+	Portal		portal;
+	bool		isnull;
+	int16		typlen;
+	bool		typbyval;
+	Oid			typoutput;
+	bool		typisvarlena;
+	Datum		result;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	attnum = median_check_column(relid, attname, false);
+	typid = get_atttype(relid, attnum);
+	get_typlenbyval(typid, &typlen, &typbyval);
+
+	SPI_connect();
+
+	if (!median_ostat_lookup(fcinfo->flinfo->fn_oid, relid, attname,
+							 &values_table, &buckets_table))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("column \"%s\" of relation \"%s\" has no order statistics",
+						NameStr(*attname), get_rel_name(relid)),
+				 errhint("Use median_ostat_create() to maintain them.")));
+
+	median_switch_to_owner(relid, &save_userid, &save_sec_context);
+
+	ret = SPI_execute(psprintf("SELECT sum(cnt)::int8 FROM %s", buckets_table),
+					  true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+	total = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+										SPI_tuptable->tupdesc, 1, &isnull));
+	if (isnull || total <= 0)
+	{
+		SetUserIdAndSecContext(save_userid, save_sec_context);
+		SPI_finish();
+		PG_RETURN_NULL();
+	}
+
+	/* Same ranks as median(): the middle one, or the two middle ones */
+	even = (total % 2 == 0);
+	rank = even ? total / 2 - 1 : total / 2;
+
+	/* Find the bucket holding the rank */
+	portal = SPI_cursor_open_with_args(NULL,
+									   psprintf("SELECT lo, cnt FROM %s ORDER BY lo",
+												buckets_table),
+									   0, NULL, NULL, NULL, true, 0);
+	while (!found_bucket)
+	{
+		uint64		i;
+
+		SPI_cursor_fetch(portal, true, MEDIAN_OSTAT_FETCH);
+		if (SPI_processed == 0)
+			break;
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[i];
+			int64		cnt;
+
+			cnt = DatumGetInt64(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2,
+											  &isnull));
+			if (acc + cnt > rank)
+			{
+				lo = datumCopy(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1,
+											 &isnull), typbyval, typlen);
+				within = rank - acc;
+				found_bucket = true;
+				break;
+			}
+			acc += cnt;
+			first = false;
+		}
+		SPI_freetuptable(SPI_tuptable);
+	}
+	SPI_cursor_close(portal);
+
+	if (!found_bucket)
+		elog(ERROR, "order statistics of column \"%s\" are inconsistent",
+			 NameStr(*attname));
+
+	/* Walk the values from the start of the bucket */
+	if (first)
+		portal = SPI_cursor_open_with_args(NULL,
+										   psprintf("SELECT val, cnt FROM %s "
+													"ORDER BY val", values_table),
+										   0, NULL, NULL, NULL, true, 0);
+	else
+		portal = SPI_cursor_open_with_args(NULL,
+										   psprintf("SELECT val, cnt FROM %s "
+													"WHERE val >= $1 ORDER BY val",
+													values_table),
+										   1, &typid, &lo, NULL, true, 0);
+	acc = 0;
+	while (!(found_left && (found_right || !even)))
+	{
+		uint64		i;
+
+		SPI_cursor_fetch(portal, true, MEDIAN_OSTAT_FETCH);
+		if (SPI_processed == 0)
+			break;
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[i];
+			int64		cnt;
+
+			cnt = DatumGetInt64(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2,
+											  &isnull));
+			if (!found_left && acc + cnt > within)
+			{
+				left = datumCopy(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1,
+											   &isnull), typbyval, typlen);
+				found_left = true;
+			}
+			if (found_left && even && acc + cnt > within + 1)
+			{
+				right = datumCopy(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1,
+												&isnull), typbyval, typlen);
+				found_right = true;
+			}
+			acc += cnt;
+			if (found_left && (found_right || !even))
+				break;
+		}
+		SPI_freetuptable(SPI_tuptable);
+	}
+	SPI_cursor_close(portal);
+
+	if (!found_left || (even && !found_right))
+		elog(ERROR, "order statistics of column \"%s\" are inconsistent",
+			 NameStr(*attname));
+
+	if (even)
+		left = calculate_average(typid, left, right);
+
+	getTypeOutputInfo(typid, &typoutput, &typisvarlena);
+	result = SPI_datumTransfer(CStringGetTextDatum(OidOutputFunctionCall(typoutput,
+																		 left)),
+							   false, -1);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+
+	PG_RETURN_DATUM(result);
+}
+
+/*
+ * median_ostat_trigger
+ *
+ * Row trigger applying a change of the column to its side tables, and
+ * statement trigger emptying them on TRUNCATE. The arguments are the column
+ * name, the values and buckets tables and the bucket size.
+ */
+Datum
+median_ostat_trigger(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	Trigger    *trigger;
+	TupleDesc	tupdesc;
+	AttrNumber	attnum;
+	MedianOstatPlans *plans;
+	Datum		oldval = (Datum) 0;
+	Datum		newval = (Datum) 0;
+	bool		oldnull = true;
+	bool		newnull = true;
+	Oid			save_userid;
+	int			save_sec_context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "median_ostat_trigger: not called by trigger manager");
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event))
+		elog(ERROR, "median_ostat_trigger: must be fired after the event");
+
+	trigger = trigdata->tg_trigger;
+	if (trigger->tgnargs != 4)
+		elog(ERROR, "median_ostat_trigger: expected 4 arguments, got %d",
+			 trigger->tgnargs);
+
+	SPI_connect();
+	median_switch_to_owner(RelationGetRelid(trigdata->tg_relation),
+						   &save_userid, &save_sec_context);
+
+	if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+	{
+		int			ret;
+
+		ret = SPI_execute(psprintf("DELETE FROM %s", trigger->tgargs[1]),
+						  false, 0);
+		if (ret != SPI_OK_DELETE)
+			elog(ERROR, "SPI_execute failed: error code %d", ret);
+		ret = SPI_execute(psprintf("DELETE FROM %s", trigger->tgargs[2]),
+						  false, 0);
+		if (ret != SPI_OK_DELETE)
+			elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+		SetUserIdAndSecContext(save_userid, save_sec_context);
+		SPI_finish();
+		return PointerGetDatum(NULL);
+	}
+
+	if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		elog(ERROR, "median_ostat_trigger: must be fired for each row");
+
+	tupdesc = RelationGetDescr(trigdata->tg_relation);
+	attnum = SPI_fnumber(tupdesc, trigger->tgargs[0]);
+	if (attnum <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						trigger->tgargs[0],
+						RelationGetRelationName(trigdata->tg_relation))));
+
+	plans = median_ostat_plans(trigger, TupleDescAttr(tupdesc, attnum - 1)->atttypid);
+
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		newval = heap_getattr(trigdata->tg_trigtuple, attnum, tupdesc, &newnull);
+	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+		oldval = heap_getattr(trigdata->tg_trigtuple, attnum, tupdesc, &oldnull);
+	else
+	{
+		oldval = heap_getattr(trigdata->tg_trigtuple, attnum, tupdesc, &oldnull);
+		newval = heap_getattr(trigdata->tg_newtuple, attnum, tupdesc, &newnull);
+
+		/* Nothing to do if the value did not change its place in the order */
+		if (!oldnull && !newnull)
+		{
+			TypeCacheEntry *typentry = get_type_comp_method(plans->typid);
+
+			if (DatumGetInt32(FunctionCall2Coll(&typentry->cmp_proc_finfo,
+												typentry->typcollation,
+												oldval, newval)) == 0)
+				oldnull = newnull = true;
+		}
+	}
+
+	if (!oldnull)
+		median_ostat_remove(plans, oldval);
+	if (!newnull)
+		median_ostat_add(plans, newval);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * median_ostat_check_owner
+ *
+ * Raise an error unless the current user owns the table.
+ */
+static void
+median_ostat_check_owner(Oid relid)
+{
+	if (!pg_class_ownercheck(relid, GetUserId()))
+		aclcheck_error(ACLCHECK_NOT_OWNER,
+					   get_relkind_objtype(get_rel_relkind(relid)),
+					   get_rel_name(relid));
+}
+
+/*
+ * median_ostat_table_name
+ *
+ * Qualified name of a side table of a column, which is created next to the
+ * table.
+ */
+static char *
+median_ostat_table_name(Oid relid, AttrNumber attnum, const char *suffix)
+{
+	return quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+									  psprintf("median_ostat_%u_%d_%s",
+											   relid, attnum, suffix));
+}
+
+/*
+ * median_ostat_lookup
+ *
+ * Find the side tables of a column. Must be called while connected to SPI,
+ * the names are allocated in the SPI procedure context.
+ */
+static bool
+median_ostat_lookup(Oid funcid, Oid relid, Name attname,
+					char **values_table, char **buckets_table)
+{
+	Oid			argtypes[2] = {REGCLASSOID, NAMEOID};
+	Datum		args[2];
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+
+	median_switch_to_owner(median_catalog_relid(funcid, "median_ostat"),
+						   &save_userid, &save_sec_context);
+	ret = SPI_execute_with_args(psprintf("SELECT values_table, buckets_table "
+										 "FROM %s.median_ostat "
+										 "WHERE relid = $1 AND attname = $2",
+										 quote_identifier(get_namespace_name(get_func_namespace(funcid)))),
+								2, argtypes, args, NULL, true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	if (SPI_processed == 0)
+		return false;
+
+	/* regclass output is quoted and qualified where needed */
+	*values_table = pstrdup(SPI_getvalue(SPI_tuptable->vals[0],
+										 SPI_tuptable->tupdesc, 1));
+	*buckets_table = pstrdup(SPI_getvalue(SPI_tuptable->vals[0],
+										  SPI_tuptable->tupdesc, 2));
+
+	return true;
+}
+
+/*
+ * median_ostat_build_buckets
+ *
+ * Replace the buckets with ones of bucket_size values each, walking the
+ * values in order. Returns the number of buckets. Must be called while
+ * connected to SPI.
+ */
+static int
+median_ostat_build_buckets(const char *values_table, const char *buckets_table,
+						   Oid typid, int bucket_size)
+{
+	Oid			argtypes[2] = {typid, INT8OID};
+	Datum		args[2];
+	SPIPlanPtr	insert;
+	Portal		portal;
+	int16		typlen;
+	bool		typbyval;
+	bool		have_bucket = false;
+	int			nbuckets = 0;
+	bool		isnull;
+	int			ret;
+
+	get_typlenbyval(typid, &typlen, &typbyval);
+
+	ret = SPI_execute(psprintf("DELETE FROM %s", buckets_table), false, 0);
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	insert = SPI_prepare(psprintf("INSERT INTO %s (lo, cnt) VALUES ($1, $2)",
+								  buckets_table), 2, argtypes);
+	if (insert == NULL)
+		elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+	args[0] = (Datum) 0;
+	args[1] = Int64GetDatum(0);
+
+	portal = SPI_cursor_open_with_args(NULL,
+									   psprintf("SELECT val, cnt FROM %s ORDER BY val",
+												values_table),
+									   0, NULL, NULL, NULL, false, 0);
+	for (;;)
+	{
+		SPITupleTable *tuptable;
+		uint64		nrows;
+		uint64		i;
+
+		SPI_cursor_fetch(portal, true, MEDIAN_OSTAT_FETCH);
+		tuptable = SPI_tuptable;
+		nrows = SPI_processed;
+		if (nrows == 0)
+			break;
+
+		for (i = 0; i < nrows; i++)
+		{
+			HeapTuple	tuple = tuptable->vals[i];
+
+			if (!have_bucket || DatumGetInt64(args[1]) >= bucket_size)
+			{
+				if (have_bucket)
+				{
+					ret = SPI_execute_plan(insert, args, NULL, false, 0);
+					if (ret != SPI_OK_INSERT)
+						elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+					nbuckets++;
+				}
+				args[0] = datumCopy(SPI_getbinval(tuple, tuptable->tupdesc, 1,
+												  &isnull), typbyval, typlen);
+				args[1] = Int64GetDatum(0);
+				have_bucket = true;
+			}
+			args[1] = Int64GetDatum(DatumGetInt64(args[1]) +
+									DatumGetInt64(SPI_getbinval(tuple, tuptable->tupdesc,
+																2, &isnull)));
+		}
+		SPI_freetuptable(tuptable);
+	}
+	SPI_cursor_close(portal);
+
+	if (have_bucket)
+	{
+		ret = SPI_execute_plan(insert, args, NULL, false, 0);
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+		nbuckets++;
+	}
+
+	SPI_freeplan(insert);
+
+	return nbuckets;
+}
+
+/*
+ * median_ostat_plans
+ *
+ * Return the saved plans of a trigger, preparing them on first use.
+ */
+static MedianOstatPlans *
+median_ostat_plans(Trigger *trigger, Oid typid)
+{
+	MedianOstatPlans *plans;
+	const char *values_table = trigger->tgargs[1];
+	const char *buckets_table = trigger->tgargs[2];
+	Oid			argtypes[2] = {typid, INT8OID};
+	Oid			move_argtypes[2] = {typid, typid};
+	bool		found;
+
+	if (median_ostat_plans_hash == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(MedianOstatPlans);
+		median_ostat_plans_hash = hash_create("median ostat plans", 16, &ctl,
+											  HASH_ELEM | HASH_BLOBS);
+	}
+
+	plans = (MedianOstatPlans *) hash_search(median_ostat_plans_hash,
+											 &trigger->tgoid, HASH_ENTER,
+											 &found);
+	if (found && plans->typid == typid)
+		return plans;
+
+	/* Entries are only valid once all plans are saved */
+	hash_search(median_ostat_plans_hash, &trigger->tgoid, HASH_REMOVE, NULL);
+
+	{
+		MedianOstatPlans new_plans;
+
+		new_plans.tgoid = trigger->tgoid;
+		new_plans.typid = typid;
+		new_plans.bucket_size = pg_atoi(trigger->tgargs[3], sizeof(int32), 0);
+		new_plans.inc = median_ostat_prepare(psprintf("INSERT INTO %s AS v (val, cnt) "
+													  "VALUES ($1, 1) ON CONFLICT (val) "
+													  "DO UPDATE SET cnt = v.cnt + 1",
+													  values_table),
+											 1, argtypes);
+		new_plans.dec = median_ostat_prepare(psprintf("UPDATE %s SET cnt = cnt - 1 "
+													  "WHERE val = $1 RETURNING cnt",
+													  values_table),
+											 1, argtypes);
+		new_plans.del = median_ostat_prepare(psprintf("DELETE FROM %s "
+													  "WHERE val = $1 AND cnt <= 0",
+													  values_table),
+											 1, argtypes);
+		new_plans.find_bucket = median_ostat_prepare(psprintf("SELECT coalesce((SELECT max(lo) FROM %s WHERE lo <= $1), "
+															  "(SELECT min(lo) FROM %s))",
+															  buckets_table, buckets_table),
+													 1, argtypes);
+		new_plans.lock_bucket = median_ostat_prepare(psprintf("SELECT 1 FROM %s WHERE lo = $1 "
+															  "FOR UPDATE",
+															  buckets_table),
+													 1, argtypes);
+		new_plans.count = median_ostat_prepare(psprintf("UPDATE %s SET cnt = cnt + $2 "
+														"WHERE lo = $1 "
+														"RETURNING lo, cnt, lo = (SELECT min(lo) FROM %s)",
+														buckets_table, buckets_table),
+											   2, argtypes);
+		new_plans.insert_bucket = median_ostat_prepare(psprintf("INSERT INTO %s (lo, cnt) "
+																"VALUES ($1, $2)",
+																buckets_table),
+													   2, argtypes);
+		new_plans.set_bucket = median_ostat_prepare(psprintf("UPDATE %s SET cnt = $2 "
+															 "WHERE lo = $1",
+															 buckets_table),
+													2, argtypes);
+		new_plans.move_bucket = median_ostat_prepare(psprintf("UPDATE %s SET lo = $2 "
+															  "WHERE lo = $1",
+															  buckets_table),
+													 2, move_argtypes);
+		new_plans.scan_from = median_ostat_prepare(psprintf("SELECT val, cnt FROM %s "
+															"WHERE val >= $1 ORDER BY val",
+															values_table),
+												   1, argtypes);
+		new_plans.scan_all = median_ostat_prepare(psprintf("SELECT val, cnt FROM %s "
+														   "ORDER BY val",
+														   values_table),
+												  0, NULL);
+
+		plans = (MedianOstatPlans *) hash_search(median_ostat_plans_hash,
+												 &trigger->tgoid, HASH_ENTER,
+												 &found);
+		*plans = new_plans;
+	}
+
+	return plans;
+}
+
+/*
+ * median_ostat_prepare
+ *
+ * Prepare and save a plan for the lifetime of the backend.
+ */
+static SPIPlanPtr
+median_ostat_prepare(const char *query, int nargs, Oid *argtypes)
+{
+	SPIPlanPtr	plan = SPI_prepare(query, nargs, argtypes);
+
+	if (plan == NULL)
+		elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+	if (SPI_keepplan(plan) != 0)
+		elog(ERROR, "SPI_keepplan failed");
+
+	return plan;
+}
+
+/*
+ * median_ostat_add
+ *
+ * Count one occurrence of a value.
+ */
+static void
+median_ostat_add(MedianOstatPlans *plans, Datum value)
+{
+	int			ret;
+
+	ret = SPI_execute_plan(plans->inc, &value, NULL, false, 0);
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+
+	median_ostat_count(plans, value, 1);
+}
+
+/*
+ * median_ostat_remove
+ *
+ * Uncount one occurrence of a value.
+ */
+static void
+median_ostat_remove(MedianOstatPlans *plans, Datum value)
+{
+	bool		isnull;
+	int			ret;
+
+	ret = SPI_execute_plan(plans->dec, &value, NULL, false, 0);
+	if (ret != SPI_OK_UPDATE_RETURNING)
+		elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+
+	/* Not counted, e.g. changed while the triggers were disabled */
+	if (SPI_processed == 0)
+		return;
+
+	if (DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull)) <= 0)
+	{
+		ret = SPI_execute_plan(plans->del, &value, NULL, false, 0);
+		if (ret != SPI_OK_DELETE)
+			elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+	}
+
+	median_ostat_count(plans, value, -1);
+}
+
+/*
+ * median_ostat_count
+ *
+ * Add delta to the count of the bucket a value falls in, and split the bucket
+ * if it grew too big.
+ *
+ * A concurrent split can move the value to a new bucket after we picked the
+ * old one, and an UPDATE waiting for the split would not look for the bucket
+ * again when rechecking the row. So the bucket is locked first and looked up
+ * once more under the lock: a bucket is only split by a transaction holding
+ * its lock, so if the lookup still finds it, it stays right until we commit.
+ * Otherwise we try again with the bucket found. Buckets locked by mistake
+ * stay locked until the end of the transaction.
+ */
+static void
+median_ostat_count(MedianOstatPlans *plans, Datum value, int64 delta)
+{
+	TypeCacheEntry *typentry = get_type_comp_method(plans->typid);
+	Datum		args[2];
+	Datum		lo;
+	Datum		found;
+	bool		have_bucket;
+	HeapTuple	tuple;
+	TupleDesc	tupdesc;
+	int64		cnt;
+	bool		isnull;
+	int			ret;
+
+	args[0] = value;
+	args[1] = Int64GetDatum(delta);
+
+	have_bucket = median_ostat_find_bucket(plans, value, &lo);
+	while (have_bucket)
+	{
+		bool		locked;
+
+		CHECK_FOR_INTERRUPTS();
+
+		ret = SPI_execute_plan(plans->lock_bucket, &lo, NULL, false, 0);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+		locked = (SPI_processed > 0);
+
+		/* The bucket is gone if the buckets were rebuilt meanwhile */
+		have_bucket = median_ostat_find_bucket(plans, value, &found);
+		if (have_bucket && locked &&
+			DatumGetInt32(FunctionCall2Coll(&typentry->cmp_proc_finfo,
+											typentry->typcollation,
+											lo, found)) == 0)
+			break;
+
+		lo = found;
+	}
+
+	if (!have_bucket)
+	{
+		/* No buckets yet */
+		if (delta > 0)
+		{
+			ret = SPI_execute_plan(plans->insert_bucket, args, NULL, false, 0);
+			if (ret != SPI_OK_INSERT)
+				elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+		}
+		return;
+	}
+
+	args[0] = lo;
+	ret = SPI_execute_plan(plans->count, args, NULL, false, 0);
+	if (ret != SPI_OK_UPDATE_RETURNING)
+		elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+
+	tuple = SPI_tuptable->vals[0];
+	tupdesc = SPI_tuptable->tupdesc;
+	cnt = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+
+	if (cnt > 2 * (int64) plans->bucket_size)
+		median_ostat_split(plans, SPI_getbinval(tuple, tupdesc, 1, &isnull), cnt,
+						   DatumGetBool(SPI_getbinval(tuple, tupdesc, 3, &isnull)));
+}
+
+/*
+ * median_ostat_find_bucket
+ *
+ * Look up the lo of the bucket a value falls in, in the current memory
+ * context. Returns false if there are no buckets.
+ */
+static bool
+median_ostat_find_bucket(MedianOstatPlans *plans, Datum value, Datum *lo)
+{
+	int16		typlen;
+	bool		typbyval;
+	bool		isnull;
+	int			ret;
+
+	ret = SPI_execute_plan(plans->find_bucket, &value, NULL, false, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+
+	*lo = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+						&isnull);
+	if (isnull)
+		return false;
+
+	get_typlenbyval(plans->typid, &typlen, &typbyval);
+	*lo = datumCopy(*lo, typbyval, typlen);
+
+	return true;
+}
+
+/*
+ * median_ostat_split
+ *
+ * Split the bucket starting at lo, holding cnt values, at the first value
+ * that has half of them before it. A bucket of a single value cannot be
+ * split and is left alone.
+ *
+ * The first bucket also holds the values below its lo, so its lo is first
+ * moved down to the lowest value. The split then falls above lo, where the
+ * new bucket starts.
+ */
+static void
+median_ostat_split(MedianOstatPlans *plans, Datum lo, int64 cnt, bool first)
+{
+	Portal		portal;
+	int64		acc = 0;
+	bool		done = false;
+	bool		lo_checked = !first;
+	Datum		args[2];
+	bool		isnull;
+	int			ret;
+
+	if (first)
+		portal = SPI_cursor_open(NULL, plans->scan_all, NULL, NULL, false);
+	else
+		portal = SPI_cursor_open(NULL, plans->scan_from, &lo, NULL, false);
+
+	while (!done)
+	{
+		SPITupleTable *tuptable;
+		uint64		nrows;
+		uint64		i;
+
+		SPI_cursor_fetch(portal, true, MEDIAN_OSTAT_FETCH);
+		tuptable = SPI_tuptable;
+		nrows = SPI_processed;
+		if (nrows == 0)
+			break;
+
+		for (i = 0; i < nrows && !done; i++)
+		{
+			HeapTuple	tuple = tuptable->vals[i];
+
+			if (!lo_checked)
+			{
+				TypeCacheEntry *typentry = get_type_comp_method(plans->typid);
+				Datum		lowest = SPI_getbinval(tuple, tuptable->tupdesc, 1,
+												   &isnull);
+
+				if (DatumGetInt32(FunctionCall2Coll(&typentry->cmp_proc_finfo,
+													typentry->typcollation,
+													lowest, lo)) < 0)
+				{
+					args[0] = lo;
+					args[1] = lowest;
+					ret = SPI_execute_plan(plans->move_bucket, args, NULL,
+										   false, 0);
+					if (ret != SPI_OK_UPDATE)
+						elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+					lo = datumCopy(lowest, typentry->typbyval, typentry->typlen);
+				}
+				lo_checked = true;
+			}
+
+			if (acc > 0 && acc >= cnt / 2)
+			{
+				/* Old bucket keeps what came before, the new one the rest */
+				args[0] = lo;
+				args[1] = Int64GetDatum(acc);
+				ret = SPI_execute_plan(plans->set_bucket, args, NULL, false, 0);
+				if (ret != SPI_OK_UPDATE)
+					elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+
+				args[0] = SPI_getbinval(tuple, tuptable->tupdesc, 1, &isnull);
+				args[1] = Int64GetDatum(cnt - acc);
+				ret = SPI_execute_plan(plans->insert_bucket, args, NULL, false, 0);
+				if (ret != SPI_OK_INSERT)
+					elog(ERROR, "SPI_execute_plan failed: error code %d", ret);
+
+				done = true;
+				break;
+			}
+
+			acc += DatumGetInt64(SPI_getbinval(tuple, tuptable->tupdesc, 2,
+											   &isnull));
+
+			/* Reached the end of the bucket */
+			if (acc >= cnt)
+				done = true;
+		}
+		SPI_freetuptable(tuptable);
+	}
+	SPI_cursor_close(portal);
+}
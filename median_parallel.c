@@ -0,0 +1,483 @@
+/*
+ * median_parallel.c
+ *
+ * Parallel finalize of a single huge by-value median state.
+ *
+ * Parallel query only parallelizes the scan: the selection over the combined
+ * state still runs in the leader. For states above
+ * median.finalize_workers_threshold values, median_finalfn instead copies the
+ * values into a dynamic shared memory segment and launches dynamic background
+ * workers that share the selection with it, in two rounds:
+ *
+ *	1. Every participant builds a histogram of the top 16 key bits over the
+ *	   chunks of the array it claims. The leader merges them, which tells it
+ *	   which bucket holds the wanted rank.
+ *
+ *	2. Every participant compacts the keys of that bucket to the front of the
+ *	   chunks it claims, and finds the smallest key of the next non-empty
+ *	   bucket, in case the even-count median needs it.
+ *
+ * The leader then moves the compacted candidates together and finishes with
+ * ordinary radix selection over them, which is cheap as they are only a small
+ * part of the input. Chunks are claimed through an atomic counter and the
+ * leader takes part in both rounds itself, so the result does not depend on
+ * how many of the workers actually start. Should a worker exit without
+ * finishing a chunk it claimed, we give up and let the caller fall back to
+ * selecting locally; the state itself is never modified.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "tcop/tcopprot.h"
+#include "utils/resowner.h"
+
+#include "median.h"
+
+/* Number of key bits histogrammed in the first round */
+#define PARALLEL_BUCKET_BITS	16
+#define PARALLEL_BUCKETS		(1 << PARALLEL_BUCKET_BITS)
+
+/* Size of the unit of work claimed by a participant */
+#define PARALLEL_CHUNK_SIZE		(1024 * 1024)
+
+/* Upper limit for median.finalize_workers */
+#define MEDIAN_MAX_WORKERS		64
+
+typedef enum MedianParallelRound
+{
+	MEDIAN_ROUND_HISTOGRAM,
+	MEDIAN_ROUND_COMPACT
+} MedianParallelRound;
+
+typedef enum MedianChunkStatus
+{
+	MEDIAN_CHUNK_TODO,
+	MEDIAN_CHUNK_CLAIMED,
+	MEDIAN_CHUNK_DONE
+} MedianChunkStatus;
+
+/*
+ * MedianParallelShared
+ *
+ * Header of the DSM segment. It is followed by the per-participant
+ * histograms, the per-chunk status and candidate counts, and the data.
+ */
+typedef struct MedianParallelShared
+{
+	MedianKeyKind kind;
+	int64		count;			/* number of values in data */
+	int			nchunks;
+	int			max_participants;	/* launched workers plus the leader */
+	MedianParallelRound round;
+	uint32		bucket;			/* COMPACT: bucket holding the rank */
+	uint32		next_bucket;	/* COMPACT: next non-empty bucket */
+	pg_atomic_uint32 next_participant;	/* slot assignment, leader is 0 */
+	pg_atomic_uint32 next_chunk;	/* next chunk to claim */
+	Size		hist_offset;	/* int64[max_participants][PARALLEL_BUCKETS] */
+	Size		min_offset;		/* uint64[max_participants] */
+	Size		status_offset;	/* pg_atomic_uint32[nchunks] */
+	Size		ncand_offset;	/* int64[nchunks] */
+	Size		data_offset;	/* uint64[count] */
+} MedianParallelShared;
+
+#define SHARED_PTR(shared, type, offset) \
+	((type *) ((char *) (shared) + (shared)->offset))
+
+static void median_parallel_run(MedianParallelShared *shared, int participant);
+static int	median_parallel_launch(dsm_segment *seg, int nworkers,
+								   BackgroundWorkerHandle **handles);
+static bool median_parallel_wait(MedianParallelShared *shared, int nlaunched,
+								 BackgroundWorkerHandle **handles);
+static void median_parallel_reset(MedianParallelShared *shared,
+								  MedianParallelRound round);
+
+PGDLLEXPORT void median_finalize_worker_main(Datum main_arg);
+
+
+/*
+ * median_parallel_select
+ *
+ * Find the value of zero-based rank in values, and of rank + 1 if next is
+ * not NULL, with the help of up to nworkers background workers. The final
+ * selection over the candidates uses up to nthreads threads.
+ *
+ * Returns false if the selection could not be done in parallel, in which
+ * case the caller should do it locally.
+ */
+bool
+median_parallel_select(const Datum *values, int64 count, MedianKeyKind kind,
+					   int64 rank, int nworkers, int nthreads,
+					   Datum *result, Datum *next)
+{
+	MedianParallelShared *shared;
+	dsm_segment *seg;
+	BackgroundWorkerHandle *handles[MEDIAN_MAX_WORKERS];
+	int			nlaunched;
+	int			max_participants;
+	int			nchunks;
+	int			shift;
+	int64	   *hist;
+	int64	   *merged;
+	int64		cum = 0;
+	int64		bucket_count = 0;
+	uint32		bucket;
+	uint32		next_bucket;
+	uint64	   *data;
+	int64		ncand;
+	int			i;
+	Size		size;
+
+	Assert(kind != MEDIAN_KEY_NONE);
+	Assert(rank >= 0 && rank < count);
+	Assert(next == NULL || rank + 1 < count);
+
+	/* Keys no wider than the histogram need no parallel help */
+	shift = median_key_bits(kind) - PARALLEL_BUCKET_BITS;
+	if (shift <= 0)
+		return false;
+
+	nworkers = Min(nworkers, MEDIAN_MAX_WORKERS);
+	max_participants = nworkers + 1;
+	nchunks = (int) ((count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+
+	/* Lay out the segment */
+	size = MAXALIGN(sizeof(MedianParallelShared));
+	size += MAXALIGN(mul_size(max_participants,
+							  PARALLEL_BUCKETS * sizeof(int64)));
+	size += MAXALIGN(mul_size(max_participants, sizeof(uint64)));
+	size += MAXALIGN(mul_size(nchunks, sizeof(pg_atomic_uint32)));
+	size += MAXALIGN(mul_size(nchunks, sizeof(int64)));
+	size = add_size(size, mul_size(count, sizeof(uint64)));
+
+	seg = dsm_create(size, DSM_CREATE_NULL_IF_MAXSEGMENTS);
+	if (seg == NULL)
+		return false;
+
+	shared = (MedianParallelShared *) dsm_segment_address(seg);
+	shared->kind = kind;
+	shared->count = count;
+	shared->nchunks = nchunks;
+	shared->max_participants = max_participants;
+	pg_atomic_init_u32(&shared->next_participant, 1);
+	pg_atomic_init_u32(&shared->next_chunk, 0);
+
+	size = MAXALIGN(sizeof(MedianParallelShared));
+	shared->hist_offset = size;
+	size += MAXALIGN(max_participants * PARALLEL_BUCKETS * sizeof(int64));
+	shared->min_offset = size;
+	size += MAXALIGN(max_participants * sizeof(uint64));
+	shared->status_offset = size;
+	size += MAXALIGN(nchunks * sizeof(pg_atomic_uint32));
+	shared->ncand_offset = size;
+	size += MAXALIGN(nchunks * sizeof(int64));
+	shared->data_offset = size;
+
+	for (i = 0; i < nchunks; i++)
+		pg_atomic_init_u32(&SHARED_PTR(shared, pg_atomic_uint32, status_offset)[i],
+						   MEDIAN_CHUNK_TODO);
+
+	/* Copy the values in, widening them on builds with 4-byte Datums */
+	data = SHARED_PTR(shared, uint64, data_offset);
+#if SIZEOF_DATUM == 8
+	memcpy(data, values, count * sizeof(Datum));
+#else
+	for (int64 j = 0; j < count; j++)
+		data[j] = (uint64) values[j];
+#endif
+
+	/* Round 1: histogram of the top key bits */
+	median_parallel_reset(shared, MEDIAN_ROUND_HISTOGRAM);
+	nlaunched = median_parallel_launch(seg, nworkers, handles);
+	median_parallel_run(shared, 0);
+	if (!median_parallel_wait(shared, nlaunched, handles))
+	{
+		dsm_detach(seg);
+		return false;
+	}
+
+	hist = SHARED_PTR(shared, int64, hist_offset);
+	merged = (int64 *) palloc0(PARALLEL_BUCKETS * sizeof(int64));
+	for (i = 0; i < max_participants; i++)
+	{
+		int			b;
+
+		for (b = 0; b < PARALLEL_BUCKETS; b++)
+			merged[b] += hist[i * PARALLEL_BUCKETS + b];
+	}
+
+	for (bucket = 0; bucket < PARALLEL_BUCKETS - 1; bucket++)
+	{
+		if (rank < cum + merged[bucket])
+			break;
+		cum += merged[bucket];
+	}
+	bucket_count = merged[bucket];
+	rank -= cum;
+
+	for (next_bucket = bucket + 1; next_bucket < PARALLEL_BUCKETS; next_bucket++)
+		if (merged[next_bucket] > 0)
+			break;
+	pfree(merged);
+
+	/* Round 2: compact the candidates of the bucket */
+	shared->bucket = bucket;
+	shared->next_bucket = next_bucket;
+	median_parallel_reset(shared, MEDIAN_ROUND_COMPACT);
+	nlaunched = median_parallel_launch(seg, nworkers, handles);
+	median_parallel_run(shared, 0);
+	if (!median_parallel_wait(shared, nlaunched, handles))
+	{
+		dsm_detach(seg);
+		return false;
+	}
+
+	/* Move the candidates of all chunks together */
+	ncand = 0;
+	for (i = 0; i < nchunks; i++)
+	{
+		int64		n = SHARED_PTR(shared, int64, ncand_offset)[i];
+
+		memmove(data + ncand, data + (int64) i * PARALLEL_CHUNK_SIZE,
+				n * sizeof(uint64));
+		ncand += n;
+	}
+	Assert(ncand == bucket_count);
+
+	if (next != NULL && rank + 1 < bucket_count)
+	{
+		uint64		next_key;
+		uint64		key;
+
+		key = median_radix_select_keys(data, ncand, kind, rank, nthreads,
+									   &next_key);
+		*result = median_key_to_datum(key, kind);
+		*next = median_key_to_datum(next_key, kind);
+	}
+	else
+	{
+		uint64		key;
+
+		key = median_radix_select_keys(data, ncand, kind, rank, nthreads,
+									   NULL);
+		*result = median_key_to_datum(key, kind);
+
+		if (next != NULL)
+		{
+			uint64	   *mins = SHARED_PTR(shared, uint64, min_offset);
+			uint64		min_key = PG_UINT64_MAX;
+
+			for (i = 0; i < max_participants; i++)
+				min_key = Min(min_key, mins[i]);
+			*next = median_key_to_datum(min_key, kind);
+		}
+	}
+
+	dsm_detach(seg);
+	return true;
+}
+
+/*
+ * median_parallel_reset
+ *
+ * Prepare the shared state for the next round.
+ */
+static void
+median_parallel_reset(MedianParallelShared *shared, MedianParallelRound round)
+{
+	pg_atomic_uint32 *status = SHARED_PTR(shared, pg_atomic_uint32, status_offset);
+	uint64	   *mins = SHARED_PTR(shared, uint64, min_offset);
+	int			i;
+
+	shared->round = round;
+	pg_atomic_write_u32(&shared->next_participant, 1);
+	pg_atomic_write_u32(&shared->next_chunk, 0);
+
+	memset(SHARED_PTR(shared, int64, hist_offset), 0,
+		   shared->max_participants * PARALLEL_BUCKETS * sizeof(int64));
+	for (i = 0; i < shared->max_participants; i++)
+		mins[i] = PG_UINT64_MAX;
+	for (i = 0; i < shared->nchunks; i++)
+		pg_atomic_write_u32(&status[i], MEDIAN_CHUNK_TODO);
+
+	/* Make sure workers see the reset state before they are launched */
+	pg_memory_barrier();
+}
+
+/*
+ * median_parallel_run
+ *
+ * Claim and process chunks of the current round until none are left. Used by
+ * the leader as well as the workers.
+ */
+static void
+median_parallel_run(MedianParallelShared *shared, int participant)
+{
+	pg_atomic_uint32 *status = SHARED_PTR(shared, pg_atomic_uint32, status_offset);
+	int64	   *ncand = SHARED_PTR(shared, int64, ncand_offset);
+	uint64	   *data = SHARED_PTR(shared, uint64, data_offset);
+	int64	   *hist = SHARED_PTR(shared, int64, hist_offset) +
+		(Size) participant * PARALLEL_BUCKETS;
+	uint64	   *min_key = SHARED_PTR(shared, uint64, min_offset) + participant;
+	MedianKeyKind kind = shared->kind;
+	int			shift = median_key_bits(kind) - PARALLEL_BUCKET_BITS;
+
+	for (;;)
+	{
+		uint32		chunk = pg_atomic_fetch_add_u32(&shared->next_chunk, 1);
+		int64		start;
+		int64		end;
+		int64		i;
+
+		if (chunk >= shared->nchunks)
+			break;
+
+		pg_atomic_write_u32(&status[chunk], MEDIAN_CHUNK_CLAIMED);
+		start = (int64) chunk * PARALLEL_CHUNK_SIZE;
+		end = Min(start + PARALLEL_CHUNK_SIZE, shared->count);
+
+		if (shared->round == MEDIAN_ROUND_HISTOGRAM)
+		{
+			for (i = start; i < end; i++)
+			{
+				uint64		key = median_datum_to_key((Datum) data[i], kind);
+
+				hist[key >> shift]++;
+			}
+		}
+		else
+		{
+			int64		out = start;
+
+			/* Keys overwrite values we have already read */
+			for (i = start; i < end; i++)
+			{
+				uint64		key = median_datum_to_key((Datum) data[i], kind);
+				uint32		bucket = (uint32) (key >> shift);
+
+				if (bucket == shared->bucket)
+					data[out++] = key;
+				else if (bucket == shared->next_bucket && key < *min_key)
+					*min_key = key;
+			}
+			ncand[chunk] = out - start;
+		}
+
+		pg_write_barrier();
+		pg_atomic_write_u32(&status[chunk], MEDIAN_CHUNK_DONE);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * median_parallel_launch
+ *
+ * Start up to nworkers workers for the current round, returning how many
+ * could be registered.
+ */
+static int
+median_parallel_launch(dsm_segment *seg, int nworkers,
+					   BackgroundWorkerHandle **handles)
+{
+	BackgroundWorker worker;
+	int			i;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "median");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "median_finalize_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "median finalize worker for PID %d",
+			 MyProcPid);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "median finalize worker");
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	worker.bgw_notify_pid = MyProcPid;
+
+	for (i = 0; i < nworkers; i++)
+	{
+		if (!RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+			break;
+	}
+
+	if (i < nworkers)
+		elog(DEBUG1, "could only launch %d of %d median finalize workers",
+			 i, nworkers);
+
+	return i;
+}
+
+/*
+ * median_parallel_wait
+ *
+ * Wait for the workers of a round to exit, and check that every chunk was
+ * processed. Returns false otherwise.
+ */
+static bool
+median_parallel_wait(MedianParallelShared *shared, int nlaunched,
+					 BackgroundWorkerHandle **handles)
+{
+	pg_atomic_uint32 *status = SHARED_PTR(shared, pg_atomic_uint32, status_offset);
+	int			i;
+
+	for (i = 0; i < nlaunched; i++)
+	{
+		BgwHandleStatus bgwstatus;
+
+		bgwstatus = WaitForBackgroundWorkerShutdown(handles[i]);
+		if (bgwstatus == BGWH_POSTMASTER_DIED)
+			ereport(FATAL,
+					(errcode(ERRCODE_ADMIN_SHUTDOWN),
+					 errmsg("postmaster exited during a median finalize")));
+		pfree(handles[i]);
+	}
+
+	pg_read_barrier();
+	for (i = 0; i < shared->nchunks; i++)
+	{
+		if (pg_atomic_read_u32(&status[i]) != MEDIAN_CHUNK_DONE)
+		{
+			elog(DEBUG1, "median finalize worker left chunk %d unfinished", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * median_finalize_worker_main
+ *
+ * Entry point of the dynamic background workers. The argument is the handle
+ * of the DSM segment to work on.
+ */
+void
+median_finalize_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	MedianParallelShared *shared;
+	uint32		participant;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "median finalize worker");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+
+	shared = (MedianParallelShared *) dsm_segment_address(seg);
+	participant = pg_atomic_fetch_add_u32(&shared->next_participant, 1);
+	if (participant < shared->max_participants)
+		median_parallel_run(shared, participant);
+
+	dsm_detach(seg);
+	proc_exit(0);
+}
@@ -0,0 +1,318 @@
+/*
+ * median_partition.c
+ *
+ * Medians of partitioned tables from cached per-partition states.
+ *
+ * In a table partitioned by time only the newest partitions still change, yet
+ * median() reads all of them every time. median_cached() instead keeps the
+ * serialized median state of every leaf partition in the
+ * median_partition_cache table, computed with median_state_agg, and merges
+ * them. A cached state is reused as long as the partition keeps its
+ * relfilenode and its insert, update and delete counters in the statistics
+ * collector stay the same; otherwise the partition is scanned again and its
+ * entry replaced. So the cost of a query is the scan of the partitions that
+ * changed plus the merge.
+ *
+ * The statistics collector hears about changes with a delay of up to half a
+ * second, and about those of running transactions only at commit, so a state
+ * cached right after a change may miss it until the counters move again.
+ * Partitions changed by the current transaction are scanned and not cached,
+ * as are all partitions when track_counts is off. The time the database's
+ * counters were last reset is cached along with the counters, since a reset
+ * counter could climb back to its cached value. Foreign partitions cannot be
+ * checked for changes and are always scanned.
+ *
+ * A partition is scanned through the parent, restricted to the partition by
+ * its tableoid and its partition constraint, which lets the planner prune the
+ * others. So the privileges and policies of the parent apply as they would to
+ * median() over the parent, and not those of the partition. The cache is only
+ * read and written as its owner and not granted to anyone, so its states can
+ * be trusted.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "access/relation.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/partcache.h"
+#include "utils/rel.h"
+#include "utils/ruleutils.h"
+#include "utils/timestamp.h"
+
+#include "median.h"
+
+static bytea *median_partition_state(const char *nspname, Oid cache_relid,
+									 Oid parent, Oid relid, Name attname,
+									 bool cacheable);
+static bool median_partition_counted(Oid relid);
+static int64 median_partition_changes(Oid relid);
+static TimestampTz median_partition_stats_reset(void);
+
+PG_FUNCTION_INFO_V1(median_cached);
+
+
+/*
+ * median_cached
+ *
+ * The median of a column over all partitions of a table, in text form.
+ */
+Datum
+median_cached(PG_FUNCTION_ARGS)
+{
+	Oid			parent = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	char	   *nspname = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+	Oid			cache_relid = median_catalog_relid(fcinfo->flinfo->fn_oid,
+												   "median_partition_cache");
+	List	   *partitions;
+	ListCell   *lc;
+	MedianState *merged = NULL;
+	Datum		result;
+	Oid			typoutput;
+	bool		typisvarlena;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	median_check_column(parent, attname, true);
+
+	partitions = find_all_inheritors(parent, AccessShareLock, NULL);
+
+	SPI_connect();
+
+	/* Forget partitions that were dropped */
+	median_switch_to_owner(cache_relid, &save_userid, &save_sec_context);
+	ret = SPI_execute(psprintf("DELETE FROM %s.median_partition_cache c "
+							   "WHERE NOT EXISTS (SELECT 1 FROM pg_catalog.pg_class "
+							   "WHERE oid = c.partition)",
+							   quote_identifier(nspname)), false, 0);
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	foreach(lc, partitions)
+	{
+		Oid			relid = lfirst_oid(lc);
+		char		relkind = get_rel_relkind(relid);
+		bytea	   *bytes;
+		MedianState *state;
+
+		/* Partitioned tables have no rows of their own */
+		if (relkind != RELKIND_RELATION && relkind != RELKIND_FOREIGN_TABLE)
+			continue;
+
+		bytes = median_partition_state(nspname, cache_relid, parent, relid,
+									   attname,
+									   relkind == RELKIND_RELATION &&
+									   median_partition_counted(relid));
+		state = median_state_deserialize_trusted(bytes);
+
+		if (merged == NULL)
+			merged = state;
+		else
+			median_state_combine(merged, state);
+	}
+
+	if (merged == NULL || median_state_count(merged) == 0)
+	{
+		SPI_finish();
+		PG_RETURN_NULL();
+	}
+
+	getTypeOutputInfo(get_atttype(parent, get_attnum(parent, NameStr(*attname))),
+					  &typoutput, &typisvarlena);
+	result = CStringGetTextDatum(OidOutputFunctionCall(typoutput,
+													   median_state_median(merged)));
+	result = SPI_datumTransfer(result, false, -1);
+
+	SPI_finish();
+
+	PG_RETURN_DATUM(result);
+}
+
+/*
+ * median_partition_state
+ *
+ * Return the serialized median state of a column of one partition, from the
+ * cache if it is still valid. Otherwise the partition is scanned through the
+ * parent, and the state cached if cacheable. Must be called while connected
+ * to SPI.
+ */
+static bytea *
+median_partition_state(const char *nspname, Oid cache_relid, Oid parent,
+					   Oid relid, Name attname, bool cacheable)
+{
+	Oid			argtypes[7] = {REGCLASSOID, NAMEOID, REGTYPEOID, OIDOID,
+	INT8OID, TIMESTAMPTZOID, BYTEAOID};
+	Datum		args[7];
+	Oid			typid = get_atttype(relid, get_attnum(relid, NameStr(*attname)));
+	Oid			relfilenode = InvalidOid;
+	int64		changes = 0;
+	TimestampTz stats_reset = 0;
+	bytea	   *bytes;
+	Datum		datum;
+	bool		isnull;
+	Expr	   *qual;
+	char	   *constraint;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+
+	if (cacheable)
+	{
+		Relation	rel = relation_open(relid, AccessShareLock);
+
+		relfilenode = rel->rd_node.relNode;
+		relation_close(rel, NoLock);
+
+		/* Read before scanning, so changes made meanwhile show next time */
+		changes = median_partition_changes(relid);
+		stats_reset = median_partition_stats_reset();
+
+		median_switch_to_owner(cache_relid, &save_userid, &save_sec_context);
+		ret = SPI_execute_with_args(psprintf("SELECT atttypid, relfilenode, "
+											 "changes, stats_reset, state "
+											 "FROM %s.median_partition_cache "
+											 "WHERE partition = $1 AND attname = $2",
+											 quote_identifier(nspname)),
+									2, argtypes, args, NULL, true, 1);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+		SetUserIdAndSecContext(save_userid, save_sec_context);
+
+		if (SPI_processed > 0)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[0];
+			TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+
+			datum = SPI_getbinval(tuple, tupdesc, 5, &isnull);
+			if (!isnull &&
+				DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 1, &isnull)) == typid &&
+				DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 2, &isnull)) == relfilenode &&
+				DatumGetInt64(SPI_getbinval(tuple, tupdesc, 3, &isnull)) == changes &&
+				DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 4, &isnull)) == stats_reset)
+				return DatumGetByteaP(datum);
+		}
+	}
+
+	/* The partition constraint, for pruning; the tableoid is what counts */
+	qual = get_partition_qual_relid(relid);
+	if (qual != NULL)
+		constraint = psprintf(" AND (%s)",
+							  deparse_expression((Node *) qual,
+												 deparse_context_for(get_rel_name(relid),
+																	 relid),
+												 false, false));
+	else
+		constraint = "";
+
+	ret = SPI_execute(psprintf("SELECT %s.median_state_agg(%s) FROM %s "
+							   "WHERE tableoid = %u%s",
+							   quote_identifier(nspname),
+							   quote_identifier(NameStr(*attname)),
+							   quote_qualified_identifier(get_namespace_name(get_rel_namespace(parent)),
+														  get_rel_name(parent)),
+							   relid, constraint),
+					  true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	datum = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+						  &isnull);
+	if (isnull)
+		bytes = median_state_serialize(median_state_create(typid));
+	else
+		bytes = DatumGetByteaP(datum);
+
+	if (!cacheable)
+		return bytes;
+
+	args[2] = ObjectIdGetDatum(typid);
+	args[3] = ObjectIdGetDatum(relfilenode);
+	args[4] = Int64GetDatum(changes);
+	args[5] = TimestampTzGetDatum(stats_reset);
+	args[6] = PointerGetDatum(bytes);
+
+	median_switch_to_owner(cache_relid, &save_userid, &save_sec_context);
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s.median_partition_cache "
+										 "(partition, attname, atttypid, "
+										 "relfilenode, changes, stats_reset, "
+										 "state, computed_at) "
+										 "VALUES ($1, $2, $3, $4, $5, $6, $7, now()) "
+										 "ON CONFLICT (partition, attname) DO UPDATE "
+										 "SET atttypid = $3, relfilenode = $4, "
+										 "changes = $5, stats_reset = $6, "
+										 "state = $7, computed_at = now()",
+										 quote_identifier(nspname)),
+								7, argtypes, args, NULL, false, 0);
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	return bytes;
+}
+
+/*
+ * median_partition_counted
+ *
+ * Do the statistics collector's counters tell whether a partition changed?
+ * Not when counting is off, and not for changes of the current transaction,
+ * which the collector only hears about at commit.
+ */
+static bool
+median_partition_counted(Oid relid)
+{
+	PgStat_TableStatus *tabstat;
+
+	if (!pgstat_track_counts)
+		return false;
+
+	tabstat = find_tabstat_entry(relid);
+
+	return tabstat == NULL || tabstat->trans == NULL;
+}
+
+/*
+ * median_partition_changes
+ *
+ * Sum of the statistics collector's counters of rows written to a partition.
+ */
+static int64
+median_partition_changes(Oid relid)
+{
+	PgStat_StatTabEntry *tabentry = pgstat_fetch_stat_tabentry(relid);
+
+	if (tabentry == NULL)
+		return 0;
+
+	return tabentry->tuples_inserted + tabentry->tuples_updated +
+		tabentry->tuples_deleted;
+}
+
+/*
+ * median_partition_stats_reset
+ *
+ * When the statistics of the current database were last reset, 0 if the
+ * collector knows nothing about it. Resetting the counters of a single table
+ * also sets it.
+ */
+static TimestampTz
+median_partition_stats_reset(void)
+{
+	PgStat_StatDBEntry *dbentry = pgstat_fetch_stat_dbentry(MyDatabaseId);
+
+	if (dbentry == NULL)
+		return 0;
+
+	return dbentry->stat_reset_timestamp;
+}
@@ -0,0 +1,378 @@
+/*
+ * median_rank.c
+ *
+ * Ranks of values against a stored distribution.
+ *
+ * Scoring many values against a baseline, as in
+ *
+ *   SELECT e.*, median_state_rank(b.state, e.val) FROM events e, baseline b
+ *
+ * must not sort the baseline again for every row. median_state_sort() turns a
+ * serialized median state into a sorted, read-only layout once, and
+ * median_state_rank() then binary searches it in place: fixed-length values
+ * are packed at a fixed stride, other values are reached through an array of
+ * offsets, so a lookup only touches about log2(n) values.
+ *
+ * A baseline large enough to be TOASTed would still be fetched, decompressed
+ * and copied for every row, so median_state_rank() keeps the last layout it
+ * was passed in fn_extra, keyed on the datum as stored: for a value kept out
+ * of line that is its TOAST pointer, which stays the same for every row
+ * joined to the baseline.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "access/tupmacs.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "median.h"
+
+/*
+ * MedianSorted
+ *
+ * Header of the sorted layout. For fixed-length types the values follow at
+ * stride bytes each, as stored in a tuple. For other types an array of count
+ * offsets into the values follows, then the values, int-aligned.
+ */
+typedef struct MedianSorted
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	uint32		magic;			/* MEDIAN_SORTED_MAGIC */
+	Oid			typid;			/* type of the values */
+	int16		typlen;
+	bool		typbyval;
+	int32		stride;			/* bytes per value, 0 for varlena types */
+	int64		count;
+} MedianSorted;
+
+#define MEDIAN_SORTED_MAGIC		0x4D534F52	/* "MSOR" */
+#define MEDIAN_SORTED_DATA(s)	((char *) (s) + MAXALIGN(sizeof(MedianSorted)))
+
+/*
+ * MedianRankCache
+ *
+ * The layout last ranked against at a call site, in fn_mcxt.
+ */
+typedef struct MedianRankCache
+{
+	struct varlena *key;		/* copy of the datum as passed */
+	MedianSorted *sorted;		/* detoasted, aligned and checked copy */
+} MedianRankCache;
+
+static MedianSorted *get_sorted(FunctionCallInfo fcinfo);
+static MedianSorted *detoast_sorted(struct varlena *raw);
+static void check_sorted(MedianSorted *sorted);
+static Datum sorted_value(MedianSorted *sorted, int64 i);
+
+PG_FUNCTION_INFO_V1(median_state_sort);
+PG_FUNCTION_INFO_V1(median_state_rank);
+
+
+/*
+ * median_state_sort
+ *
+ * Sorted layout of a serialized median state, for median_state_rank.
+ */
+Datum
+median_state_sort(PG_FUNCTION_ARGS)
+{
+	MedianState *state = median_state_deserialize(PG_GETARG_BYTEA_P(0));
+	Oid			typid = median_state_type(state);
+	int64		count = median_state_count(state);
+	Datum	   *values = median_state_sorted_values(state);
+	MedianSorted *sorted;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	Size		size;
+	char	   *data;
+
+	get_typlenbyvalalign(typid, &typlen, &typbyval, &typalign);
+
+	size = MAXALIGN(sizeof(MedianSorted));
+	if (typlen > 0)
+		size += count * att_align_nominal(typlen, typalign);
+	else
+	{
+		size += MAXALIGN(count * sizeof(uint32));
+		for (int64 i = 0; i < count && size <= MaxAllocSize; i++)
+		{
+			if (typlen == -1)
+				size = INTALIGN(size) + VARSIZE_ANY(DatumGetPointer(values[i]));
+			else
+				size += strlen(DatumGetCString(values[i])) + 1;
+		}
+	}
+
+	if (size > MaxAllocSize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("median state is too large to sort")));
+
+	sorted = (MedianSorted *) palloc0(size);
+	SET_VARSIZE(sorted, size);
+	sorted->magic = MEDIAN_SORTED_MAGIC;
+	sorted->typid = typid;
+	sorted->typlen = typlen;
+	sorted->typbyval = typbyval;
+	sorted->stride = typlen > 0 ? att_align_nominal(typlen, typalign) : 0;
+	sorted->count = count;
+
+	data = MEDIAN_SORTED_DATA(sorted);
+	if (typlen > 0)
+	{
+		for (int64 i = 0; i < count; i++)
+		{
+			char	   *p = data + i * sorted->stride;
+
+			if (typbyval)
+				store_att_byval(p, values[i], typlen);
+			else
+				memcpy(p, DatumGetPointer(values[i]), typlen);
+		}
+	}
+	else
+	{
+		uint32	   *offsets = (uint32 *) data;
+		Size		offset = MAXALIGN(count * sizeof(uint32));
+
+		for (int64 i = 0; i < count; i++)
+		{
+			char	   *value = DatumGetPointer(values[i]);
+			Size		len;
+
+			if (typlen == -1)
+			{
+				offset = INTALIGN(offset);
+				len = VARSIZE_ANY(value);
+			}
+			else
+				len = strlen(value) + 1;
+
+			offsets[i] = (uint32) offset;
+			memcpy(data + offset, value, len);
+			offset += len;
+		}
+	}
+
+	PG_RETURN_BYTEA_P(sorted);
+}
+
+/*
+ * median_state_rank
+ *
+ * Fraction of the values of a sorted state that are less than or equal to
+ * the given value, NULL for an empty state.
+ */
+Datum
+median_state_rank(PG_FUNCTION_ARGS)
+{
+	Datum		value = PG_GETARG_DATUM(1);
+	Oid			typid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	MedianSorted *sorted = get_sorted(fcinfo);
+	TypeCacheEntry *typentry;
+	int64		lo = 0;
+	int64		hi;
+
+	if (sorted->typid != typid)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("median state holds values of type %s, not %s",
+						format_type_be(sorted->typid),
+						format_type_be(typid))));
+
+	if (sorted->count == 0)
+		PG_RETURN_NULL();
+
+	typentry = get_type_comp_method(typid);
+
+	/* Find the first value greater than the given one */
+	hi = sorted->count;
+	while (lo < hi)
+	{
+		int64		mid = lo + (hi - lo) / 2;
+		int32		cmp;
+
+		cmp = DatumGetInt32(FunctionCall2Coll(&typentry->cmp_proc_finfo,
+											  typentry->typcollation,
+											  sorted_value(sorted, mid),
+											  value));
+		if (cmp <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	PG_RETURN_FLOAT8((float8) lo / sorted->count);
+}
+
+/*
+ * get_sorted
+ *
+ * The sorted layout of the first argument, from the cache of the call site if
+ * it was passed the same datum last time. Indirect and expanded datums point
+ * into memory that may be reused, so they are not cached.
+ */
+static MedianSorted *
+get_sorted(FunctionCallInfo fcinfo)
+{
+	struct varlena *raw = (struct varlena *) DatumGetPointer(PG_GETARG_DATUM(0));
+	MedianRankCache *cache = (MedianRankCache *) fcinfo->flinfo->fn_extra;
+	MedianSorted *sorted;
+
+	if (VARATT_IS_EXTERNAL(raw) && !VARATT_IS_EXTERNAL_ONDISK(raw))
+		return detoast_sorted(raw);
+
+	if (cache != NULL && cache->key != NULL &&
+		VARSIZE_ANY(cache->key) == VARSIZE_ANY(raw) &&
+		memcmp(cache->key, raw, VARSIZE_ANY(raw)) == 0)
+		return cache->sorted;
+
+	if (cache == NULL)
+	{
+		cache = (MedianRankCache *) MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+														   sizeof(MedianRankCache));
+		fcinfo->flinfo->fn_extra = cache;
+	}
+	else if (cache->key != NULL)
+	{
+		pfree(cache->key);
+		pfree(cache->sorted);
+		cache->key = NULL;
+		cache->sorted = NULL;
+	}
+
+	sorted = detoast_sorted(raw);
+	cache->sorted = (MedianSorted *) MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+														VARSIZE(sorted));
+	memcpy(cache->sorted, sorted, VARSIZE(sorted));
+	cache->key = (struct varlena *) MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+													   VARSIZE_ANY(raw));
+	memcpy(cache->key, raw, VARSIZE_ANY(raw));
+
+	return cache->sorted;
+}
+
+/*
+ * detoast_sorted
+ *
+ * Detoasted, aligned and checked copy of a sorted layout, in the current
+ * memory context.
+ */
+static MedianSorted *
+detoast_sorted(struct varlena *raw)
+{
+	struct varlena *bytes = pg_detoast_datum(raw);
+	MedianSorted *sorted = (MedianSorted *) bytes;
+
+	if (VARSIZE(bytes) < MAXALIGN(sizeof(MedianSorted)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("median state is not sorted"),
+				 errhint("Pass the state through median_state_sort() first.")));
+
+	/* Values kept inline in a tuple are only int-aligned */
+	if ((uintptr_t) bytes % MAXIMUM_ALIGNOF != 0)
+	{
+		sorted = (MedianSorted *) palloc(VARSIZE(bytes));
+		memcpy(sorted, bytes, VARSIZE(bytes));
+	}
+
+	if (sorted->magic != MEDIAN_SORTED_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("median state is not sorted"),
+				 errhint("Pass the state through median_state_sort() first.")));
+
+	check_sorted(sorted);
+
+	return sorted;
+}
+
+/*
+ * check_sorted
+ *
+ * Raise an error unless the header of a sorted layout agrees with its type
+ * and its size, and the current user may read values of that type from
+ * bytes the user can forge, see median_state_check_type. The layout may come
+ * from the user, so the values are checked by sorted_value as they are
+ * reached; checking them all would cost as much as sorting them again.
+ */
+static void
+check_sorted(MedianSorted *sorted)
+{
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	Size		available = VARSIZE(sorted) - MAXALIGN(sizeof(MedianSorted));
+	bool		valid;
+
+	get_typlenbyvalalign(sorted->typid, &typlen, &typbyval, &typalign);
+
+	valid = (sorted->typlen == typlen && sorted->typbyval == typbyval &&
+			 sorted->count >= 0);
+	if (valid && typlen > 0)
+		valid = (sorted->stride == att_align_nominal(typlen, typalign) &&
+				 sorted->count <= available / sorted->stride);
+	else if (valid)
+		valid = (sorted->stride == 0 &&
+				 sorted->count <= available / sizeof(uint32) &&
+				 MAXALIGN(sorted->count * sizeof(uint32)) <= available);
+
+	if (!valid)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid sorted median state")));
+
+	median_state_check_type(sorted->typid);
+}
+
+/*
+ * sorted_value
+ *
+ * Value number i of a sorted layout, checked with median_state_check_value.
+ */
+static Datum
+sorted_value(MedianSorted *sorted, int64 i)
+{
+	char	   *data = MEDIAN_SORTED_DATA(sorted);
+	char	   *end = (char *) sorted + VARSIZE(sorted);
+	char	   *value;
+	Size		left;
+	bool		valid;
+
+	if (sorted->stride > 0 && sorted->typbyval)
+		return fetch_att(data + i * sorted->stride, true, sorted->typlen);
+
+	if (sorted->stride > 0)
+	{
+		value = data + i * sorted->stride;
+		median_state_check_value(sorted->typid, PointerGetDatum(value));
+		return PointerGetDatum(value);
+	}
+
+	/* The value must start after the offsets and end within the layout */
+	value = data + ((uint32 *) data)[i];
+	left = end - value;
+	if (value < data + MAXALIGN(sorted->count * sizeof(uint32)) || value >= end)
+		valid = false;
+	else if (sorted->typlen == -1 && VARATT_IS_1B(value))
+		valid = (!VARATT_IS_1B_E(value) && VARSIZE_1B(value) <= left);
+	else if (sorted->typlen == -1)
+		valid = (left >= VARHDRSZ && VARATT_IS_4B_U(value) &&
+				 INTALIGN(value - data) == (value - data) &&
+				 VARSIZE_4B(value) >= VARHDRSZ && VARSIZE_4B(value) <= left);
+	else
+		valid = (memchr(value, '\0', left) != NULL);
+
+	if (!valid)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid sorted median state")));
+
+	median_state_check_value(sorted->typid, PointerGetDatum(value));
+
+	return PointerGetDatum(value);
+}
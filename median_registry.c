@@ -0,0 +1,945 @@
+/*
+ * median_registry.c
+ *
+ * Cached medians of registered columns.
+ *
+ * median_register() records a column in the median_registry table, after
+ * which median_registered() answers with the median stored there instead of
+ * scanning the table. The entries are kept up to date by a background worker
+ * when median.registry_database is set, by median_registry_refresh(), and by
+ * median_registered() itself for callers that do not accept an entry older
+ * than a given staleness.
+ *
+ * Every entry holds the serialized median state of its column together with
+ * the snapshot it was built with, unless the state is larger than
+ * median.registry_max_state_size; such entries only keep their median and are
+ * rebuilt from scratch by every refresh. A refresh scans the table with a newer
+ * snapshot and only adds the values of tuples the stored snapshot did not
+ * see: those whose xmin is at or past its xmax, or was still running when it
+ * was taken. That still reads the heap, but skips deforming, copying and
+ * selecting on everything that was counted before.
+ *
+ * Rows that went away cannot be told apart from rows that never were there,
+ * and vacuum may freeze the xmin of new rows, so an entry is rebuilt from
+ * scratch when the update, delete or vacuum counters of its table in the
+ * statistics collector moved, when the table got a new relfilenode, or when
+ * the stored snapshot is too old to compare xids with. The statistics
+ * collector learns about deletes with a small delay, so they may take one
+ * more refresh to show.
+ *
+ * The registry holds the states, values included, so it is not granted to
+ * anyone. The functions check that the current user may read the column, then
+ * use the registry as its owner.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/tableam.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
+
+#include "median.h"
+
+/*
+ * Stored snapshots older than this many xids are not trusted to compare
+ * against, the entry is rebuilt instead.
+ */
+#define MEDIAN_REGISTRY_MAX_XID_AGE ((uint32) 1 << 30)
+
+/*
+ * MedianRegistrySnapshot
+ *
+ * The part of a stored snapshot needed to tell whether it saw a tuple.
+ */
+typedef struct MedianRegistrySnapshot
+{
+	TransactionId xmin;
+	TransactionId xmax;
+	int			nxip;
+	TransactionId *xip;			/* running xids, including subtransactions */
+} MedianRegistrySnapshot;
+
+/* GUC variables */
+static char *median_registry_database = NULL;
+static int	median_registry_naptime = 60;
+static int	median_registry_max_state_size = 16 * 1024;	/* kB */
+
+/* Flags set by signal handlers */
+static volatile sig_atomic_t got_sighup = false;
+
+static char *median_registry_name(Oid funcid);
+static bool median_registry_refresh_entry(const char *registry, Oid relid,
+										  Name attname);
+static void median_registry_touch(const char *registry, Oid relid,
+								  Name attname);
+static bool median_registry_xid_is_new(TransactionId xid,
+									   MedianRegistrySnapshot *snapshot);
+static int64 median_registry_changes(Oid relid);
+static void median_registry_refresh_all(void);
+static void median_registry_sighup(SIGNAL_ARGS);
+
+PGDLLEXPORT void median_registry_main(Datum main_arg);
+
+PG_FUNCTION_INFO_V1(median_register);
+PG_FUNCTION_INFO_V1(median_unregister);
+PG_FUNCTION_INFO_V1(median_registered);
+PG_FUNCTION_INFO_V1(median_registry_refresh);
+
+
+/*
+ * median_registry_init
+ *
+ * Define the GUCs and, when preloaded with a database configured, register
+ * the background worker. Called from _PG_init.
+ */
+void
+median_registry_init(void)
+{
+	BackgroundWorker worker;
+
+	DefineCustomStringVariable("median.registry_database",
+							   "Database whose registered medians are refreshed by a background worker.",
+							   "Needs \"median\" in shared_preload_libraries. "
+							   "No worker is started if empty.",
+							   &median_registry_database,
+							   NULL,
+							   PGC_POSTMASTER,
+							   0,
+							   NULL, NULL, NULL);
+
+	DefineCustomIntVariable("median.registry_naptime",
+							"Time between refreshes of the registered medians.",
+							NULL,
+							&median_registry_naptime,
+							60,
+							1, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("median.registry_max_state_size",
+							"Largest median state stored with a registered median.",
+							"Entries whose state is larger only keep their median "
+							"and are rebuilt by every refresh.",
+							&median_registry_max_state_size,
+							16 * 1024,
+							0, MaxAllocSize / 1024,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress ||
+		median_registry_database == NULL ||
+		median_registry_database[0] == '\0')
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 60;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "median");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "median_registry_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "median registry worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "median registry worker");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * median_register
+ *
+ * Register a column and build its entry.
+ */
+Datum
+median_register(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	char	   *registry = median_registry_name(fcinfo->flinfo->fn_oid);
+	Oid			argtypes[2] = {REGCLASSOID, NAMEOID};
+	Datum		args[2];
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	median_check_column(relid, attname, false);
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+
+	SPI_connect();
+	median_switch_to_owner(median_catalog_relid(fcinfo->flinfo->fn_oid,
+												"median_registry"),
+						   &save_userid, &save_sec_context);
+
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s (relid, attname) "
+										 "VALUES ($1, $2) ON CONFLICT DO NOTHING",
+										 registry),
+								2, argtypes, args, NULL, false, 0);
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+
+	median_registry_refresh_entry(registry, relid, attname);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * median_unregister
+ *
+ * Forget a registered column.
+ */
+Datum
+median_unregister(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	char	   *registry = median_registry_name(fcinfo->flinfo->fn_oid);
+	Oid			argtypes[2] = {REGCLASSOID, NAMEOID};
+	Datum		args[2];
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	median_check_column(relid, attname, false);
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+
+	SPI_connect();
+	median_switch_to_owner(median_catalog_relid(fcinfo->flinfo->fn_oid,
+												"median_registry"),
+						   &save_userid, &save_sec_context);
+
+	ret = SPI_execute_with_args(psprintf("DELETE FROM %s "
+										 "WHERE relid = $1 AND attname = $2",
+										 registry),
+								2, argtypes, args, NULL, false, 0);
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * median_registered
+ *
+ * Return the cached median of a registered column in text form, after
+ * refreshing it if it is older than max_staleness. Without max_staleness the
+ * cached median is returned as it is.
+ */
+Datum
+median_registered(PG_FUNCTION_ARGS)
+{
+	Oid			relid;
+	Name		attname;
+	char	   *registry;
+	Oid			argtypes[2] = {REGCLASSOID, NAMEOID};
+	Datum		args[2];
+	Datum		result;
+	bool		isnull;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	relid = PG_GETARG_OID(0);
+	attname = PG_GETARG_NAME(1);
+	registry = median_registry_name(fcinfo->flinfo->fn_oid);
+
+	/* The cached median is as good as the column's values */
+	median_check_column(relid, attname, false);
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+
+	SPI_connect();
+	median_switch_to_owner(median_catalog_relid(fcinfo->flinfo->fn_oid,
+												"median_registry"),
+						   &save_userid, &save_sec_context);
+
+	if (!PG_ARGISNULL(2))
+	{
+		Datum		cutoff;
+		Datum		refreshed_at;
+
+		cutoff = DirectFunctionCall2(timestamptz_mi_interval,
+									 TimestampTzGetDatum(GetCurrentTimestamp()),
+									 PG_GETARG_DATUM(2));
+
+		ret = SPI_execute_with_args(psprintf("SELECT refreshed_at FROM %s "
+											 "WHERE relid = $1 AND attname = $2",
+											 registry),
+									2, argtypes, args, NULL, true, 1);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+
+		if (SPI_processed > 0)
+		{
+			refreshed_at = SPI_getbinval(SPI_tuptable->vals[0],
+										 SPI_tuptable->tupdesc, 1, &isnull);
+			if (isnull ||
+				DatumGetTimestampTz(refreshed_at) < DatumGetTimestampTz(cutoff))
+				median_registry_refresh_entry(registry, relid, attname);
+		}
+	}
+
+	ret = SPI_execute_with_args(psprintf("SELECT median FROM %s "
+										 "WHERE relid = $1 AND attname = $2",
+										 registry),
+								2, argtypes, args, NULL, true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+
+	if (SPI_processed == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("column \"%s\" of relation \"%s\" is not registered",
+						NameStr(*attname), get_rel_name(relid)),
+				 errhint("Use median_register() to register it.")));
+
+	result = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+						   &isnull);
+	if (!isnull)
+		result = SPI_datumTransfer(result, false, -1);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+
+	if (isnull)
+		PG_RETURN_NULL();
+
+	PG_RETURN_DATUM(result);
+}
+
+/*
+ * median_registry_refresh
+ *
+ * Refresh the registered columns, all of them or those of one relation or
+ * column, that the current user may read. Returns the number of entries
+ * refreshed.
+ */
+Datum
+median_registry_refresh(PG_FUNCTION_ARGS)
+{
+	char	   *registry = median_registry_name(fcinfo->flinfo->fn_oid);
+	StringInfoData query;
+	Oid			argtypes[2] = {REGCLASSOID, NAMEOID};
+	Datum		args[2];
+	int			nargs = 0;
+	SPITupleTable *entries;
+	uint64		nentries;
+	uint64		i;
+	int32		nrefreshed = 0;
+	Oid			userid = GetUserId();
+	Oid			save_userid;
+	int			save_sec_context;
+	int			ret;
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "SELECT relid, attname FROM %s", registry);
+	if (!PG_ARGISNULL(0))
+	{
+		args[nargs++] = PG_GETARG_DATUM(0);
+		appendStringInfoString(&query, " WHERE relid = $1");
+		if (!PG_ARGISNULL(1))
+		{
+			args[nargs++] = PG_GETARG_DATUM(1);
+			appendStringInfoString(&query, " AND attname = $2");
+		}
+	}
+	appendStringInfoString(&query, " ORDER BY relid, attname");
+
+	SPI_connect();
+	median_switch_to_owner(median_catalog_relid(fcinfo->flinfo->fn_oid,
+												"median_registry"),
+						   &save_userid, &save_sec_context);
+
+	ret = SPI_execute_with_args(query.data, nargs, argtypes, args, NULL,
+								false, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+
+	/* Later queries replace SPI_tuptable, but leave this one alone */
+	entries = SPI_tuptable;
+	nentries = SPI_processed;
+
+	for (i = 0; i < nentries; i++)
+	{
+		bool		isnull;
+		Oid			relid;
+		Name		attname;
+		AttrNumber	attnum;
+
+		relid = DatumGetObjectId(SPI_getbinval(entries->vals[i],
+											   entries->tupdesc, 1, &isnull));
+		attname = DatumGetName(SPI_getbinval(entries->vals[i],
+											 entries->tupdesc, 2, &isnull));
+
+		/* Entries of dropped columns are skipped by the refresh itself */
+		attnum = get_attnum(relid, NameStr(*attname));
+		if (attnum > 0 &&
+			pg_class_aclcheck(relid, userid, ACL_SELECT) != ACLCHECK_OK &&
+			pg_attribute_aclcheck(relid, attnum, userid,
+								  ACL_SELECT) != ACLCHECK_OK)
+			continue;
+
+		if (median_registry_refresh_entry(registry, relid, attname))
+			nrefreshed++;
+	}
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+
+	PG_RETURN_INT32(nrefreshed);
+}
+
+/*
+ * median_registry_name
+ *
+ * Qualified name of the registry table, which lives in the schema of the
+ * extension's functions.
+ */
+static char *
+median_registry_name(Oid funcid)
+{
+	return quote_qualified_identifier(get_namespace_name(get_func_namespace(funcid)),
+									  "median_registry");
+}
+
+/*
+ * median_check_column
+ *
+ * Make sure a column of a table can have its median cached and that the
+ * current user may read all of it, and return its number. Partitioned tables
+ * are only accepted if partitioned_ok.
+ */
+AttrNumber
+median_check_column(Oid relid, Name attname, bool partitioned_ok)
+{
+	Relation	rel;
+	AttrNumber	attnum;
+	Oid			typid;
+	TypeCacheEntry *typentry;
+
+	rel = relation_open(relid, AccessShareLock);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW &&
+		(rel->rd_rel->relkind != RELKIND_PARTITIONED_TABLE || !partitioned_ok))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a table or materialized view",
+						RelationGetRelationName(rel))));
+
+	attnum = get_attnum(relid, NameStr(*attname));
+	if (attnum <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						NameStr(*attname), RelationGetRelationName(rel))));
+
+	if (pg_class_aclcheck(relid, GetUserId(), ACL_SELECT) != ACLCHECK_OK &&
+		pg_attribute_aclcheck(relid, attnum, GetUserId(),
+							  ACL_SELECT) != ACLCHECK_OK)
+		aclcheck_error(ACLCHECK_NO_PRIV,
+					   get_relkind_objtype(rel->rd_rel->relkind),
+					   RelationGetRelationName(rel));
+
+	/* Medians are computed over all rows, including those policies hide */
+	if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("relation \"%s\" has row-level security enabled",
+						RelationGetRelationName(rel)),
+				 errdetail("The median would include rows hidden from the current user.")));
+
+	typid = TupleDescAttr(RelationGetDescr(rel), attnum - 1)->atttypid;
+	typentry = lookup_type_cache(typid, TYPECACHE_CMP_PROC);
+	if (!OidIsValid(typentry->cmp_proc))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("could not identify a comparison function for type %s",
+						format_type_be(typid))));
+
+	relation_close(rel, NoLock);
+
+	return attnum;
+}
+
+/*
+ * median_switch_to_owner
+ *
+ * Act as the owner of a relation, saving the current user and security
+ * context for SetUserIdAndSecContext to restore, the way referential
+ * integrity triggers query the tables they check. Row-level security is not
+ * forced on the owner. An error restores the user on its own.
+ */
+void
+median_switch_to_owner(Oid relid, Oid *save_userid, int *save_sec_context)
+{
+	HeapTuple	tuple;
+	Oid			owner;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for relation %u", relid);
+	owner = ((Form_pg_class) GETSTRUCT(tuple))->relowner;
+	ReleaseSysCache(tuple);
+
+	GetUserIdAndSecContext(save_userid, save_sec_context);
+	SetUserIdAndSecContext(owner, *save_sec_context |
+						   SECURITY_LOCAL_USERID_CHANGE |
+						   SECURITY_NOFORCE_RLS);
+}
+
+/*
+ * median_catalog_relid
+ *
+ * OID of a table of the extension, found in the schema of one of its
+ * functions. The tables are only granted to their owner, and are read and
+ * written as that owner, see median_switch_to_owner.
+ */
+Oid
+median_catalog_relid(Oid funcid, const char *relname)
+{
+	Oid			relid = get_relname_relid(relname, get_func_namespace(funcid));
+
+	if (!OidIsValid(relid))
+		elog(ERROR, "table \"%s\" of the median extension does not exist",
+			 relname);
+
+	return relid;
+}
+
+/*
+ * median_registry_refresh_entry
+ *
+ * Bring the entry of a registered column up to date, incrementally if its
+ * stored state can still be trusted. Returns false if there is no such entry,
+ * or its column is gone. Must be called while connected to SPI.
+ */
+static bool
+median_registry_refresh_entry(const char *registry, Oid relid, Name attname)
+{
+	Oid			argtypes[11] = {REGCLASSOID, NAMEOID, REGTYPEOID, OIDOID,
+		INT8OID, XIDOID, XIDOID, get_array_type(XIDOID), BYTEAOID, TEXTOID,
+	TIMESTAMPTZOID};
+	Datum		args[11];
+	char		nulls[11];
+	HeapTuple	entry;
+	TupleDesc	entrydesc;
+	Relation	rel;
+	AttrNumber	attnum;
+	Form_pg_attribute attr;
+	Snapshot	snapshot;
+	MedianRegistrySnapshot stored;
+	bool		has_snapshot;
+	bool		incremental;
+	int64		changes;
+	Datum		datum;
+	bool		isnull;
+	MemoryContext work_context;
+	MemoryContext old_context;
+	MedianState *state;
+	TableScanDesc scan;
+	HeapTuple	tuple;
+	int			ret;
+	int			i;
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+
+	/* Lock the entry, so concurrent refreshes do not count values twice */
+	ret = SPI_execute_with_args(psprintf("SELECT atttypid, relfilenode, changes, "
+										 "snapshot_xmin, snapshot_xmax, "
+										 "snapshot_xip, state FROM %s "
+										 "WHERE relid = $1 AND attname = $2 "
+										 "FOR UPDATE", registry),
+								2, argtypes, args, NULL, false, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+	if (SPI_processed == 0)
+		return false;
+
+	entry = SPI_tuptable->vals[0];
+	entrydesc = SPI_tuptable->tupdesc;
+
+	rel = try_relation_open(relid, AccessShareLock);
+	if (rel == NULL)
+		return false;
+
+	attnum = get_attnum(relid, NameStr(*attname));
+	if (attnum <= 0 ||
+		(rel->rd_rel->relkind != RELKIND_RELATION &&
+		 rel->rd_rel->relkind != RELKIND_MATVIEW))
+	{
+		relation_close(rel, NoLock);
+		return false;
+	}
+
+	if (rel->rd_rel->relam != HEAP_TABLE_AM_OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("registered medians are only supported for heap tables")));
+
+	attr = TupleDescAttr(RelationGetDescr(rel), attnum - 1);
+
+	/* Taken after locking the entry, so at least as new as the stored one */
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	changes = median_registry_changes(relid);
+
+	datum = SPI_getbinval(entry, entrydesc, 5, &isnull);
+	has_snapshot = !isnull;
+	if (has_snapshot)
+	{
+		Datum	   *elems;
+
+		stored.xmax = DatumGetTransactionId(datum);
+		stored.xmin = DatumGetTransactionId(SPI_getbinval(entry, entrydesc,
+														  4, &isnull));
+		deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(entry, entrydesc,
+														   6, &isnull)),
+						  XIDOID, sizeof(TransactionId), true, 'i',
+						  &elems, NULL, &stored.nxip);
+		stored.xip = palloc(Max(stored.nxip, 1) * sizeof(TransactionId));
+		for (i = 0; i < stored.nxip; i++)
+			stored.xip[i] = DatumGetTransactionId(elems[i]);
+
+		/*
+		 * Nothing committed since the last refresh. The horizon not moving
+		 * is not enough: transactions that were running then may have
+		 * committed without completing the newest xid.
+		 */
+		if (!TransactionIdPrecedes(stored.xmax, snapshot->xmax) &&
+			(uint32) (snapshot->xmax - stored.xmin) < MEDIAN_REGISTRY_MAX_XID_AGE)
+		{
+			bool		committed = false;
+
+			for (i = 0; i < stored.nxip && !committed; i++)
+				committed = TransactionIdDidCommit(stored.xip[i]);
+
+			if (!committed)
+			{
+				UnregisterSnapshot(snapshot);
+				relation_close(rel, NoLock);
+				median_registry_touch(registry, relid, attname);
+				return true;
+			}
+		}
+	}
+
+	incremental = has_snapshot &&
+		DatumGetObjectId(SPI_getbinval(entry, entrydesc, 1, &isnull)) ==
+		attr->atttypid &&
+		DatumGetObjectId(SPI_getbinval(entry, entrydesc, 2, &isnull)) ==
+		rel->rd_node.relNode &&
+		DatumGetInt64(SPI_getbinval(entry, entrydesc, 3, &isnull)) == changes &&
+		(uint32) (snapshot->xmax - stored.xmin) < MEDIAN_REGISTRY_MAX_XID_AGE;
+
+	datum = SPI_getbinval(entry, entrydesc, 7, &isnull);
+	if (isnull)
+		incremental = false;
+
+	work_context = AllocSetContextCreate(CurrentMemoryContext,
+										 "median registry refresh",
+										 ALLOCSET_DEFAULT_SIZES);
+	old_context = MemoryContextSwitchTo(work_context);
+
+	if (incremental)
+		state = median_state_deserialize_trusted(DatumGetByteaP(datum));
+	else
+		state = median_state_create(attr->atttypid);
+
+	scan = table_beginscan(rel, snapshot, 0, NULL);
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Datum		value;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (incremental &&
+			!median_registry_xid_is_new(HeapTupleHeaderGetXmin(tuple->t_data),
+										&stored))
+			continue;
+
+		value = heap_getattr(tuple, attnum, RelationGetDescr(rel), &isnull);
+		if (isnull)
+			continue;
+
+		/* The state outlives the buffer, and is serialized */
+		if (attr->attlen == -1)
+			value = PointerGetDatum(PG_DETOAST_DATUM_PACKED(value));
+
+		median_state_add(state, value);
+	}
+	table_endscan(scan);
+
+	/*
+	 * Remember what this snapshot saw. Running subtransactions are only
+	 * known if it did not overflow, otherwise rebuild the next time.
+	 */
+	memset(nulls, ' ', sizeof(nulls));
+	args[2] = ObjectIdGetDatum(attr->atttypid);
+	args[3] = ObjectIdGetDatum(rel->rd_node.relNode);
+	args[4] = Int64GetDatum(changes);
+	args[5] = TransactionIdGetDatum(snapshot->xmin);
+	args[6] = TransactionIdGetDatum(snapshot->xmax);
+	if (snapshot->suboverflowed)
+	{
+		args[7] = (Datum) 0;
+		nulls[5] = nulls[6] = nulls[7] = 'n';
+	}
+	else
+	{
+		int			nxip = snapshot->xcnt + snapshot->subxcnt;
+		Datum	   *xip = palloc(Max(nxip, 1) * sizeof(Datum));
+
+		for (i = 0; i < snapshot->xcnt; i++)
+			xip[i] = TransactionIdGetDatum(snapshot->xip[i]);
+		for (i = 0; i < snapshot->subxcnt; i++)
+			xip[snapshot->xcnt + i] = TransactionIdGetDatum(snapshot->subxip[i]);
+		args[7] = PointerGetDatum(construct_array(xip, nxip, XIDOID,
+												  sizeof(TransactionId), true,
+												  'i'));
+	}
+
+	/*
+	 * Serialize before selecting, which reorders the values. A state past
+	 * the limit is not stored: it would be rewritten in full by every
+	 * refresh, and could not be serialized at all past MaxAllocSize.
+	 */
+	if (median_state_serialized_size(state) <=
+		(Size) median_registry_max_state_size * 1024)
+		args[8] = PointerGetDatum(median_state_serialize(state));
+	else
+	{
+		args[8] = (Datum) 0;
+		nulls[8] = 'n';
+	}
+	if (median_state_count(state) > 0)
+	{
+		Oid			typoutput;
+		bool		typisvarlena;
+
+		getTypeOutputInfo(attr->atttypid, &typoutput, &typisvarlena);
+		args[9] = CStringGetTextDatum(OidOutputFunctionCall(typoutput,
+															median_state_median(state)));
+	}
+	else
+		nulls[9] = 'n';
+	args[10] = TimestampTzGetDatum(GetCurrentTimestamp());
+
+	MemoryContextSwitchTo(old_context);
+
+	ret = SPI_execute_with_args(psprintf("UPDATE %s SET atttypid = $3, "
+										 "relfilenode = $4, changes = $5, "
+										 "snapshot_xmin = $6, snapshot_xmax = $7, "
+										 "snapshot_xip = $8, state = $9, "
+										 "median = $10, refreshed_at = $11 "
+										 "WHERE relid = $1 AND attname = $2",
+										 registry),
+								11, argtypes, args, nulls, false, 0);
+	if (ret != SPI_OK_UPDATE)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+
+	MemoryContextDelete(work_context);
+	UnregisterSnapshot(snapshot);
+	relation_close(rel, NoLock);
+
+	return true;
+}
+
+/*
+ * median_registry_touch
+ *
+ * Mark an entry that had nothing to catch up with as refreshed.
+ */
+static void
+median_registry_touch(const char *registry, Oid relid, Name attname)
+{
+	Oid			argtypes[3] = {REGCLASSOID, NAMEOID, TIMESTAMPTZOID};
+	Datum		args[3];
+	int			ret;
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = NameGetDatum(attname);
+	args[2] = TimestampTzGetDatum(GetCurrentTimestamp());
+
+	ret = SPI_execute_with_args(psprintf("UPDATE %s SET refreshed_at = $3 "
+										 "WHERE relid = $1 AND attname = $2",
+										 registry),
+								3, argtypes, args, NULL, false, 0);
+	if (ret != SPI_OK_UPDATE)
+		elog(ERROR, "SPI_execute_with_args failed: error code %d", ret);
+}
+
+/*
+ * median_registry_xid_is_new
+ *
+ * Did a tuple inserted by xid, visible now, stay invisible to the stored
+ * snapshot? Frozen and bootstrap xids are older than any snapshot.
+ */
+static bool
+median_registry_xid_is_new(TransactionId xid, MedianRegistrySnapshot *snapshot)
+{
+	int			i;
+
+	if (!TransactionIdIsNormal(xid))
+		return false;
+	if (TransactionIdFollowsOrEquals(xid, snapshot->xmax))
+		return true;
+	if (TransactionIdPrecedes(xid, snapshot->xmin))
+		return false;
+
+	for (i = 0; i < snapshot->nxip; i++)
+	{
+		if (TransactionIdEquals(xid, snapshot->xip[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * median_registry_changes
+ *
+ * Sum of the statistics collector's counters of a table that tell us rows
+ * may have disappeared or been frozen since the last refresh.
+ */
+static int64
+median_registry_changes(Oid relid)
+{
+	PgStat_StatTabEntry *tabentry = pgstat_fetch_stat_tabentry(relid);
+
+	if (tabentry == NULL)
+		return 0;
+
+	return tabentry->tuples_updated + tabentry->tuples_deleted +
+		tabentry->vacuum_count + tabentry->autovac_vacuum_count;
+}
+
+/*
+ * median_registry_sighup
+ *
+ * Reload the configuration at the next opportunity.
+ */
+static void
+median_registry_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * median_registry_main
+ *
+ * Entry point of the registry worker. Refreshes all registered columns of
+ * median.registry_database every median.registry_naptime.
+ */
+void
+median_registry_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, median_registry_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(median_registry_database, NULL, 0);
+
+	for (;;)
+	{
+		median_registry_refresh_all();
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 median_registry_naptime * 1000L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+}
+
+/*
+ * median_registry_refresh_all
+ *
+ * Refresh every registered column in one transaction, if the extension is
+ * installed in the worker's database.
+ */
+static void
+median_registry_refresh_all(void)
+{
+	int			ret;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "refreshing registered medians");
+
+	ret = SPI_execute("SELECT quote_ident(n.nspname) "
+					  "FROM pg_catalog.pg_extension e "
+					  "JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace "
+					  "WHERE e.extname = 'median'", true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	if (SPI_processed > 0)
+	{
+		char	   *nspname = SPI_getvalue(SPI_tuptable->vals[0],
+										   SPI_tuptable->tupdesc, 1);
+
+		ret = SPI_execute(psprintf("SELECT %s.median_registry_refresh()",
+								   nspname), false, 0);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "SPI_execute failed: error code %d", ret);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
@@ -0,0 +1,310 @@
+/*
+ * median_sample.c
+ *
+ * Approximate medians from a sample of the blocks of a table.
+ *
+ * sampled_median() reads percent of the heap blocks of a table and selects on
+ * the values of the visible rows in them, so a first answer on a very large
+ * table costs a fraction of a full scan. The blocks are chosen stratified:
+ * the table is cut into as many equal runs of blocks as are to be read and
+ * one block is picked at random from each run, which spreads the sample over
+ * the whole table like TABLESAMPLE SYSTEM does, but without leaving large
+ * parts of it unsampled by chance.
+ *
+ * Rows of a block are not independent, so the error bounds treat blocks as
+ * the sampled units. For the sample median m and block b holding n_b sampled
+ * rows of which c_b are <= m, the fraction of rows <= m is estimated as the
+ * ratio sum(c_b) / sum(n_b), whose variance over k blocks out of N is about
+ *
+ *   (1 - k / N) / (k * mean(n_b)^2) * sum((c_b - n_b / 2)^2) / (k - 1)
+ *
+ * The bounds are the sample quantiles at 0.5 -/+ 1.96 standard errors of
+ * that fraction (Woodruff's interval), for a confidence of about 95%. The
+ * variance is that of blocks drawn at random; the stratified draw is at
+ * least as good when the column follows the physical order, so the bounds
+ * err on the wide side.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <math.h>
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "catalog/pg_am.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/sampling.h"
+#include "utils/snapmgr.h"
+
+#include "median.h"
+
+/* Normal quantile of the two-sided 95% bounds */
+#define MEDIAN_SAMPLE_Z			1.959964
+
+/* How many of the chosen blocks are prefetched ahead of the one read */
+#define MEDIAN_SAMPLE_PREFETCH	16
+
+static int64 sampled_median_block(Relation rel, BlockNumber blkno,
+								  AttrNumber attnum, Snapshot snapshot,
+								  BufferAccessStrategy strategy,
+								  MemoryContext block_context,
+								  MedianState *state);
+static char *sampled_median_output(Oid typid, Datum value);
+
+PG_FUNCTION_INFO_V1(sampled_median);
+
+
+/*
+ * sampled_median
+ *
+ * Median of a column estimated from percent of the table's blocks, with
+ * bounds of its 95% confidence interval and the size of the sample.
+ */
+Datum
+sampled_median(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	float8		percent = PG_GETARG_FLOAT8(2);
+	AttrNumber	attnum;
+	Relation	rel;
+	Oid			typid;
+	TupleDesc	tupdesc;
+	BlockNumber nblocks;
+	int64		nsample;
+	BlockNumber *blocks;
+	int64	   *block_rows;
+	SamplerRandomState rstate;
+	BufferAccessStrategy strategy;
+	MemoryContext block_context;
+	MedianState *state;
+	Datum		result[6];
+	bool		nulls[6] = {false, false, false, false, false, false};
+	int64		count;
+
+	if (isnan(percent) || percent <= 0 || percent > 100)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TABLESAMPLE_ARGUMENT),
+				 errmsg("sample percentage must be between 0 and 100")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	attnum = median_check_column(relid, attname, false);
+
+	rel = relation_open(relid, AccessShareLock);
+	if (rel->rd_rel->relam != HEAP_TABLE_AM_OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot sample \"%s\", only heap tables are supported",
+						RelationGetRelationName(rel))));
+
+	typid = TupleDescAttr(RelationGetDescr(rel), attnum - 1)->atttypid;
+	nblocks = RelationGetNumberOfBlocks(rel);
+	nsample = nblocks == 0 ? 0 :
+		Min(Max((int64) ceil(nblocks * percent / 100.0), 1), nblocks);
+
+	/* One block out of each of nsample equal runs, in ascending order */
+	blocks = (BlockNumber *) palloc(Max(nsample, 1) * sizeof(BlockNumber));
+	block_rows = (int64 *) palloc(Max(nsample, 1) * sizeof(int64));
+	sampler_random_init_state(random(), rstate);
+	for (int64 i = 0; i < nsample; i++)
+	{
+		BlockNumber start = (BlockNumber) (i * nblocks / nsample);
+		BlockNumber end = (BlockNumber) ((i + 1) * nblocks / nsample);
+
+		blocks[i] = start + (BlockNumber) (sampler_random_fract(rstate) *
+										   (end - start));
+		blocks[i] = Min(blocks[i], end - 1);
+	}
+
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+	block_context = AllocSetContextCreate(CurrentMemoryContext,
+										  "sampled_median block",
+										  ALLOCSET_DEFAULT_SIZES);
+	state = median_state_create(typid);
+
+	for (int64 i = 0; i < nsample; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+#ifdef USE_PREFETCH
+		if (i == 0)
+		{
+			for (int64 j = 0; j < Min(nsample, MEDIAN_SAMPLE_PREFETCH); j++)
+				PrefetchBuffer(rel, MAIN_FORKNUM, blocks[j]);
+		}
+		else if (i + MEDIAN_SAMPLE_PREFETCH - 1 < nsample)
+			PrefetchBuffer(rel, MAIN_FORKNUM,
+						   blocks[i + MEDIAN_SAMPLE_PREFETCH - 1]);
+#endif
+
+		block_rows[i] = sampled_median_block(rel, blocks[i], attnum,
+											 GetActiveSnapshot(), strategy,
+											 block_context, state);
+	}
+
+	FreeAccessStrategy(strategy);
+	MemoryContextDelete(block_context);
+	relation_close(rel, AccessShareLock);
+
+	count = median_state_count(state);
+	if (count == 0)
+		nulls[0] = nulls[1] = nulls[2] = true;
+	else
+	{
+		TypeCacheEntry *typentry = get_type_comp_method(typid);
+		Datum	   *values;
+		Datum		median;
+		Datum		found[2];
+		int64		ranks[2];
+		float8		mean_rows = (float8) count / nsample;
+		float8		sum_sq = 0;
+		float8		se = 0;
+		int64		next = 0;
+
+		/* The values in the order read, before selecting reorders them */
+		values = (Datum *) palloc(count * sizeof(Datum));
+		memcpy(values, median_state_values(state), count * sizeof(Datum));
+
+		median = median_state_median(state);
+
+		/* Spread of the fraction of rows <= median between blocks */
+		for (int64 i = 0; i < nsample; i++)
+		{
+			int64		below = 0;
+
+			for (int64 j = next; j < next + block_rows[i]; j++)
+			{
+				int32		cmp;
+
+				cmp = DatumGetInt32(FunctionCall2Coll(&typentry->cmp_proc_finfo,
+													  typentry->typcollation,
+													  values[j], median));
+				if (cmp <= 0)
+					below++;
+			}
+			next += block_rows[i];
+
+			sum_sq += (below - block_rows[i] / 2.0) * (below - block_rows[i] / 2.0);
+		}
+
+		if (nsample > 1)
+			se = sqrt((1.0 - (float8) nsample / nblocks) / nsample * sum_sq /
+					  (nsample - 1)) / mean_rows;
+
+		ranks[0] = (int64) floor((count - 1) * Max(0.5 - MEDIAN_SAMPLE_Z * se, 0));
+		ranks[1] = (int64) ceil((count - 1) * Min(0.5 + MEDIAN_SAMPLE_Z * se, 1));
+		median_state_select_ranks(state, ranks, 2, found);
+
+		result[0] = CStringGetTextDatum(sampled_median_output(typid, median));
+		result[1] = CStringGetTextDatum(sampled_median_output(typid, found[0]));
+		result[2] = CStringGetTextDatum(sampled_median_output(typid, found[1]));
+	}
+
+	result[3] = Int64GetDatum(nsample);
+	result[4] = Int64GetDatum(nblocks);
+	result[5] = Int64GetDatum(count);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, result, nulls)));
+}
+
+/*
+ * sampled_median_block
+ *
+ * Add the non-null values of the column in the rows of a block visible to the
+ * snapshot to the state, and return how many there were.
+ *
+ * The values are copied while the buffer is locked, but only detoasted and
+ * added once it is released, as that may read the TOAST table.
+ */
+static int64
+sampled_median_block(Relation rel, BlockNumber blkno, AttrNumber attnum,
+					 Snapshot snapshot, BufferAccessStrategy strategy,
+					 MemoryContext block_context, MedianState *state)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
+	MemoryContext old_context;
+	Buffer		buffer;
+	Page		page;
+	OffsetNumber maxoff;
+	Datum	   *values;
+	int			nvalues = 0;
+
+	buffer = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+
+	page = BufferGetPage(buffer);
+	maxoff = PageGetMaxOffsetNumber(page);
+
+	old_context = MemoryContextSwitchTo(block_context);
+	values = (Datum *) palloc(Max(maxoff, 1) * sizeof(Datum));
+
+	for (OffsetNumber off = FirstOffsetNumber; off <= maxoff; off++)
+	{
+		ItemId		itemid = PageGetItemId(page, off);
+		HeapTupleData tuple;
+		Datum		value;
+		bool		isnull;
+
+		if (!ItemIdIsNormal(itemid))
+			continue;
+
+		tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemid);
+		tuple.t_len = ItemIdGetLength(itemid);
+		tuple.t_tableOid = RelationGetRelid(rel);
+		ItemPointerSet(&tuple.t_self, blkno, off);
+
+		if (!HeapTupleSatisfiesVisibility(&tuple, snapshot, buffer))
+			continue;
+
+		value = heap_getattr(&tuple, attnum, tupdesc, &isnull);
+		if (isnull)
+			continue;
+
+		values[nvalues++] = datumCopy(value, attr->attbyval, attr->attlen);
+	}
+
+	UnlockReleaseBuffer(buffer);
+
+	if (attr->attlen == -1)
+	{
+		for (int i = 0; i < nvalues; i++)
+			values[i] = PointerGetDatum(PG_DETOAST_DATUM_PACKED(values[i]));
+	}
+
+	MemoryContextSwitchTo(old_context);
+
+	for (int i = 0; i < nvalues; i++)
+		median_state_add(state, values[i]);
+
+	MemoryContextReset(block_context);
+
+	return nvalues;
+}
+
+/*
+ * sampled_median_output
+ *
+ * Text form of a value of the sampled column.
+ */
+static char *
+sampled_median_output(Oid typid, Datum value)
+{
+	Oid			typoutput;
+	bool		typisvarlena;
+
+	getTypeOutputInfo(typid, &typoutput, &typisvarlena);
+
+	return OidOutputFunctionCall(typoutput, value);
+}
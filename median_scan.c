@@ -0,0 +1,739 @@
+/*
+ * median_scan.c
+ *
+ * MedianScan, a custom scan that computes plain medians of a table column.
+ *
+ * For SELECT median(col) FROM tab [WHERE ...] the executor normally runs a
+ * Seq Scan, which forms a slot for every row, under an Agg node, which calls
+ * median_transfn through fmgr for each of them. The planner hook below offers
+ * a MedianScan path for the grouping step of such queries instead. It reads
+ * the heap itself in page-at-a-time mode, so the visibility of all tuples of
+ * a page is checked under one buffer lock, fetches only the aggregated
+ * attribute of each visible tuple and appends it straight to a median state,
+ * whose median is then selected as median_finalfn would. Rows are only formed
+ * into slots when there is a WHERE clause to evaluate on them.
+ *
+ * In parallel plans MedianScan is also offered as a parallel-aware partial
+ * path: every process scans its share of the blocks and returns its state
+ * serialized, and a Finalize Aggregate above the Gather combines them like
+ * the partial states of median.
+ *
+ * Only columns of the by-value types radix selection works on are handled,
+ * as their values need neither detoasting nor copying. The path is added at
+ * the grouping stage, not from set_rel_pathlist_hook, since only there can a
+ * path stand for the aggregate as well as the scan.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "commands/extension.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/extensible.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
+#include "optimizer/planmain.h"
+#include "optimizer/planner.h"
+#include "optimizer/restrictinfo.h"
+#include "parser/parse_func.h"
+#include "rewrite/rewriteManip.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/ruleutils.h"
+#include "utils/spccache.h"
+
+#include "median.h"
+
+/*
+ * MedianScanState
+ *
+ * Executor state of a MedianScan. The plan's custom_private holds the
+ * relation, the attribute, whether the scan is partial and the quals, in
+ * that order.
+ */
+typedef struct MedianScanState
+{
+	CustomScanState css;
+	Oid			relid;			/* scanned table */
+	AttrNumber	attnum;			/* aggregated attribute */
+	bool		partial;		/* return the serialized state */
+	List	   *quals;			/* implicitly ANDed quals, varno 1 */
+	Relation	rel;
+	ExprState  *qual;			/* quals prepared for execution */
+	TupleTableSlot *heap_slot;	/* rows the quals are evaluated on */
+	MedianState *state;
+	ParallelTableScanDesc pscan;	/* shared state of a parallel scan */
+	bool		done;			/* has the result row been returned? */
+} MedianScanState;
+
+/* GUC variables */
+static bool median_enable_medianscan = true;
+
+static create_upper_paths_hook_type prev_create_upper_paths_hook = NULL;
+
+static void median_create_upper_paths(PlannerInfo *root,
+									  UpperRelationKind stage,
+									  RelOptInfo *input_rel,
+									  RelOptInfo *output_rel, void *extra);
+static void median_scan_add_path(PlannerInfo *root, RelOptInfo *input_rel,
+								 RelOptInfo *output_rel, bool partial);
+static bool median_scan_unsafe_walker(Node *node, Index *relid);
+static Oid	median_scan_agg_oid(void);
+static void median_scan_cost(PlannerInfo *root, RelOptInfo *rel, List *quals,
+							 int nworkers, Path *path);
+static double median_scan_parallel_divisor(int nworkers);
+static Plan *median_scan_plan(PlannerInfo *root, RelOptInfo *rel,
+							  CustomPath *best_path, List *tlist,
+							  List *clauses, List *custom_plans);
+static Node *median_scan_create_state(CustomScan *cscan);
+static void median_scan_begin(CustomScanState *node, EState *estate,
+							  int eflags);
+static TupleTableSlot *median_scan_exec(CustomScanState *node);
+static TupleTableSlot *median_scan_next(ScanState *node);
+static bool median_scan_recheck(ScanState *node, TupleTableSlot *slot);
+static void median_scan_collect(MedianScanState *mss);
+static void median_scan_end(CustomScanState *node);
+static void median_scan_rescan(CustomScanState *node);
+static Size median_scan_estimate_dsm(CustomScanState *node,
+									 ParallelContext *pcxt);
+static void median_scan_initialize_dsm(CustomScanState *node,
+									   ParallelContext *pcxt,
+									   void *coordinate);
+static void median_scan_reinitialize_dsm(CustomScanState *node,
+										 ParallelContext *pcxt,
+										 void *coordinate);
+static void median_scan_initialize_worker(CustomScanState *node,
+										  shm_toc *toc, void *coordinate);
+static void median_scan_explain(CustomScanState *node, List *ancestors,
+								ExplainState *es);
+
+static const CustomPathMethods median_scan_path_methods = {
+	.CustomName = "MedianScan",
+	.PlanCustomPath = median_scan_plan,
+};
+
+static const CustomScanMethods median_scan_scan_methods = {
+	.CustomName = "MedianScan",
+	.CreateCustomScanState = median_scan_create_state,
+};
+
+static const CustomExecMethods median_scan_exec_methods = {
+	.CustomName = "MedianScan",
+	.BeginCustomScan = median_scan_begin,
+	.ExecCustomScan = median_scan_exec,
+	.EndCustomScan = median_scan_end,
+	.ReScanCustomScan = median_scan_rescan,
+	.EstimateDSMCustomScan = median_scan_estimate_dsm,
+	.InitializeDSMCustomScan = median_scan_initialize_dsm,
+	.ReInitializeDSMCustomScan = median_scan_reinitialize_dsm,
+	.InitializeWorkerCustomScan = median_scan_initialize_worker,
+	.ExplainCustomScan = median_scan_explain,
+};
+
+
+/*
+ * median_scan_init
+ *
+ * Define the GUC, register the scan and install the planner hook. Called
+ * from _PG_init.
+ */
+void
+median_scan_init(void)
+{
+	DefineCustomBoolVariable("median.enable_medianscan",
+							 "Enables the planner's use of MedianScan plans.",
+							 "MedianScan computes median(col) over a single "
+							 "table of by-value columns while scanning it, "
+							 "without an Agg node.",
+							 &median_enable_medianscan,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	RegisterCustomScanMethods(&median_scan_scan_methods);
+
+	prev_create_upper_paths_hook = create_upper_paths_hook;
+	create_upper_paths_hook = median_create_upper_paths;
+}
+
+/*
+ * median_create_upper_paths
+ *
+ * Offer MedianScan paths for the grouping of a plain median query, as a
+ * complete path and as a partial one for parallel plans.
+ */
+static void
+median_create_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+						  RelOptInfo *input_rel, RelOptInfo *output_rel,
+						  void *extra)
+{
+	if (prev_create_upper_paths_hook)
+		prev_create_upper_paths_hook(root, stage, input_rel, output_rel,
+									 extra);
+
+	if (!median_enable_medianscan)
+		return;
+
+	if (stage == UPPERREL_GROUP_AGG)
+		median_scan_add_path(root, input_rel, output_rel, false);
+	else if (stage == UPPERREL_PARTIAL_GROUP_AGG)
+		median_scan_add_path(root, input_rel, output_rel, true);
+}
+
+/*
+ * median_scan_add_path
+ *
+ * Add a MedianScan path to output_rel if the query computes nothing but
+ * median of a by-value column of the heap table input_rel, with no grouping.
+ */
+static void
+median_scan_add_path(PlannerInfo *root, RelOptInfo *input_rel,
+					 RelOptInfo *output_rel, bool partial)
+{
+	Query	   *parse = root->parse;
+	RangeTblEntry *rte;
+	Relation	rel;
+	Oid			relam;
+	bool		populated;
+	Aggref	   *aggref;
+	Var		   *var;
+	List	   *quals;
+	ListCell   *lc;
+	CustomPath *cpath;
+	int			nworkers = 0;
+
+	if (parse->commandType != CMD_SELECT || parse->groupClause != NIL ||
+		parse->groupingSets != NIL || root->hasHavingQual ||
+		parse->hasTargetSRFs)
+		return;
+
+	if (input_rel->reloptkind != RELOPT_BASEREL ||
+		input_rel->rtekind != RTE_RELATION || IS_DUMMY_REL(input_rel))
+		return;
+
+	rte = planner_rt_fetch(input_rel->relid, root);
+	if (rte->inh || rte->tablesample != NULL ||
+		(rte->relkind != RELKIND_RELATION && rte->relkind != RELKIND_MATVIEW))
+		return;
+
+	/* The grouping target must be a single median(col) */
+	if (list_length(output_rel->reltarget->exprs) != 1 ||
+		!IsA(linitial(output_rel->reltarget->exprs), Aggref))
+		return;
+
+	aggref = (Aggref *) linitial(output_rel->reltarget->exprs);
+	if (aggref->aggsplit != (partial ? AGGSPLIT_INITIAL_SERIAL : AGGSPLIT_SIMPLE) ||
+		aggref->aggorder != NIL || aggref->aggdistinct != NIL ||
+		aggref->aggfilter != NULL || aggref->agglevelsup != 0 ||
+		list_length(aggref->args) != 1)
+		return;
+
+	var = (Var *) ((TargetEntry *) linitial(aggref->args))->expr;
+	if (!IsA(var, Var) || var->varno != input_rel->relid ||
+		var->varlevelsup != 0 || var->varattno <= 0 ||
+		median_key_kind(var->vartype) == MEDIAN_KEY_NONE)
+		return;
+
+	if (aggref->aggfnoid != median_scan_agg_oid())
+		return;
+
+	/*
+	 * Quals only on the table itself, evaluated once per row. Pseudoconstant
+	 * quals would need a gating Result node above the scan.
+	 */
+	foreach(lc, input_rel->baserestrictinfo)
+	{
+		if (lfirst_node(RestrictInfo, lc)->pseudoconstant)
+			return;
+	}
+	quals = extract_actual_clauses(input_rel->baserestrictinfo, false);
+	if (median_scan_unsafe_walker((Node *) quals, &input_rel->relid))
+		return;
+
+	if (partial)
+	{
+		if (!input_rel->consider_parallel || !output_rel->consider_parallel)
+			return;
+
+		nworkers = compute_parallel_worker(input_rel, input_rel->pages, -1,
+										   max_parallel_workers_per_gather);
+		if (nworkers <= 0)
+			return;
+	}
+
+	/*
+	 * The planner already holds a lock on the table. An unpopulated
+	 * materialized view is left to the core scan, which reports it.
+	 */
+	rel = table_open(rte->relid, NoLock);
+	relam = rel->rd_rel->relam;
+	populated = RelationIsPopulated(rel);
+	table_close(rel, NoLock);
+	if (relam != HEAP_TABLE_AM_OID || !populated)
+		return;
+
+	cpath = makeNode(CustomPath);
+	cpath->path.pathtype = T_CustomScan;
+	cpath->path.parent = output_rel;
+	cpath->path.pathtarget = output_rel->reltarget;
+	cpath->path.param_info = NULL;
+	cpath->path.parallel_aware = partial;
+	cpath->path.parallel_safe = output_rel->consider_parallel;
+	cpath->path.parallel_workers = nworkers;
+	cpath->path.rows = 1;
+	cpath->path.pathkeys = NIL;
+	cpath->flags = 0;
+	cpath->custom_paths = NIL;
+	cpath->methods = &median_scan_path_methods;
+
+	median_scan_cost(root, input_rel, quals, nworkers, &cpath->path);
+
+	/*
+	 * The quals do not pass through setrefs.c in custom_private, so their
+	 * function OIDs are filled in here. Executing them does not look at the
+	 * varno of their Vars, which is set to 1 for EXPLAIN to deparse them.
+	 */
+	quals = copyObject(quals);
+	ChangeVarNodes((Node *) quals, input_rel->relid, 1, 0);
+	fix_opfuncids((Node *) quals);
+
+	cpath->custom_private = list_make4(makeInteger(rte->relid),
+									   makeInteger(var->varattno),
+									   makeInteger(partial),
+									   quals);
+
+	if (partial)
+		add_partial_path(output_rel, &cpath->path);
+	else
+		add_path(output_rel, &cpath->path);
+}
+
+/*
+ * median_scan_unsafe_walker
+ *
+ * Does a qual reference anything but the columns of the table and external
+ * parameters?
+ */
+static bool
+median_scan_unsafe_walker(Node *node, Index *relid)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Var))
+		return ((Var *) node)->varno != *relid ||
+			((Var *) node)->varlevelsup != 0;
+	if (IsA(node, Param))
+		return ((Param *) node)->paramkind != PARAM_EXTERN;
+	if (IsA(node, SubLink) || IsA(node, SubPlan) ||
+		IsA(node, AlternativeSubPlan) || IsA(node, PlaceHolderVar))
+		return true;
+
+	return expression_tree_walker(node, median_scan_unsafe_walker,
+								  (void *) relid);
+}
+
+/*
+ * median_scan_agg_oid
+ *
+ * OID of median(anyelement) in the schema of the extension, or InvalidOid
+ * if the extension is not installed in this database.
+ */
+static Oid
+median_scan_agg_oid(void)
+{
+	Oid			extoid = get_extension_oid("median", true);
+	Oid			argtypes[1] = {ANYELEMENTOID};
+	char	   *schema;
+
+	if (!OidIsValid(extoid))
+		return InvalidOid;
+
+	schema = get_namespace_name(get_extension_schema(extoid));
+	if (schema == NULL)
+		return InvalidOid;
+
+	return LookupFuncName(list_make2(makeString(schema), makeString("median")),
+						  1, argtypes, true);
+}
+
+/*
+ * median_scan_cost
+ *
+ * Estimate the cost of a MedianScan of rel, divided over nworkers parallel
+ * workers if there are any.
+ *
+ * The pages are read as by a Seq Scan. Per row a Seq Scan under an Agg
+ * charges cpu_tuple_cost for the row, the quals, and a cpu_operator_cost for
+ * the transition function. Without quals MedianScan forms no row, so only a
+ * cpu_operator_cost is charged for fetching the attribute. With quals the
+ * row is formed to evaluate them, but the values are added to the state
+ * without a function call. The result is ready only once all rows are read.
+ */
+static void
+median_scan_cost(PlannerInfo *root, RelOptInfo *rel, List *quals,
+				 int nworkers, Path *path)
+{
+	QualCost	qual_cost;
+	double		spc_seq_page_cost;
+	Cost		cpu_per_tuple;
+	Cost		cpu_run_cost;
+	Cost		disk_run_cost;
+
+	get_tablespace_page_costs(rel->reltablespace, NULL, &spc_seq_page_cost);
+	cost_qual_eval(&qual_cost, quals, root);
+
+	disk_run_cost = spc_seq_page_cost * rel->pages;
+
+	if (quals != NIL)
+		cpu_per_tuple = cpu_tuple_cost + qual_cost.per_tuple;
+	else
+		cpu_per_tuple = cpu_operator_cost;
+	cpu_run_cost = cpu_per_tuple * rel->tuples;
+
+	if (nworkers > 0)
+		cpu_run_cost /= median_scan_parallel_divisor(nworkers);
+
+	path->startup_cost = qual_cost.startup + disk_run_cost + cpu_run_cost;
+	path->total_cost = path->startup_cost;
+}
+
+/*
+ * median_scan_parallel_divisor
+ *
+ * Share of the rows one process of a parallel scan handles, as assumed by
+ * the core costing of parallel scans.
+ */
+static double
+median_scan_parallel_divisor(int nworkers)
+{
+	double		divisor = nworkers;
+
+	if (parallel_leader_participation)
+	{
+		double		leader_contribution = 1.0 - (0.3 * nworkers);
+
+		if (leader_contribution > 0)
+			divisor += leader_contribution;
+	}
+
+	return divisor;
+}
+
+/*
+ * median_scan_plan
+ *
+ * Turn a MedianScan path into a CustomScan plan. It scans no range table
+ * entry of its own: its output is the aggregate, which custom_scan_tlist
+ * makes setrefs.c point the target list at.
+ */
+static Plan *
+median_scan_plan(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+				 List *tlist, List *clauses, List *custom_plans)
+{
+	CustomScan *cscan = makeNode(CustomScan);
+
+	cscan->scan.plan.targetlist = tlist;
+	cscan->scan.plan.qual = NIL;
+	cscan->scan.scanrelid = 0;
+	cscan->flags = best_path->flags;
+	cscan->custom_plans = NIL;
+	cscan->custom_exprs = NIL;
+	cscan->custom_private = best_path->custom_private;
+	cscan->custom_scan_tlist = copyObject(tlist);
+	cscan->methods = &median_scan_scan_methods;
+
+	return &cscan->scan.plan;
+}
+
+/*
+ * median_scan_create_state
+ *
+ * Create the executor state of a MedianScan plan.
+ */
+static Node *
+median_scan_create_state(CustomScan *cscan)
+{
+	MedianScanState *mss;
+
+	mss = (MedianScanState *) newNode(sizeof(MedianScanState),
+									  T_CustomScanState);
+	mss->css.methods = &median_scan_exec_methods;
+	mss->relid = (Oid) intVal(linitial(cscan->custom_private));
+	mss->attnum = (AttrNumber) intVal(lsecond(cscan->custom_private));
+	mss->partial = intVal(lthird(cscan->custom_private)) != 0;
+	mss->quals = (List *) lfourth(cscan->custom_private);
+
+	return (Node *) mss;
+}
+
+/*
+ * median_scan_begin
+ *
+ * Open the table and prepare the quals and the state. The scan itself is
+ * only started on the first call, when a parallel scan has its shared state.
+ */
+static void
+median_scan_begin(CustomScanState *node, EState *estate, int eflags)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+	TupleDesc	tupdesc;
+
+	mss->rel = table_open(mss->relid, AccessShareLock);
+	tupdesc = RelationGetDescr(mss->rel);
+
+	/* As ExecOpenScanRelation, in case the plan outlived a refresh */
+	if ((eflags & EXEC_FLAG_WITH_NO_DATA) == 0 &&
+		!RelationIsScannable(mss->rel))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("materialized view \"%s\" has not been populated",
+						RelationGetRelationName(mss->rel)),
+				 errhint("Use the REFRESH MATERIALIZED VIEW command.")));
+
+	mss->qual = ExecInitQual(mss->quals, (PlanState *) node);
+	if (mss->quals != NIL)
+		mss->heap_slot = ExecInitExtraTupleSlot(estate, tupdesc,
+												&TTSOpsBufferHeapTuple);
+
+	mss->state = median_state_create(TupleDescAttr(tupdesc,
+												   mss->attnum - 1)->atttypid);
+	mss->pscan = NULL;
+	mss->done = false;
+}
+
+/*
+ * median_scan_exec
+ *
+ * Return the single result row, then nothing.
+ */
+static TupleTableSlot *
+median_scan_exec(CustomScanState *node)
+{
+	return ExecScan(&node->ss, median_scan_next, median_scan_recheck);
+}
+
+/*
+ * median_scan_next
+ *
+ * Scan the table and return its median, or the serialized state in a
+ * partial scan, NULL if no value was found.
+ */
+static TupleTableSlot *
+median_scan_next(ScanState *node)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+	TupleTableSlot *slot = node->ss_ScanTupleSlot;
+
+	ExecClearTuple(slot);
+	if (mss->done)
+		return slot;
+	mss->done = true;
+
+	median_scan_collect(mss);
+
+	if (median_state_count(mss->state) == 0)
+	{
+		slot->tts_values[0] = (Datum) 0;
+		slot->tts_isnull[0] = true;
+	}
+	else
+	{
+		if (mss->partial)
+			slot->tts_values[0] =
+				PointerGetDatum(median_state_serialize(mss->state));
+		else
+			slot->tts_values[0] = median_state_median(mss->state);
+		slot->tts_isnull[0] = false;
+	}
+
+	return ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * median_scan_recheck
+ *
+ * There are no rows of the table in the output to recheck.
+ */
+static bool
+median_scan_recheck(ScanState *node, TupleTableSlot *slot)
+{
+	return true;
+}
+
+/*
+ * median_scan_collect
+ *
+ * Add the non-null values of the attribute in the rows of the table that
+ * are visible and pass the quals to the state. In a parallel scan only the
+ * blocks handed to this process are read.
+ */
+static void
+median_scan_collect(MedianScanState *mss)
+{
+	Relation	rel = mss->rel;
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	ExprContext *econtext = mss->css.ss.ps.ps_ExprContext;
+	EState	   *estate = mss->css.ss.ps.state;
+	TableScanDesc scan;
+	HeapTuple	tuple;
+
+	if (mss->pscan != NULL)
+		scan = table_beginscan_parallel(rel, mss->pscan);
+	else
+		scan = table_beginscan(rel, estate->es_snapshot, 0, NULL);
+
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Datum		value;
+		bool		isnull;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (mss->qual != NULL)
+		{
+			ResetExprContext(econtext);
+			ExecStoreBufferHeapTuple(tuple, mss->heap_slot,
+									 ((HeapScanDesc) scan)->rs_cbuf);
+			econtext->ecxt_scantuple = mss->heap_slot;
+			if (!ExecQual(mss->qual, econtext))
+				continue;
+
+			value = slot_getattr(mss->heap_slot, mss->attnum, &isnull);
+		}
+		else
+			value = heap_getattr(tuple, mss->attnum, tupdesc, &isnull);
+
+		if (!isnull)
+			median_state_add(mss->state, value);
+	}
+
+	if (mss->heap_slot != NULL)
+		ExecClearTuple(mss->heap_slot);
+	table_endscan(scan);
+}
+
+/*
+ * median_scan_end
+ *
+ * Close the table.
+ */
+static void
+median_scan_end(CustomScanState *node)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+
+	table_close(mss->rel, NoLock);
+}
+
+/*
+ * median_scan_rescan
+ *
+ * Start over with an empty state. A parallel scan has its shared state
+ * reset by median_scan_reinitialize_dsm.
+ */
+static void
+median_scan_rescan(CustomScanState *node)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+
+	median_state_reset(mss->state);
+	mss->done = false;
+}
+
+/*
+ * median_scan_estimate_dsm
+ *
+ * Size of the shared state of a parallel scan.
+ */
+static Size
+median_scan_estimate_dsm(CustomScanState *node, ParallelContext *pcxt)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+
+	return table_parallelscan_estimate(mss->rel, node->ss.ps.state->es_snapshot);
+}
+
+/*
+ * median_scan_initialize_dsm
+ *
+ * Set up the shared state of a parallel scan in the leader.
+ */
+static void
+median_scan_initialize_dsm(CustomScanState *node, ParallelContext *pcxt,
+						   void *coordinate)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+
+	mss->pscan = (ParallelTableScanDesc) coordinate;
+	table_parallelscan_initialize(mss->rel, mss->pscan,
+								  node->ss.ps.state->es_snapshot);
+}
+
+/*
+ * median_scan_reinitialize_dsm
+ *
+ * Reset the shared state of a parallel scan for a rescan.
+ */
+static void
+median_scan_reinitialize_dsm(CustomScanState *node, ParallelContext *pcxt,
+							 void *coordinate)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+
+	table_parallelscan_reinitialize(mss->rel, (ParallelTableScanDesc) coordinate);
+}
+
+/*
+ * median_scan_initialize_worker
+ *
+ * Attach a parallel worker to the shared state of the scan.
+ */
+static void
+median_scan_initialize_worker(CustomScanState *node, shm_toc *toc,
+							  void *coordinate)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+
+	mss->pscan = (ParallelTableScanDesc) coordinate;
+}
+
+/*
+ * median_scan_explain
+ *
+ * Show the table, the column and the quals of the scan.
+ */
+static void
+median_scan_explain(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+	MedianScanState *mss = (MedianScanState *) node;
+	char	   *relname = RelationGetRelationName(mss->rel);
+
+	ExplainPropertyText("Relation", relname, es);
+	ExplainPropertyText("Column", get_attname(mss->relid, mss->attnum, false),
+						es);
+
+	if (mss->quals != NIL)
+	{
+		List	   *context = deparse_context_for(relname, mss->relid);
+
+		ExplainPropertyText("Filter",
+							deparse_expression((Node *) make_ands_explicit(mss->quals),
+											   context, false, false),
+							es);
+	}
+}
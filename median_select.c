@@ -0,0 +1,491 @@
+/*
+ * median_select.c
+ *
+ * Radix selection over by-value median states.
+ *
+ * For by-value types with an order preserving mapping to unsigned integers we
+ * can find the k-th smallest value without calling the type's comparison
+ * function at all: each pass builds a 256-bucket histogram of the next key
+ * byte over the values that share the already chosen prefix, and the bucket
+ * holding rank k becomes the next byte of the prefix.
+ *
+ * The histogram passes are embarrassingly parallel, so they can optionally be
+ * spread over a small pool of threads, each counting a disjoint slice of the
+ * array into its own histogram. The threads only ever touch the arrays handed
+ * to them by the leader: they make no palloc, elog or other backend calls,
+ * and have all signals blocked so that signal handling stays in the backend's
+ * main thread. The leader takes part in every pass itself and is the only one
+ * merging histograms and allocating memory.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "catalog/pg_type.h"
+#include "utils/memutils.h"
+
+#include "median.h"
+
+/* Upper limit for median.finalize_threads */
+#define MEDIAN_MAX_THREADS		128
+
+/* Don't bother waking up threads for less than this many values each */
+#define MEDIAN_MIN_PER_SLICE	(64 * 1024)
+
+#define RADIX_BITS				8
+#define RADIX_BUCKETS			(1 << RADIX_BITS)
+
+typedef enum RadixJobType
+{
+	RADIX_JOB_HISTOGRAM,		/* count digits of keys matching prefix */
+	RADIX_JOB_GATHER,			/* copy keys matching prefix to gather */
+	RADIX_JOB_MIN_ABOVE			/* find the smallest key above prefix */
+} RadixJobType;
+
+typedef struct RadixSlice
+{
+	int64		hist[RADIX_BUCKETS];	/* histogram of this slice */
+	int64		offset;			/* output offset of this slice for GATHER */
+	uint64		min_above;		/* result of MIN_ABOVE */
+	bool		found;			/* did MIN_ABOVE find anything? */
+} RadixSlice;
+
+typedef struct RadixJob
+{
+	RadixJobType type;
+	MedianKeyKind kind;
+	const Datum *values;		/* input values, used if keys is NULL */
+	const uint64 *keys;			/* input keys of candidates, or NULL */
+	int64		count;			/* number of input values or keys */
+	uint64		prefix;			/* key bits chosen so far */
+	uint64		mask;			/* which key bits are chosen */
+	int			shift;			/* position of the digit to count */
+	uint64	   *gather;			/* output of GATHER */
+	RadixSlice *slices;			/* per participant results */
+	int			nslices;		/* number of participants */
+} RadixJob;
+
+/*
+ * The thread pool. It is started lazily by the first threaded selection and
+ * then kept for the lifetime of the backend, unless median.finalize_threads is
+ * changed.
+ */
+static struct
+{
+	int			nthreads;		/* number of helper threads running */
+	pthread_t	threads[MEDIAN_MAX_THREADS];
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cv;		/* signalled when a job is posted */
+	pthread_cond_t done_cv;		/* signalled when pending drops to zero */
+	uint64		generation;		/* bumped for every posted job */
+	uint64		base_generation;	/* generation when threads started */
+	int			pending;		/* helper threads still busy with job */
+	RadixJob   *job;			/* current job */
+	bool		shutdown;		/* ask helper threads to exit */
+}			radix_pool =
+{
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work_cv = PTHREAD_COND_INITIALIZER,
+	.done_cv = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64 radix_select(const Datum *values, const uint64 *keys,
+						   int64 count, MedianKeyKind kind, int64 rank,
+						   int nthreads, uint64 *next);
+static void radix_run_slice(RadixJob *job, int slice);
+static void radix_dispatch(RadixJob *job);
+static int	radix_slices(int64 count, int nthreads);
+static void radix_pool_resize(int nthreads);
+static void *radix_pool_main(void *arg);
+
+
+/*
+ * median_key_kind
+ *
+ * Return the key mapping to use for a type, or MEDIAN_KEY_NONE if values of
+ * the type cannot be radix selected.
+ */
+MedianKeyKind
+median_key_kind(Oid typid)
+{
+	switch (typid)
+	{
+		case INT2OID:
+			return MEDIAN_KEY_INT16;
+		case INT4OID:
+		case DATEOID:
+			return MEDIAN_KEY_INT32;
+		case OIDOID:
+			return MEDIAN_KEY_UINT32;
+		case FLOAT4OID:
+			return MEDIAN_KEY_FLOAT4;
+#ifdef USE_FLOAT8_BYVAL
+		case INT8OID:
+		case TIMEOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return MEDIAN_KEY_INT64;
+		case FLOAT8OID:
+			return MEDIAN_KEY_FLOAT8;
+#endif
+		default:
+			return MEDIAN_KEY_NONE;
+	}
+}
+
+/*
+ * median_radix_select
+ *
+ * Return the value of the given zero-based rank in values, as if they were
+ * sorted. If next is not NULL, the value of rank + 1 is returned there as
+ * well, which saves a second selection for the even-count median.
+ *
+ * Up to nthreads threads, including the calling backend, share the passes.
+ */
+Datum
+median_radix_select(const Datum *values, int64 count, MedianKeyKind kind,
+					int64 rank, int nthreads, Datum *next)
+{
+	uint64		key;
+	uint64		next_key;
+
+	key = radix_select(values, NULL, count, kind, rank, nthreads,
+					   next ? &next_key : NULL);
+	if (next != NULL)
+		*next = median_key_to_datum(next_key, kind);
+
+	return median_key_to_datum(key, kind);
+}
+
+/*
+ * median_radix_select_keys
+ *
+ * Like median_radix_select, for input that is already mapped to keys.
+ */
+uint64
+median_radix_select_keys(const uint64 *keys, int64 count, MedianKeyKind kind,
+						 int64 rank, int nthreads, uint64 *next)
+{
+	return radix_select(NULL, keys, count, kind, rank, nthreads, next);
+}
+
+/*
+ * radix_select
+ *
+ * Workhorse of the above, takes either values or keys as input.
+ */
+static uint64
+radix_select(const Datum *values, const uint64 *keys, int64 count,
+			 MedianKeyKind kind, int64 rank, int nthreads, uint64 *next)
+{
+	RadixJob	job;
+	int64		remaining = count;
+	int			maxslices;
+	int			shift;
+
+	Assert(kind != MEDIAN_KEY_NONE);
+	Assert(rank >= 0 && rank < count);
+	Assert(next == NULL || rank + 1 < count);
+
+	nthreads = Min(Max(nthreads, 1), MEDIAN_MAX_THREADS);
+	if (nthreads - 1 != radix_pool.nthreads)
+		radix_pool_resize(nthreads - 1);
+
+	maxslices = radix_slices(count, radix_pool.nthreads + 1);
+
+	memset(&job, 0, sizeof(job));
+	job.kind = kind;
+	job.values = values;
+	job.keys = keys;
+	job.count = count;
+	job.prefix = 0;
+	job.mask = 0;
+	job.slices = (RadixSlice *) palloc(maxslices * sizeof(RadixSlice));
+	job.nslices = maxslices;
+
+	for (shift = median_key_bits(kind) - RADIX_BITS; shift >= 0; shift -= RADIX_BITS)
+	{
+		int64		hist[RADIX_BUCKETS];
+		int64		cum = 0;
+		int			digit;
+		int			i;
+
+		job.type = RADIX_JOB_HISTOGRAM;
+		job.shift = shift;
+		radix_dispatch(&job);
+
+		/* Merge the per-slice histograms */
+		memset(hist, 0, sizeof(hist));
+		for (i = 0; i < job.nslices; i++)
+			for (digit = 0; digit < RADIX_BUCKETS; digit++)
+				hist[digit] += job.slices[i].hist[digit];
+
+		/* Find the bucket holding our rank */
+		for (digit = 0; digit < RADIX_BUCKETS - 1; digit++)
+		{
+			if (rank < cum + hist[digit])
+				break;
+			cum += hist[digit];
+		}
+		rank -= cum;
+		remaining = hist[digit];
+
+		job.prefix |= (uint64) digit << shift;
+		job.mask |= (uint64) (RADIX_BUCKETS - 1) << shift;
+
+		/*
+		 * Once the candidates are a small fraction of the input, copy their
+		 * keys out so that the remaining passes don't need to scan and
+		 * convert the whole array again. Every slice knows how many of its
+		 * keys are in the chosen bucket, which gives its output offset.
+		 */
+		if (shift > 0 && job.gather == NULL && remaining <= count / 8)
+		{
+			int64		offset = 0;
+
+			for (i = 0; i < job.nslices; i++)
+			{
+				job.slices[i].offset = offset;
+				offset += job.slices[i].hist[digit];
+			}
+
+			job.type = RADIX_JOB_GATHER;
+			job.gather = (uint64 *) palloc_extended(Max(remaining, 1) * sizeof(uint64),
+													MCXT_ALLOC_HUGE);
+			radix_dispatch(&job);
+
+			job.keys = job.gather;
+			job.count = remaining;
+			job.nslices = radix_slices(remaining, job.nslices);
+		}
+	}
+
+	/* All key bits are chosen now, and rank indexes the equal keys */
+	if (next != NULL)
+	{
+		if (rank + 1 < remaining)
+			*next = job.prefix;
+		else
+		{
+			uint64		min_above = PG_UINT64_MAX;
+			int			i;
+
+			job.type = RADIX_JOB_MIN_ABOVE;
+			job.values = values;
+			job.keys = keys;
+			job.count = count;
+			job.nslices = maxslices;
+			radix_dispatch(&job);
+
+			for (i = 0; i < job.nslices; i++)
+				if (job.slices[i].found && job.slices[i].min_above < min_above)
+					min_above = job.slices[i].min_above;
+			*next = min_above;
+		}
+	}
+
+	if (job.gather != NULL)
+		pfree(job.gather);
+	pfree(job.slices);
+
+	return job.prefix;
+}
+
+/*
+ * radix_run_slice
+ *
+ * Do one participant's share of a job. Runs in the helper threads, so no
+ * backend calls in here.
+ */
+static void
+radix_run_slice(RadixJob *job, int slice)
+{
+	RadixSlice *s = &job->slices[slice];
+	int64		start = job->count * slice / job->nslices;
+	int64		end = job->count * (slice + 1) / job->nslices;
+	int64		i;
+
+	switch (job->type)
+	{
+		case RADIX_JOB_HISTOGRAM:
+			memset(s->hist, 0, sizeof(s->hist));
+			for (i = start; i < end; i++)
+			{
+				uint64		key = job->keys ? job->keys[i] :
+				median_datum_to_key(job->values[i], job->kind);
+
+				if ((key & job->mask) == job->prefix)
+					s->hist[(key >> job->shift) & (RADIX_BUCKETS - 1)]++;
+			}
+			break;
+
+		case RADIX_JOB_GATHER:
+			{
+				uint64	   *out = job->gather + s->offset;
+
+				for (i = start; i < end; i++)
+				{
+					uint64		key = job->keys ? job->keys[i] :
+					median_datum_to_key(job->values[i], job->kind);
+
+					if ((key & job->mask) == job->prefix)
+						*out++ = key;
+				}
+			}
+			break;
+
+		case RADIX_JOB_MIN_ABOVE:
+			s->found = false;
+			s->min_above = PG_UINT64_MAX;
+			for (i = start; i < end; i++)
+			{
+				uint64		key = job->keys ? job->keys[i] :
+				median_datum_to_key(job->values[i], job->kind);
+
+				if (key > job->prefix && key <= s->min_above)
+				{
+					s->min_above = key;
+					s->found = true;
+				}
+			}
+			break;
+	}
+}
+
+/*
+ * radix_dispatch
+ *
+ * Run a job on all its slices, the calling backend doing the first one, and
+ * wait for the helper threads to finish theirs.
+ */
+static void
+radix_dispatch(RadixJob *job)
+{
+	if (job->nslices <= 1)
+	{
+		radix_run_slice(job, 0);
+		return;
+	}
+
+	Assert(job->nslices <= radix_pool.nthreads + 1);
+
+	pthread_mutex_lock(&radix_pool.mutex);
+	radix_pool.job = job;
+	radix_pool.pending = radix_pool.nthreads;
+	radix_pool.generation++;
+	pthread_cond_broadcast(&radix_pool.work_cv);
+	pthread_mutex_unlock(&radix_pool.mutex);
+
+	radix_run_slice(job, 0);
+
+	pthread_mutex_lock(&radix_pool.mutex);
+	while (radix_pool.pending > 0)
+		pthread_cond_wait(&radix_pool.done_cv, &radix_pool.mutex);
+	radix_pool.job = NULL;
+	pthread_mutex_unlock(&radix_pool.mutex);
+}
+
+/*
+ * radix_slices
+ *
+ * Number of participants worth using for count values.
+ */
+static int
+radix_slices(int64 count, int nthreads)
+{
+	int64		nslices = count / MEDIAN_MIN_PER_SLICE;
+
+	return (int) Max(Min(nslices, nthreads), 1);
+}
+
+/*
+ * radix_pool_resize
+ *
+ * Stop the current helper threads, if any, and start nthreads new ones. If
+ * thread creation fails we carry on with the threads we got, down to running
+ * everything in the backend itself.
+ */
+static void
+radix_pool_resize(int nthreads)
+{
+	sigset_t	blocked;
+	sigset_t	saved;
+	int			i;
+
+	if (radix_pool.nthreads > 0)
+	{
+		pthread_mutex_lock(&radix_pool.mutex);
+		radix_pool.shutdown = true;
+		pthread_cond_broadcast(&radix_pool.work_cv);
+		pthread_mutex_unlock(&radix_pool.mutex);
+
+		for (i = 0; i < radix_pool.nthreads; i++)
+			pthread_join(radix_pool.threads[i], NULL);
+
+		radix_pool.shutdown = false;
+		radix_pool.nthreads = 0;
+	}
+
+	if (nthreads <= 0)
+		return;
+
+	/* New threads inherit our signal mask, keep them away from signals */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_SETMASK, &blocked, &saved);
+
+	radix_pool.base_generation = radix_pool.generation;
+	for (i = 0; i < nthreads; i++)
+	{
+		if (pthread_create(&radix_pool.threads[i], NULL, radix_pool_main,
+						   (void *) (intptr_t) (i + 1)) != 0)
+			break;
+	}
+	radix_pool.nthreads = i;
+
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (radix_pool.nthreads < nthreads)
+		elog(DEBUG1, "could only start %d of %d median selection threads",
+			 radix_pool.nthreads, nthreads);
+}
+
+/*
+ * radix_pool_main
+ *
+ * Main loop of a helper thread: wait for a job, do our slice of it, and
+ * report back. The argument is the slice number of this thread.
+ */
+static void *
+radix_pool_main(void *arg)
+{
+	int			slice = (int) (intptr_t) arg;
+	uint64		seen;
+
+	pthread_mutex_lock(&radix_pool.mutex);
+	seen = radix_pool.base_generation;
+	for (;;)
+	{
+		RadixJob   *job;
+
+		while (!radix_pool.shutdown && radix_pool.generation == seen)
+			pthread_cond_wait(&radix_pool.work_cv, &radix_pool.mutex);
+		if (radix_pool.shutdown)
+			break;
+
+		seen = radix_pool.generation;
+		job = radix_pool.job;
+		pthread_mutex_unlock(&radix_pool.mutex);
+
+		if (slice < job->nslices)
+			radix_run_slice(job, slice);
+
+		pthread_mutex_lock(&radix_pool.mutex);
+		if (--radix_pool.pending == 0)
+			pthread_cond_signal(&radix_pool.done_cv);
+	}
+	pthread_mutex_unlock(&radix_pool.mutex);
+
+	return NULL;
+}
@@ -0,0 +1,120 @@
+/*
+ * median_sketch.c
+ *
+ * Log-bucketed quantile sketches.
+ *
+ * A sketch counts values in buckets whose bounds grow geometrically by a
+ * factor gamma = (1 + alpha) / (1 - alpha). Reporting the geometric middle of
+ * a bucket then estimates any quantile within a relative error of alpha, no
+ * matter how many values were counted. Positive and negative values have a
+ * mirrored set of buckets each, and values too close to zero to be told apart
+ * from it share a bucket in the middle, so that the slots of a sketch are in
+ * value order:
+ *
+ *	  [ negative buckets, largest magnitude first | zero | positive buckets ]
+ *
+ * The sketch is just an array of MEDIAN_SKETCH_SLOTS counters. Adding or
+ * removing a value is a single counter update, which is what makes sketches
+ * cheap to share between backends and to use in moving aggregates.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <math.h>
+
+#include "median.h"
+
+/* log(gamma) */
+#define MEDIAN_SKETCH_LOG_GAMMA \
+	log((1.0 + MEDIAN_SKETCH_ALPHA) / (1.0 - MEDIAN_SKETCH_ALPHA))
+
+
+/*
+ * median_sketch_slot
+ *
+ * Return the slot counting value, or -1 for NaN, which cannot be ordered
+ * among the other values. Infinities go to the outermost buckets.
+ */
+int
+median_sketch_slot(float8 value)
+{
+	float8		absval = fabs(value);
+	int			index;
+
+	if (isnan(value))
+		return -1;
+
+	if (isinf(value))
+		index = MEDIAN_SKETCH_BUCKETS - 1;
+	else if (absval == 0)
+		return MEDIAN_SKETCH_ZERO_SLOT;
+	else
+	{
+		float8		raw = ceil(log(absval) / MEDIAN_SKETCH_LOG_GAMMA);
+
+		if (raw < -MEDIAN_SKETCH_BUCKETS / 2)
+			return MEDIAN_SKETCH_ZERO_SLOT;
+		index = (int) Min(raw + MEDIAN_SKETCH_BUCKETS / 2,
+						  MEDIAN_SKETCH_BUCKETS - 1);
+	}
+
+	return value > 0 ? MEDIAN_SKETCH_ZERO_SLOT + 1 + index :
+		MEDIAN_SKETCH_ZERO_SLOT - 1 - index;
+}
+
+/*
+ * median_sketch_slot_value
+ *
+ * The value reported for a slot, chosen to have the same relative distance
+ * to both bounds of its bucket.
+ */
+float8
+median_sketch_slot_value(int slot)
+{
+	float8		gamma = (1.0 + MEDIAN_SKETCH_ALPHA) / (1.0 - MEDIAN_SKETCH_ALPHA);
+	int			index;
+	float8		value;
+
+	Assert(slot >= 0 && slot < MEDIAN_SKETCH_SLOTS);
+
+	if (slot == MEDIAN_SKETCH_ZERO_SLOT)
+		return 0;
+
+	if (slot > MEDIAN_SKETCH_ZERO_SLOT)
+		index = slot - MEDIAN_SKETCH_ZERO_SLOT - 1;
+	else
+		index = MEDIAN_SKETCH_ZERO_SLOT - 1 - slot;
+
+	value = 2.0 * exp((index - MEDIAN_SKETCH_BUCKETS / 2) *
+					  MEDIAN_SKETCH_LOG_GAMMA) / (gamma + 1.0);
+
+	return slot > MEDIAN_SKETCH_ZERO_SLOT ? value : -value;
+}
+
+/*
+ * median_sketch_quantile
+ *
+ * Estimate the value at the given fraction of a sketch holding total values,
+ * using the same rank as percentile_disc. The sketch must not be empty.
+ */
+float8
+median_sketch_quantile(const int64 *counts, int64 total, float8 fraction)
+{
+	int64		rank;
+	int64		cum = 0;
+	int			slot;
+
+	Assert(total > 0);
+
+	rank = (int64) ceil(fraction * total) - 1;
+	rank = Max(Min(rank, total - 1), 0);
+
+	for (slot = 0; slot < MEDIAN_SKETCH_SLOTS - 1; slot++)
+	{
+		cum += counts[slot];
+		if (cum > rank)
+			break;
+	}
+
+	return median_sketch_slot_value(slot);
+}
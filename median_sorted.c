@@ -0,0 +1,399 @@
+/*
+ * median_sorted.c
+ *
+ * Sorted arrays of all values, built in parallel on median states.
+ *
+ * sorted_array_agg collects its values in a median state like median does.
+ * Its serial function sorts a partial state before sending it, so in a
+ * parallel plan every worker sorts its own share and the leader only receives
+ * sorted runs. The combine function appends the runs and remembers where each
+ * ends, and the final function merges them with a loser tree, which takes
+ * about log2(k) comparisons per value for k runs. Without parallelism there is
+ * a single unsorted run, which is sorted as median_state_sorted_values does.
+ * NULLs are skipped, as by median.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "miscadmin.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/typcache.h"
+
+#include "median.h"
+
+/*
+ * SortedArrayState
+ *
+ * Transition state of sorted_array_agg. If sorted is set, values consists of
+ * nruns sorted runs, run i ending before run_ends[i].
+ */
+typedef struct SortedArrayState
+{
+	MedianState *values;
+	bool		sorted;			/* values are made of sorted runs */
+	int			nruns;			/* number of runs */
+	int			maxruns;		/* allocated size of run_ends */
+	int64	   *run_ends;		/* end of each run */
+} SortedArrayState;
+
+/*
+ * MedianLoserTree
+ *
+ * Tournament tree over k sorted runs. Leaf i is node k + i, internal node n has
+ * children 2n and 2n + 1 and holds the run that lost the match there; node 0
+ * holds the overall winner.
+ */
+typedef struct MedianLoserTree
+{
+	const Datum *values;
+	int64	   *pos;			/* next value of each run */
+	const int64 *ends;			/* end of each run */
+	int			k;				/* number of runs */
+	int		   *nodes;			/* 2k nodes, see above */
+	TypeCacheEntry *typentry;
+} MedianLoserTree;
+
+static SortedArrayState *sorted_array_state_create(MedianState *values,
+												   bool sorted);
+static void sorted_array_add_run(SortedArrayState *state, int64 end);
+static bool loser_tree_precedes(MedianLoserTree *tree, int a, int b);
+
+PG_FUNCTION_INFO_V1(sorted_array_agg_transfn);
+PG_FUNCTION_INFO_V1(sorted_array_agg_combinefn);
+PG_FUNCTION_INFO_V1(sorted_array_agg_serialfn);
+PG_FUNCTION_INFO_V1(sorted_array_agg_deserialfn);
+PG_FUNCTION_INFO_V1(sorted_array_agg_finalfn);
+
+
+/*
+ * sorted_array_agg_transfn
+ *
+ * Add a value to the state, creating it on the first call.
+ */
+Datum
+sorted_array_agg_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	SortedArrayState *state;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "sorted_array_agg_transfn called in non-aggregate context");
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	if (PG_ARGISNULL(0))
+	{
+		Oid			inputTypeId = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+		if (inputTypeId == InvalidOid)
+			elog(ERROR, "could not determine input data type");
+
+		state = sorted_array_state_create(median_state_create(inputTypeId),
+										  false);
+	}
+	else
+		state = (SortedArrayState *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		median_state_add(state->values, PG_GETARG_DATUM(1));
+		state->sorted = false;
+	}
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * sorted_array_agg_combinefn
+ *
+ * Append the runs of state2 to state1. The values of state2 are not copied,
+ * it lives in the aggregate context as well.
+ */
+Datum
+sorted_array_agg_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	SortedArrayState *state1;
+	SortedArrayState *state2;
+	int64		offset;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (SortedArrayState *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (SortedArrayState *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+		PG_RETURN_POINTER(state1);
+
+	/* state2 is not used after this, its values can be taken over */
+	if (state1 == NULL)
+		PG_RETURN_POINTER(state2);
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	offset = median_state_count(state1->values);
+	median_state_combine(state1->values, state2->values);
+
+	state1->sorted = state1->sorted && state2->sorted;
+	for (int i = 0; i < state2->nruns && state1->sorted; i++)
+		sorted_array_add_run(state1, offset + state2->run_ends[i]);
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * sorted_array_agg_serialfn
+ *
+ * Sort the values of a partial state and serialize them, so that the leader
+ * gets a sorted run.
+ */
+Datum
+sorted_array_agg_serialfn(PG_FUNCTION_ARGS)
+{
+	SortedArrayState *state;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	state = (SortedArrayState *) PG_GETARG_POINTER(0);
+
+	if (!state->sorted || state->nruns > 1)
+		median_state_sorted_values(state->values);
+
+	PG_RETURN_BYTEA_P(median_state_serialize(state->values));
+}
+
+/*
+ * sorted_array_agg_deserialfn
+ *
+ * Rebuild a state of one sorted run from sorted_array_agg_serialfn in the
+ * aggregate memory context.
+ */
+Datum
+sorted_array_agg_deserialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	MemoryContext old_context;
+	SortedArrayState *state;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	state = sorted_array_state_create(median_state_deserialize_trusted(PG_GETARG_BYTEA_P(0)),
+									  true);
+
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * sorted_array_agg_finalfn
+ *
+ * The values in ascending order, NULL if there are none.
+ */
+Datum
+sorted_array_agg_finalfn(PG_FUNCTION_ARGS)
+{
+	SortedArrayState *state;
+	Oid			typid;
+	int64		count;
+	Datum	   *values;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (SortedArrayState *) PG_GETARG_POINTER(0);
+
+	count = median_state_count(state->values);
+	if (count == 0)
+		PG_RETURN_NULL();
+	if (count > MaxArraySize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many values for an array: " INT64_FORMAT, count)));
+
+	typid = median_state_type(state->values);
+
+	if (!state->sorted)
+		values = median_state_sorted_values(state->values);
+	else if (state->nruns == 1)
+		values = median_state_values(state->values);
+	else
+	{
+		values = (Datum *) palloc_extended(count * sizeof(Datum),
+										   MCXT_ALLOC_HUGE);
+		median_merge_runs(median_state_values(state->values), state->run_ends,
+						  state->nruns, get_type_comp_method(typid), values);
+	}
+
+	get_typlenbyvalalign(typid, &typlen, &typbyval, &typalign);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, (int) count, typid,
+										  typlen, typbyval, typalign));
+}
+
+/*
+ * median_merge_runs
+ *
+ * Merge nruns sorted runs of values, run i ending before run_ends[i], into
+ * result in the order of the type's comparison function. Equal values keep
+ * the order of their runs.
+ */
+void
+median_merge_runs(const Datum *values, const int64 *run_ends, int nruns,
+				  TypeCacheEntry *typentry, Datum *result)
+{
+	MedianLoserTree tree;
+	int		   *winners;
+	int64		count = nruns > 0 ? run_ends[nruns - 1] : 0;
+
+	if (nruns == 1)
+	{
+		memcpy(result, values, count * sizeof(Datum));
+		return;
+	}
+	if (nruns == 0)
+		return;
+
+	tree.values = values;
+	tree.ends = run_ends;
+	tree.k = nruns;
+	tree.typentry = typentry;
+	tree.pos = (int64 *) palloc(nruns * sizeof(int64));
+	tree.nodes = (int *) palloc(2 * nruns * sizeof(int));
+	winners = (int *) palloc(2 * nruns * sizeof(int));
+
+	for (int i = 0; i < nruns; i++)
+	{
+		tree.pos[i] = i == 0 ? 0 : run_ends[i - 1];
+		winners[nruns + i] = i;
+	}
+
+	/* Play the first round bottom up, the loser of each match stays there */
+	for (int n = nruns - 1; n >= 1; n--)
+	{
+		int			a = winners[2 * n];
+		int			b = winners[2 * n + 1];
+
+		if (loser_tree_precedes(&tree, a, b))
+		{
+			winners[n] = a;
+			tree.nodes[n] = b;
+		}
+		else
+		{
+			winners[n] = b;
+			tree.nodes[n] = a;
+		}
+	}
+	tree.nodes[0] = winners[1];
+	pfree(winners);
+
+	for (int64 i = 0; i < count; i++)
+	{
+		int			winner = tree.nodes[0];
+
+		if ((i & 0xFFFF) == 0)
+			CHECK_FOR_INTERRUPTS();
+
+		result[i] = values[tree.pos[winner]++];
+
+		/* Replay the matches on the path of the winner's leaf */
+		for (int n = (tree.k + winner) / 2; n >= 1; n /= 2)
+		{
+			if (loser_tree_precedes(&tree, tree.nodes[n], winner))
+			{
+				int			loser = winner;
+
+				winner = tree.nodes[n];
+				tree.nodes[n] = loser;
+			}
+		}
+		tree.nodes[0] = winner;
+	}
+
+	pfree(tree.pos);
+	pfree(tree.nodes);
+}
+
+/*
+ * sorted_array_state_create
+ *
+ * A state around values in the current memory context. Sorted values make one
+ * sorted run.
+ */
+static SortedArrayState *
+sorted_array_state_create(MedianState *values, bool sorted)
+{
+	SortedArrayState *state;
+
+	state = (SortedArrayState *) palloc(sizeof(SortedArrayState));
+	state->values = values;
+	state->sorted = sorted;
+	state->nruns = 0;
+	state->maxruns = 4;
+	state->run_ends = (int64 *) palloc(state->maxruns * sizeof(int64));
+
+	if (sorted && median_state_count(values) > 0)
+		sorted_array_add_run(state, median_state_count(values));
+
+	return state;
+}
+
+/*
+ * sorted_array_add_run
+ *
+ * Record the end of another sorted run.
+ */
+static void
+sorted_array_add_run(SortedArrayState *state, int64 end)
+{
+	if (state->nruns == state->maxruns)
+	{
+		state->maxruns *= 2;
+		state->run_ends = (int64 *) repalloc(state->run_ends,
+											 state->maxruns * sizeof(int64));
+	}
+
+	state->run_ends[state->nruns++] = end;
+}
+
+/*
+ * loser_tree_precedes
+ *
+ * Does the next value of run a come before that of run b? Exhausted runs come
+ * last, and equal values in the order of their runs.
+ */
+static bool
+loser_tree_precedes(MedianLoserTree *tree, int a, int b)
+{
+	int32		cmp;
+
+	if (tree->pos[a] >= tree->ends[a])
+		return false;
+	if (tree->pos[b] >= tree->ends[b])
+		return true;
+
+	cmp = DatumGetInt32(FunctionCall2Coll(&tree->typentry->cmp_proc_finfo,
+										  tree->typentry->typcollation,
+										  tree->values[tree->pos[a]],
+										  tree->values[tree->pos[b]]));
+	if (cmp != 0)
+		return cmp < 0;
+
+	return a < b;
+}
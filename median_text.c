@@ -0,0 +1,261 @@
+/*
+ * median_text.c
+ *
+ * Fixed-size slots for the values of text and varchar median states.
+ *
+ * Instead of an array of pointers to separately allocated varlenas, such a
+ * state keeps its values in an array of 16-byte MedianTextSlots:
+ *
+ *   strings of up to MEDIAN_TEXT_INLINE bytes: the length and the bytes
+ *   longer strings: the length, the first 4 bytes and a pointer to all bytes
+ *
+ * Short strings, which is what most codes and keys are, need no allocation of
+ * their own, and sorting in the C collation decides most comparisons on the
+ * bytes in the slots, without following a pointer. Other collations compare
+ * the whole strings with varstr_cmp, as bttextcmp does.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <stddef.h>
+
+#include "catalog/pg_type.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/pg_locale.h"
+#include "utils/varlena.h"
+
+#include "median.h"
+
+/* Bytes of a string that are always in the slot */
+#define MEDIAN_TEXT_PREFIX	4
+
+/* The inline bytes of a slot, which run on from data into u.rest */
+#define MEDIAN_TEXT_SLOT_INLINE(slot) \
+	((char *) (slot) + offsetof(MedianTextSlot, data))
+
+/* Where the bytes of a slot's string are */
+#define MEDIAN_TEXT_SLOT_DATA(slot) \
+	((slot)->len <= MEDIAN_TEXT_INLINE ? \
+	 (const char *) MEDIAN_TEXT_SLOT_INLINE(slot) : (slot)->u.ptr)
+
+static int	compare_slots_c(const void *a, const void *b, void *arg);
+static int	compare_slots_collate(const void *a, const void *b, void *arg);
+
+
+/*
+ * median_text_slot_type
+ *
+ * Are values of the given type kept in text slots?
+ */
+bool
+median_text_slot_type(Oid typid)
+{
+	return typid == TEXTOID || typid == VARCHAROID;
+}
+
+/*
+ * median_text_slot_set
+ *
+ * Fill a slot with the string of len bytes at data. A string too long to be
+ * inlined is copied into the current memory context if copy is set, otherwise
+ * the slot points at data, which must then live as long as the slot.
+ */
+void
+median_text_slot_set(MedianTextSlot *slot, const char *data, uint32 len,
+					 bool copy)
+{
+	StaticAssertStmt(sizeof(MedianTextSlot) == 16,
+					 "MedianTextSlot must be 16 bytes");
+	StaticAssertStmt(offsetof(MedianTextSlot, u) ==
+					 offsetof(MedianTextSlot, data) + MEDIAN_TEXT_PREFIX,
+					 "inline bytes of MedianTextSlot must be contiguous");
+
+	/* Zero padding keeps the prefix of short strings comparable */
+	memset(slot, 0, sizeof(MedianTextSlot));
+	slot->len = len;
+
+	if (len <= MEDIAN_TEXT_INLINE)
+	{
+		memcpy(MEDIAN_TEXT_SLOT_INLINE(slot), data, len);
+		return;
+	}
+
+	memcpy(slot->data, data, MEDIAN_TEXT_PREFIX);
+	if (copy)
+	{
+		char	   *bytes = palloc(len);
+
+		memcpy(bytes, data, len);
+		data = bytes;
+	}
+	slot->u.ptr = data;
+}
+
+/*
+ * median_text_slot_set_datum
+ *
+ * Fill a slot with a text value, which may be toasted. Anything that has to be
+ * kept is allocated in the current memory context, and the memory taken by it
+ * is returned.
+ */
+Size
+median_text_slot_set_datum(MedianTextSlot *slot, Datum value)
+{
+	text	   *t = DatumGetTextPP(value);
+	uint32		len = VARSIZE_ANY_EXHDR(t);
+
+	/* A detoasted copy can be pointed at as it is */
+	if ((Pointer) t == DatumGetPointer(value))
+	{
+		median_text_slot_set(slot, VARDATA_ANY(t), len, true);
+		return len > MEDIAN_TEXT_INLINE ? GetMemoryChunkSpace(slot->u.ptr) : 0;
+	}
+
+	median_text_slot_set(slot, VARDATA_ANY(t), len, false);
+	if (len > MEDIAN_TEXT_INLINE)
+		return GetMemoryChunkSpace(t);
+
+	pfree(t);
+	return 0;
+}
+
+/*
+ * median_text_slot_datum
+ *
+ * The value of a slot as a text Datum in the current memory context.
+ */
+Datum
+median_text_slot_datum(const MedianTextSlot *slot)
+{
+	return PointerGetDatum(cstring_to_text_with_len(MEDIAN_TEXT_SLOT_DATA(slot),
+													slot->len));
+}
+
+/*
+ * median_text_slot_find
+ *
+ * Index of the first of count slots holding the same string as a text value,
+ * or -1 if there is none.
+ */
+int64
+median_text_slot_find(const MedianTextSlot *slots, int64 count, Datum value)
+{
+	text	   *t = DatumGetTextPP(value);
+	const char *data = VARDATA_ANY(t);
+	uint32		len = VARSIZE_ANY_EXHDR(t);
+
+	for (int64 i = 0; i < count; i++)
+	{
+		if (slots[i].len == len &&
+			memcmp(MEDIAN_TEXT_SLOT_DATA(&slots[i]), data, len) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * median_text_slot_size
+ *
+ * Size of the value of a slot as a varlena with the shortest header.
+ */
+Size
+median_text_slot_size(const MedianTextSlot *slot)
+{
+	if (slot->len + VARHDRSZ_SHORT <= VARATT_SHORT_MAX)
+		return slot->len + VARHDRSZ_SHORT;
+
+	return slot->len + VARHDRSZ;
+}
+
+/*
+ * median_text_slot_write
+ *
+ * Write the value of a slot as a varlena of median_text_slot_size bytes at a
+ * possibly unaligned p. Returns the end of what was written.
+ */
+char *
+median_text_slot_write(char *p, const MedianTextSlot *slot)
+{
+	Size		size = median_text_slot_size(slot);
+
+	if (size == slot->len + VARHDRSZ_SHORT)
+	{
+		SET_VARSIZE_SHORT(p, size);
+		p += VARHDRSZ_SHORT;
+	}
+	else
+	{
+		uint32		header;
+
+		SET_VARSIZE(&header, size);
+		memcpy(p, &header, sizeof(uint32));
+		p += VARHDRSZ;
+	}
+
+	memcpy(p, MEDIAN_TEXT_SLOT_DATA(slot), slot->len);
+
+	return p + slot->len;
+}
+
+/*
+ * median_text_slot_comparator
+ *
+ * qsort_arg comparator for slots in the given collation, which has to be
+ * passed as the argument, by reference.
+ */
+qsort_arg_comparator
+median_text_slot_comparator(Oid collation)
+{
+	if (lc_collate_is_c(collation))
+		return compare_slots_c;
+
+	return compare_slots_collate;
+}
+
+/*
+ * compare_slots_c
+ *
+ * Compare two slots bytewise, which is the order of the C collation.
+ */
+static int
+compare_slots_c(const void *a, const void *b, void *arg)
+{
+	const MedianTextSlot *sa = (const MedianTextSlot *) a;
+	const MedianTextSlot *sb = (const MedianTextSlot *) b;
+	uint32		minlen = Min(sa->len, sb->len);
+	int			cmp;
+
+	/* The first bytes are in the slots, inline or not */
+	cmp = memcmp(sa->data, sb->data, Min(minlen, MEDIAN_TEXT_PREFIX));
+	if (cmp != 0)
+		return cmp;
+
+	if (minlen > MEDIAN_TEXT_PREFIX)
+	{
+		cmp = memcmp(MEDIAN_TEXT_SLOT_DATA(sa) + MEDIAN_TEXT_PREFIX,
+					 MEDIAN_TEXT_SLOT_DATA(sb) + MEDIAN_TEXT_PREFIX,
+					 minlen - MEDIAN_TEXT_PREFIX);
+		if (cmp != 0)
+			return cmp;
+	}
+
+	return (sa->len > sb->len) - (sa->len < sb->len);
+}
+
+/*
+ * compare_slots_collate
+ *
+ * Compare two slots in the collation pointed to by arg.
+ */
+static int
+compare_slots_collate(const void *a, const void *b, void *arg)
+{
+	const MedianTextSlot *sa = (const MedianTextSlot *) a;
+	const MedianTextSlot *sb = (const MedianTextSlot *) b;
+
+	return varstr_cmp(MEDIAN_TEXT_SLOT_DATA(sa), sa->len,
+					  MEDIAN_TEXT_SLOT_DATA(sb), sb->len,
+					  *(Oid *) arg);
+}
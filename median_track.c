@@ -0,0 +1,427 @@
+/*
+ * median_track.c
+ *
+ * Named quantile sketches in shared memory.
+ *
+ * median_track() counts a value into a named log-bucketed sketch (see
+ * median_sketch.c) that lives in shared memory, and median_tracked() reads a
+ * quantile back from it, so applications can record latencies and the like
+ * without inserting rows. There is a fixed number of sketches, set by
+ * median.max_tracked, which needs the library in shared_preload_libraries.
+ *
+ * Nothing here takes a lock. Counting a value is one atomic increment of its
+ * bucket. Sketches are found by open addressing on the hash of their name: a
+ * backend tracking a new name claims the first free slot of its probe
+ * sequence with a compare-and-exchange, copies the name in and only then
+ * marks the slot ready. Anybody probing past a slot still being set up waits
+ * for it to become ready, so two backends racing to create the same name end
+ * up using the same sketch. Sketches are never removed, only reset.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+#include "median.h"
+
+/* Status of a tracked sketch slot */
+#define MEDIAN_TRACK_FREE		0
+#define MEDIAN_TRACK_INIT		1
+#define MEDIAN_TRACK_READY		2
+
+typedef struct MedianTrackedSketch
+{
+	pg_atomic_uint32 status;
+	char		name[NAMEDATALEN];
+	pg_atomic_uint64 counts[MEDIAN_SKETCH_SLOTS];
+} MedianTrackedSketch;
+
+typedef struct MedianTrackShared
+{
+	int			nsketches;
+	MedianTrackedSketch sketches[FLEXIBLE_ARRAY_MEMBER];
+} MedianTrackShared;
+
+/* GUC variables */
+static int	median_max_tracked = 64;
+
+static MedianTrackShared *median_track_shared = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void median_track_check(void);
+static Size median_track_shmem_size(void);
+static void median_track_shmem_startup(void);
+static MedianTrackedSketch *median_track_lookup(text *name, bool create);
+static int64 median_track_snapshot(MedianTrackedSketch *sketch, int64 *counts);
+
+PG_FUNCTION_INFO_V1(median_track);
+PG_FUNCTION_INFO_V1(median_tracked);
+PG_FUNCTION_INFO_V1(median_tracked_reset);
+PG_FUNCTION_INFO_V1(median_tracked_snapshot);
+
+
+/*
+ * median_track_init
+ *
+ * Define the GUC and, when preloaded, reserve the shared memory. Called from
+ * _PG_init.
+ */
+void
+median_track_init(void)
+{
+	DefineCustomIntVariable("median.max_tracked",
+							"Maximum number of sketches tracked by median_track().",
+							NULL,
+							&median_max_tracked,
+							64,
+							1, 65536,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(median_track_shmem_size());
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = median_track_shmem_startup;
+}
+
+/*
+ * median_track_shmem_size
+ *
+ * Size of the shared memory for median.max_tracked sketches.
+ */
+static Size
+median_track_shmem_size(void)
+{
+	return add_size(offsetof(MedianTrackShared, sketches),
+					mul_size(median_max_tracked, sizeof(MedianTrackedSketch)));
+}
+
+/*
+ * median_track_shmem_startup
+ *
+ * Allocate or attach to the shared memory.
+ */
+static void
+median_track_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	median_track_shared = ShmemInitStruct("median tracked sketches",
+										  median_track_shmem_size(), &found);
+	if (!found)
+	{
+		int			i;
+		int			j;
+
+		median_track_shared->nsketches = median_max_tracked;
+		for (i = 0; i < median_max_tracked; i++)
+		{
+			MedianTrackedSketch *sketch = &median_track_shared->sketches[i];
+
+			pg_atomic_init_u32(&sketch->status, MEDIAN_TRACK_FREE);
+			memset(sketch->name, 0, NAMEDATALEN);
+			for (j = 0; j < MEDIAN_SKETCH_SLOTS; j++)
+				pg_atomic_init_u64(&sketch->counts[j], 0);
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * median_track_check
+ *
+ * Complain if the shared memory is not there.
+ */
+static void
+median_track_check(void)
+{
+	if (median_track_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("median tracking requires \"median\" in shared_preload_libraries")));
+}
+
+/*
+ * median_track_lookup
+ *
+ * Find the sketch of the given name, creating it if asked to. Returns NULL if
+ * there is no such sketch and it should not or could not be created.
+ */
+static MedianTrackedSketch *
+median_track_lookup(text *name, bool create)
+{
+	char		key[NAMEDATALEN];
+	int			len = VARSIZE_ANY_EXHDR(name);
+	int			nsketches;
+	uint32		start;
+	int			i;
+
+	median_track_check();
+
+	if (len >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("tracked sketch name is too long"),
+				 errdetail("Names can be at most %d bytes long.",
+						   NAMEDATALEN - 1)));
+
+	memset(key, 0, NAMEDATALEN);
+	memcpy(key, VARDATA_ANY(name), len);
+
+	nsketches = median_track_shared->nsketches;
+	start = string_hash(key, NAMEDATALEN) % nsketches;
+
+	for (i = 0; i < nsketches; i++)
+	{
+		MedianTrackedSketch *sketch;
+		uint32		status;
+
+		sketch = &median_track_shared->sketches[(start + i) % nsketches];
+		status = pg_atomic_read_u32(&sketch->status);
+
+		if (status == MEDIAN_TRACK_FREE)
+		{
+			if (!create)
+				return NULL;
+
+			if (pg_atomic_compare_exchange_u32(&sketch->status, &status,
+											   MEDIAN_TRACK_INIT))
+			{
+				memcpy(sketch->name, key, NAMEDATALEN);
+				pg_write_barrier();
+				pg_atomic_write_u32(&sketch->status, MEDIAN_TRACK_READY);
+				return sketch;
+			}
+			/* Lost the race for this slot, status tells to whom */
+		}
+
+		/* Somebody is copying a name in, that takes no time */
+		while (status == MEDIAN_TRACK_INIT)
+		{
+			SPIN_DELAY();
+			status = pg_atomic_read_u32(&sketch->status);
+		}
+
+		pg_read_barrier();
+		if (strncmp(sketch->name, key, NAMEDATALEN) == 0)
+			return sketch;
+	}
+
+	if (create)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("too many tracked sketches"),
+				 errhint("Increase median.max_tracked.")));
+
+	return NULL;
+}
+
+/*
+ * median_track_snapshot
+ *
+ * Copy the counters of a sketch, returning their total. Concurrent updates
+ * may or may not be seen, but every counter is read atomically.
+ */
+static int64
+median_track_snapshot(MedianTrackedSketch *sketch, int64 *counts)
+{
+	int64		total = 0;
+	int			i;
+
+	for (i = 0; i < MEDIAN_SKETCH_SLOTS; i++)
+	{
+		counts[i] = (int64) pg_atomic_read_u64(&sketch->counts[i]);
+		total += counts[i];
+	}
+
+	return total;
+}
+
+/*
+ * median_track
+ *
+ * Count a value into the named sketch.
+ */
+Datum
+median_track(PG_FUNCTION_ARGS)
+{
+	MedianTrackedSketch *sketch = median_track_lookup(PG_GETARG_TEXT_PP(0), true);
+	int			slot = median_sketch_slot(PG_GETARG_FLOAT8(1));
+
+	if (slot < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot track NaN")));
+
+	pg_atomic_fetch_add_u64(&sketch->counts[slot], 1);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * median_tracked
+ *
+ * Estimate the value at a fraction of the named sketch, within 1%. Returns
+ * NULL for unknown or empty sketches.
+ */
+Datum
+median_tracked(PG_FUNCTION_ARGS)
+{
+	MedianTrackedSketch *sketch = median_track_lookup(PG_GETARG_TEXT_PP(0), false);
+	float8		fraction = PG_GETARG_FLOAT8(1);
+	int64	   *counts;
+	int64		total;
+	float8		result;
+
+	if (fraction < 0 || fraction > 1 || isnan(fraction))
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("fraction %g is out of range [0, 1]", fraction)));
+
+	if (sketch == NULL)
+		PG_RETURN_NULL();
+
+	counts = (int64 *) palloc(MEDIAN_SKETCH_SLOTS * sizeof(int64));
+	total = median_track_snapshot(sketch, counts);
+	if (total == 0)
+		PG_RETURN_NULL();
+
+	result = median_sketch_quantile(counts, total, fraction);
+	pfree(counts);
+
+	PG_RETURN_FLOAT8(result);
+}
+
+/*
+ * median_tracked_reset
+ *
+ * Zero the counters of the named sketch, or of all sketches if the name is
+ * NULL. Values tracked while resetting may or may not survive.
+ */
+Datum
+median_tracked_reset(PG_FUNCTION_ARGS)
+{
+	int			i;
+	int			j;
+
+	if (!PG_ARGISNULL(0))
+	{
+		MedianTrackedSketch *sketch;
+
+		sketch = median_track_lookup(PG_GETARG_TEXT_PP(0), false);
+		if (sketch != NULL)
+			for (j = 0; j < MEDIAN_SKETCH_SLOTS; j++)
+				pg_atomic_write_u64(&sketch->counts[j], 0);
+		PG_RETURN_VOID();
+	}
+
+	median_track_check();
+	for (i = 0; i < median_track_shared->nsketches; i++)
+	{
+		MedianTrackedSketch *sketch = &median_track_shared->sketches[i];
+
+		if (pg_atomic_read_u32(&sketch->status) != MEDIAN_TRACK_READY)
+			continue;
+		for (j = 0; j < MEDIAN_SKETCH_SLOTS; j++)
+			pg_atomic_write_u64(&sketch->counts[j], 0);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * median_tracked_snapshot
+ *
+ * Return the name, value count and common quantiles of all tracked sketches.
+ */
+Datum
+median_tracked_snapshot(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int64	   *counts;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	median_track_check();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	counts = (int64 *) palloc(MEDIAN_SKETCH_SLOTS * sizeof(int64));
+
+	for (i = 0; i < median_track_shared->nsketches; i++)
+	{
+		MedianTrackedSketch *sketch = &median_track_shared->sketches[i];
+		Datum		values[5];
+		bool		nulls[5];
+		int64		total;
+
+		if (pg_atomic_read_u32(&sketch->status) != MEDIAN_TRACK_READY)
+			continue;
+		pg_read_barrier();
+
+		total = median_track_snapshot(sketch, counts);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(sketch->name);
+		values[1] = Int64GetDatum(total);
+		if (total > 0)
+		{
+			values[2] = Float8GetDatum(median_sketch_quantile(counts, total, 0.5));
+			values[3] = Float8GetDatum(median_sketch_quantile(counts, total, 0.9));
+			values[4] = Float8GetDatum(median_sketch_quantile(counts, total, 0.99));
+		}
+		else
+			nulls[2] = nulls[3] = nulls[4] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(counts);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
@@ -116,3 +116,444 @@ INSERT INTO test_median (value) VALUES
 
 -- Test aggregate with all NULL values
 SELECT median(value) AS median_value FROM test_median WHERE value IS NULL;
+
+-- Huge-page backed state, forced by a low threshold
+SET median.hugepage_threshold = '1MB';
+SELECT median(i) FROM generate_series(1, 200001) AS t(i);
+RESET median.hugepage_threshold;
+
+-- Radix selection of by-value types
+SET median.finalize_threads = 4;
+SELECT median(val) FROM intvals;
+CREATE TABLE floatvals (val float8);
+INSERT INTO floatvals VALUES (-1.5), (2.5), ('-0'), (10), ('NaN');
+SELECT median(val) FROM floatvals;
+INSERT INTO floatvals VALUES (3);
+SELECT median(val) FROM floatvals;
+SELECT median(i::float8) FROM generate_series(1, 300000) AS t(i);
+SELECT median(i::int8) FROM generate_series(1, 300001) AS t(i);
+RESET median.finalize_threads;
+
+-- Selection shared with background workers
+SET median.finalize_workers = 2;
+SET median.finalize_workers_threshold = 1000;
+SELECT median(i::float8) FROM generate_series(1, 300000) AS t(i);
+SELECT median(i) FROM generate_series(1, 300001) AS t(i);
+RESET median.finalize_workers;
+RESET median.finalize_workers_threshold;
+
+-- EXPLAIN ANALYZE details
+CREATE FUNCTION median_explain_lines(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) ' || query
+    LOOP
+        IF line ~ 'Median|States|Strategy' THEN
+            RETURN NEXT line;
+        END IF;
+    END LOOP;
+END
+$$;
+SET median.enable_medianscan = off;
+SET median.explain = on;
+SELECT median_explain_lines('SELECT median(val) FROM intvals');
+SET median.finalize_threads = 1;
+SELECT median_explain_lines('SELECT median(val), median(color) FROM intvals');
+RESET median.finalize_threads;
+
+-- A nested EXPLAIN ANALYZE keeps the outer statistics
+SELECT median_explain_lines('SELECT median(val), (SELECT count(*) FROM median_explain_lines(''SELECT median(val) FROM intvals'')) FROM intvals');
+RESET median.explain;
+SELECT median_explain_lines('SELECT median(val) FROM intvals');
+RESET median.enable_medianscan;
+
+-- Tracked sketches need the library preloaded
+SELECT median_track('latency', 1.5);
+SELECT median_tracked('latency', 0.99);
+
+-- Registered columns
+CREATE TABLE regvals (val int4, name text);
+INSERT INTO regvals SELECT g, 'n' || g FROM generate_series(1, 99) g;
+SELECT median_register('regvals', 'val');
+SELECT median_register('regvals', 'name');
+SELECT median_registered('regvals', 'val'), median_registered('regvals', 'name');
+INSERT INTO regvals SELECT g, 'n' || g FROM generate_series(100, 199) g;
+SELECT median_registered('regvals', 'val');
+SELECT median_registry_refresh('regvals');
+SELECT median_registered('regvals', 'val'), median_registered('regvals', 'name');
+INSERT INTO regvals VALUES (NULL, 'n0');
+SELECT median_registered('regvals', 'name', '0');
+SELECT median_unregister('regvals', 'name');
+SELECT median_registered('regvals', 'name');
+SELECT median_register('regvals', 'nosuchcol');
+SET median.registry_max_state_size = 0;
+INSERT INTO regvals VALUES (200, 'n200'), (201, 'n201');
+SELECT median_registered('regvals', 'val', '0');
+SELECT state IS NULL AS unstored, median FROM median_registry
+WHERE relid = 'regvals'::regclass;
+INSERT INTO regvals VALUES (202, 'n202'), (203, 'n203');
+SELECT median_registered('regvals', 'val', '0');
+RESET median.registry_max_state_size;
+CREATE ROLE regress_median_registry_reader;
+GRANT SELECT ON regvals TO regress_median_registry_reader;
+ALTER TABLE regvals ENABLE ROW LEVEL SECURITY;
+SET ROLE regress_median_registry_reader;
+SELECT median_registered('regvals', 'val');
+SELECT median_register('regvals', 'name');
+RESET ROLE;
+ALTER TABLE regvals DISABLE ROW LEVEL SECURITY;
+SET ROLE regress_median_registry_reader;
+SELECT median_registered('regvals', 'val', '0');
+SELECT median FROM median_registry;
+RESET ROLE;
+REVOKE SELECT ON regvals FROM regress_median_registry_reader;
+DROP ROLE regress_median_registry_reader;
+
+-- Trigger-maintained order statistics
+CREATE TABLE ostatvals (val int4, note text);
+INSERT INTO ostatvals SELECT g % 37, 'x' FROM generate_series(1, 100) g;
+SELECT median_ostat_create('ostatvals', 'val', 4);
+SELECT median_of('ostatvals', 'val'), median(val) FROM ostatvals;
+INSERT INTO ostatvals SELECT g, 'y' FROM generate_series(100, 150) g;
+DELETE FROM ostatvals WHERE val < 10;
+UPDATE ostatvals SET val = val + 1000 WHERE val % 5 = 0;
+UPDATE ostatvals SET note = 'z';
+SELECT median_of('ostatvals', 'val'), median(val) FROM ostatvals;
+SELECT median_ostat_rebalance('ostatvals', 'val') > 0 AS rebalanced;
+SELECT median_of('ostatvals', 'val');
+INSERT INTO ostatvals SELECT -g, 'w' FROM generate_series(1, 60) g;
+SELECT median_of('ostatvals', 'val'), median(val) FROM ostatvals;
+CREATE ROLE regress_median_ostat_writer;
+GRANT SELECT, INSERT ON ostatvals TO regress_median_ostat_writer;
+SET ROLE regress_median_ostat_writer;
+INSERT INTO ostatvals VALUES (2000, 'v');
+SELECT median_of('ostatvals', 'val');
+SELECT median_ostat_rebalance('ostatvals', 'val');
+RESET ROLE;
+DROP OWNED BY regress_median_ostat_writer;
+DROP ROLE regress_median_ostat_writer;
+TRUNCATE ostatvals;
+SELECT median_of('ostatvals', 'val');
+SELECT median_ostat_drop('ostatvals', 'val');
+SELECT median_of('ostatvals', 'val');
+
+-- Cached partition states
+CREATE TABLE partvals (day int4, val float8) PARTITION BY RANGE (day);
+CREATE TABLE partvals_1 PARTITION OF partvals FOR VALUES FROM (1) TO (2);
+CREATE TABLE partvals_2 PARTITION OF partvals FOR VALUES FROM (2) TO (3);
+INSERT INTO partvals SELECT 1, g FROM generate_series(1, 100) g;
+INSERT INTO partvals SELECT 2, g FROM generate_series(101, 151) g;
+SELECT median_cached('partvals', 'val'), median(val) FROM partvals;
+SELECT partition, attname, atttypid FROM median_partition_cache ORDER BY 1;
+TRUNCATE partvals_2;
+INSERT INTO partvals SELECT 2, g FROM generate_series(101, 120) g;
+SELECT median_cached('partvals', 'val'), median(val) FROM partvals;
+BEGIN;
+INSERT INTO partvals SELECT 1, g FROM generate_series(1001, 1100) g;
+SELECT median_cached('partvals', 'val'), median(val) FROM partvals;
+ROLLBACK;
+SELECT median_cached('partvals', 'val'), median(val) FROM partvals;
+CREATE ROLE regress_median_partition_writer;
+GRANT SELECT, INSERT ON partvals TO regress_median_partition_writer;
+ALTER TABLE partvals_1 ENABLE ROW LEVEL SECURITY;
+SET ROLE regress_median_partition_writer;
+BEGIN;
+INSERT INTO partvals VALUES (1, 60.5);
+SELECT median_cached('partvals', 'val'), median(val) FROM partvals;
+ROLLBACK;
+SELECT count(*) FROM median_partition_cache;
+RESET ROLE;
+ALTER TABLE partvals_1 DISABLE ROW LEVEL SECURITY;
+DROP OWNED BY regress_median_partition_writer;
+DROP ROLE regress_median_partition_writer;
+SELECT median_state_value(median_state_merge(
+           median_state_agg(val) FILTER (WHERE day = 1),
+           median_state_agg(val) FILTER (WHERE day = 2)), NULL::float8)
+FROM partvals;
+SELECT median_state_value(median_state_agg(val), NULL::int4) FROM partvals;
+
+-- Data files
+COPY (SELECT g, g * 0.5, 'x,y' FROM generate_series(1, 1001) g)
+    TO '/tmp/median_file.csv' WITH (FORMAT csv, HEADER);
+COPY (SELECT g FROM generate_series(1, 1001) g) TO '/tmp/median_file.tsv';
+SELECT file_median('/tmp/median_file.csv', 2, 'csv', true);
+SELECT file_median('/tmp/median_file.tsv', 1, 'tsv');
+SELECT file_median('/tmp/median_file.csv', 3, 'csv', true);
+SELECT file_median('/tmp/median_file.csv', 4, 'csv', true);
+SELECT file_median('/tmp/median_file.csv', 1, 'json');
+
+-- Time buckets
+CREATE TABLE series (ts timestamptz, val float8);
+INSERT INTO series
+    SELECT '2024-01-01 00:00:00+00'::timestamptz + g * interval '10 minutes', g
+    FROM generate_series(0, 20) g;
+INSERT INTO series VALUES ('2024-01-01 01:30:00+00', NULL), (NULL, 1000);
+SET TimeZone = 'UTC';
+SELECT b.* FROM (SELECT bucketed_medians(ts, val, '1 hour' ORDER BY ts) AS bs
+                 FROM series) s, unnest(s.bs) b;
+SELECT bucketed_medians(ts, val, '1 day') FROM series WHERE val > 100;
+SELECT bucketed_medians(ts, val, '1 hour' ORDER BY ts DESC) FROM series;
+SELECT bucketed_medians(ts, val, '1 month') FROM series;
+RESET TimeZone;
+
+-- Equi-depth histograms
+SELECT equi_depth_histogram(g, 4) FROM generate_series(1, 100) g;
+SELECT equi_depth_histogram((g * 7919) % 1000, 10) FROM generate_series(1, 1000) g;
+SELECT equi_depth_histogram(chr(65 + g % 3), 2) FROM generate_series(1, 100) g;
+SELECT equi_depth_histogram(g, 4) FROM generate_series(1, 0) g;
+SELECT equi_depth_histogram(g, 0) FROM generate_series(1, 10) g;
+
+-- Ranks against sorted states
+CREATE TABLE baseline AS
+    SELECT median_state_sort(median_state_agg((g * 37) % 100 + 1)) AS state
+    FROM generate_series(1, 100) g;
+SELECT v.x, median_state_rank(b.state, v.x)
+FROM baseline b, (VALUES (0), (1), (50), (99), (100), (1000)) v(x);
+SELECT median_state_rank(median_state_sort(median_state_agg(chr(65 + g % 3))), 'B'::text)
+FROM generate_series(1, 100) g;
+SELECT median_state_rank(median_state_agg(g), 1) FROM generate_series(1, 10) g;
+SELECT median_state_rank(state, 1::int8) FROM baseline;
+SELECT median_state_rank(substr(state, 1, 36), 1) FROM baseline;
+SELECT median_state_rank(substr(s, 1, octet_length(s) - 2) || '\xffff'::bytea, 1.5)
+FROM (SELECT median_state_sort(median_state_agg(1.5)) AS s) t;
+CREATE TABLE array_baseline AS
+    SELECT median_state_sort(median_state_agg(ARRAY[g])) AS state
+    FROM generate_series(1, 10) g;
+CREATE ROLE regress_median_ranker;
+GRANT SELECT ON baseline, array_baseline TO regress_median_ranker;
+SET ROLE regress_median_ranker;
+SELECT median_state_rank(state, ARRAY[5]) FROM array_baseline;
+SELECT median_state_rank(state, 50) FROM baseline;
+RESET ROLE;
+DROP TABLE array_baseline;
+DROP OWNED BY regress_median_ranker;
+DROP ROLE regress_median_ranker;
+CREATE TABLE big_baseline (state bytea);
+ALTER TABLE big_baseline ALTER COLUMN state SET STORAGE EXTERNAL;
+INSERT INTO big_baseline
+    SELECT median_state_sort(median_state_agg(g)) FROM generate_series(1, 100000) g;
+SELECT v.x, median_state_rank(b.state, v.x)
+FROM big_baseline b, generate_series(0, 100000, 25000) v(x);
+DROP TABLE big_baseline;
+
+-- Expanded median_state values
+DO $$
+DECLARE
+    s median_state;
+    a median_state;
+    b median_state;
+    c median_state;
+BEGIN
+    FOR i IN 1..1000 LOOP
+        s := median_state_add(s, i);
+        IF i % 250 = 0 THEN
+            RAISE NOTICE 'median of % values: %', i, median_state_result(s);
+        END IF;
+    END LOOP;
+    RAISE NOTICE 'as bytea: %', median_state_value(s::bytea, NULL::int4);
+    a := median_state_add(NULL, 1.5);
+    b := median_state_add(a, 2.5);
+    c := median_state_add(a, 10.5);
+    RAISE NOTICE 'a: %, b: %, c: %', median_state_result(a),
+        median_state_result(b), median_state_result(c);
+END
+$$;
+WITH s AS (SELECT median_state_agg(g)::median_state AS st
+           FROM generate_series(1, 9) g)
+SELECT median_state_result(median_state_add(st, 100)) AS up,
+       median_state_result(median_state_add(st, -100)) AS down,
+       median_state_result(st) AS orig
+FROM s;
+SELECT median_state_result(median_state_add(median_state_add(NULL, 'x'::text), 1));
+SELECT '\x0000'::median_state;
+SELECT median_state_result('\x0000'::bytea::median_state);
+SELECT (substr(s, 1, octet_length(s) - 2) || '\xffff'::bytea)::median_state
+FROM (SELECT median_state_agg(1.5) AS s) t;
+
+-- Portable state export
+SELECT median_state_value(median_state_import(median_state_export(median_state_agg(g))),
+                          NULL::int4)
+FROM generate_series(1, 11) g;
+SELECT median_state_value(median_state_merge(
+           median_state_import(median_state_export(median_state_agg(g::text))),
+           median_state_agg(g::text)), NULL::text)
+FROM generate_series(1, 5) g;
+SELECT substr(median_state_export(median_state_agg(g::numeric)), 1, 5)
+FROM generate_series(1, 3) g;
+SELECT median_state_value(median_state_import(median_state_export(median_state_agg(g::numeric))),
+                          NULL::numeric)
+FROM generate_series(1, 4) g;
+SELECT median_state_import('\x0000000000');
+SELECT median_state_import('\x4d45445302');
+
+-- Approximate medians
+SELECT abs(approx_median(g) - 501) / 501 < 0.01 AS within_1pct
+FROM generate_series(1, 1001) g;
+SELECT approx_median(g) FROM generate_series(1, 0) g;
+SELECT count(*), bool_and(abs(a - m) <= 0.0101 * m) AS within_1pct
+FROM (SELECT approx_median(v) OVER w AS a, median(v) OVER w AS m,
+             count(*) OVER w AS n
+      FROM (SELECT g, (g * 7919 % 1000) + 1::float8 AS v
+            FROM generate_series(1, 2000) g) s
+      WINDOW w AS (ORDER BY g ROWS BETWEEN 100 PRECEDING AND CURRENT ROW)) w
+WHERE n = 101;
+
+-- Median confidence intervals
+SELECT median_ci(g, 0.95) FROM generate_series(1, 100) g;
+SELECT median_ci((g * 7919) % 1000 + 1, 0.99) FROM generate_series(1, 1000) g;
+SELECT median_ci(g::numeric, 0.9) FROM generate_series(1, 11) g;
+SELECT median_ci(g, 0.95) FROM generate_series(1, 5) g;
+SELECT median_ci(g, 1) FROM generate_series(1, 5) g;
+
+-- Compact serialized states
+SELECT octet_length(median_state_agg(g)) AS small FROM generate_series(1, 3) g;
+SELECT octet_length(median_state_agg(g)) AS large FROM generate_series(1, 300) g;
+SELECT median_state_value(median_state_merge(median_state_agg(g::int2 - 2::int2),
+                                             median_state_agg(g::int2)), NULL::int2) AS median
+FROM generate_series(1, 3) g;
+SELECT median_state_value(median_state_merge(median_state_agg(repeat(chr(64 + g), g * 40)),
+                                             median_state_agg(chr(64 + g))), NULL::text) AS median
+FROM generate_series(1, 5) g;
+SELECT median_state_value(median_state_merge(median_state_agg(g * interval '1 hour'),
+                                             median_state_agg(g * interval '1 day')),
+                          NULL::interval) AS median
+FROM generate_series(1, 3) g;
+SELECT median_state_value(median_state_agg(g * 0.25), NULL::numeric) AS median
+FROM generate_series(1, 301) g;
+
+-- Malformed serialized states
+SELECT median_state_value(substr(median_state_agg(g), 1, 7), NULL::int4)
+FROM generate_series(1, 5) g;
+SELECT median_state_value(substr(median_state_agg(g), 1, 9), NULL::int4)
+FROM generate_series(1, 5) g;
+SELECT median_state_value(median_state_agg(g) || '\x00'::bytea, NULL::int4)
+FROM generate_series(1, 5) g;
+SELECT median_state_value('\x0000000000ffffffff', NULL::int4);
+SELECT median_state_value(substr(median_state_agg(v), 1, 9) || '\x01'::bytea, NULL::text)
+FROM (VALUES ('abc'::text)) t(v);
+SELECT median_state_value(substr(s, 1, octet_length(s) - 2) || '\xffff'::bytea, NULL::numeric)
+FROM (SELECT median_state_agg(1.5) AS s) t;
+CREATE TABLE forged_states AS
+    SELECT median_state_agg(ARRAY[g, g]) AS arrays, median_state_agg(g) AS ints
+    FROM generate_series(1, 5) g;
+CREATE ROLE regress_median_forger;
+GRANT SELECT ON forged_states TO regress_median_forger;
+SET ROLE regress_median_forger;
+SELECT median_state_value(arrays, NULL::int4[]) FROM forged_states;
+SELECT median_state_value(ints, NULL::int4) FROM forged_states;
+RESET ROLE;
+DROP TABLE forged_states;
+DROP ROLE regress_median_forger;
+
+-- Text slots
+SELECT median(v) FROM (VALUES ('b'), ('a'), ('abcdefghijklmnopq'), ('abcdefghijklmnopz'),
+                              ('abcd'), ('abcdefghijkl'), ('abcdefghijklm')) t(v);
+SELECT median_state_value(median_state_merge(median_state_agg(repeat('x', g)),
+                                             median_state_agg(repeat('y', g))), NULL::text) AS median
+FROM generate_series(1, 20) g;
+SELECT g, median(chr(96 + g) || repeat('-', g * 5))
+    OVER (ORDER BY g ROWS BETWEEN 1 PRECEDING AND 1 FOLLOWING)
+FROM generate_series(1, 5) g;
+
+-- Sampled medians
+CREATE TABLE sample_data AS
+    SELECT (g * 7919) % 100000 + 1 AS val FROM generate_series(1, 100000) g;
+SELECT median, lower, upper, sampled_blocks = total_blocks AS all_blocks, sampled_rows
+FROM sampled_median('sample_data', 'val', 100);
+SELECT sampled_blocks = ceil(total_blocks * 0.1) AS blocks_ok,
+       lower::int <= median::int AND median::int <= upper::int AS ordered,
+       sampled_rows > 0 AS rows_ok
+FROM sampled_median('sample_data', 'val', 10);
+SELECT * FROM sampled_median('sample_data', 'val', 0);
+CREATE ROLE regress_median_sampler;
+GRANT SELECT ON sample_data TO regress_median_sampler;
+ALTER TABLE sample_data ENABLE ROW LEVEL SECURITY;
+SET ROLE regress_median_sampler;
+SELECT * FROM sampled_median('sample_data', 'val', 100);
+RESET ROLE;
+ALTER TABLE sample_data DISABLE ROW LEVEL SECURITY;
+REVOKE SELECT ON sample_data FROM regress_median_sampler;
+DROP ROLE regress_median_sampler;
+
+-- Moving medians
+SELECT g, median((g * 3) % 7)
+    OVER (ORDER BY g ROWS BETWEEN 2 PRECEDING AND CURRENT ROW)
+FROM generate_series(1, 6) g;
+
+-- State memory
+SELECT (f).value_count, (f).value_bytes,
+       (f).total_bytes = (f).state_bytes + (f).array_bytes + (f).value_bytes AS sums,
+       (f).slack_bytes >= 0 AS slack_ok
+FROM (SELECT median_footprint(g) AS f FROM generate_series(1, 100) g) s;
+SELECT (f).value_count, (f).value_bytes = 0 AS all_inline,
+       (f).array_bytes >= 100 * 16 AS slots
+FROM (SELECT median_footprint('code' || g % 10) AS f FROM generate_series(1, 100) g) s;
+SELECT (median_footprint(repeat('x', 100) || g)).value_bytes >= 100 * 101 AS text_copied
+FROM generate_series(1, 100) g;
+
+-- Medians of arrays
+SELECT median_chunks(a) FROM (VALUES (ARRAY[5, 1, 9]::int8[]), (ARRAY[3, 7]::int8[]), (NULL)) t(a);
+SELECT median_chunks(a) FROM (VALUES (ARRAY[4, NULL, 2]), (ARRAY[8, 6]), ('{}')) t(a);
+SELECT median_chunks(a) FROM (VALUES (ARRAY['pear', 'apple']), (ARRAY['fig', repeat('z', 20)])) t(a);
+SELECT median_chunks(a)
+FROM (SELECT array_agg(g::float8) AS a FROM generate_series(1, 10001) g GROUP BY g % 7) s;
+
+-- Copies of by-reference values
+SELECT (median_footprint(g::numeric)).value_bytes > 0 AS numeric_copied
+FROM generate_series(1, 100) g;
+SELECT g, median(((g * 3) % 7)::numeric)
+    OVER (ORDER BY g ROWS BETWEEN 2 PRECEDING AND CURRENT ROW)
+FROM generate_series(1, 6) g;
+
+-- Sliding windows over long strings
+WITH d AS (SELECT g, repeat(md5(g::text), 4) AS v FROM generate_series(1, 2000) g)
+SELECT count(*),
+       bool_and(w.m = (SELECT median(v) FROM d WHERE d.g BETWEEN w.g - 10 AND w.g)) AS matches
+FROM (SELECT g, median(v) OVER (ORDER BY g ROWS BETWEEN 10 PRECEDING AND CURRENT ROW) AS m
+      FROM d) w;
+
+-- Sorted arrays
+SELECT sorted_array_agg(x) FROM (VALUES (3), (1), (NULL), (2), (1)) t(x);
+SELECT sorted_array_agg(x) FROM (VALUES ('pear'), ('apple'), (NULL), ('fig')) t(x);
+SELECT sorted_array_agg(x) FROM (VALUES (NULL::int)) t(x);
+CREATE TABLE sortvals AS SELECT (g * 7919) % 10007 AS v FROM generate_series(1, 50000) g;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 4;
+SELECT s = a AS same, cardinality(s)
+FROM (SELECT sorted_array_agg(v) AS s FROM sortvals) x,
+     (SELECT array_agg(v ORDER BY v) AS a FROM sortvals) y;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+
+-- Median scans
+CREATE TABLE scanvals AS
+SELECT g AS id, CASE WHEN g % 100 <> 0 THEN (g * 7919) % 10007 END AS v,
+       (((g * 31) % 1001) / 8.0)::float8 AS f
+FROM generate_series(1, 10000) g;
+ANALYZE scanvals;
+EXPLAIN (COSTS OFF) SELECT median(v) FROM scanvals WHERE id > 100;
+SELECT median(v) FROM scanvals WHERE id > 100;
+SELECT median(f) FROM scanvals WHERE id % 3 = 0;
+SELECT median(v) FROM scanvals WHERE id < 0;
+CREATE MATERIALIZED VIEW scanview AS SELECT v FROM scanvals WITH NO DATA;
+SELECT median(v) FROM scanview;
+REFRESH MATERIALIZED VIEW scanview;
+ANALYZE scanview;
+EXPLAIN (COSTS OFF) SELECT median(v) FROM scanview;
+SELECT median(v) FROM scanview;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 4;
+EXPLAIN (COSTS OFF) SELECT median(v) FROM scanvals;
+SELECT median(v) FROM scanvals;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;